@@ -0,0 +1,146 @@
+#define _POSIX_C_SOURCE 200809L
+// Microbenchmark of the command-line tokenizer, printed as a JSON object.
+// Compares the single-pass lexer (lex_line) against the previous path:
+// strtok_r on spaces plus copy_and_expand_dollar into a calloc'd buffer per
+// token. Also times the lines of a compiled script, which are split once and
+// only have their words with a '$' expanded on each run (lex_split and
+// lex_expand_tokens, see smallsh_script.c). Build with: ./compile.sh bench
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../smallsh_funcs.h"
+#include "../smallsh_arena.h"
+#include "../smallsh_lex.h"
+
+// A line of NUM_WORDS words, one in DOLLAR_EVERY holding several "$$"
+struct bench_line
+{
+    const char *name;
+    int num_words;
+    int dollar_every;
+};
+
+/*  Returns the current time of the monotonic clock in nanoseconds.
+ */
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*  Returns a newly allocated line built as described by SPEC.
+ */
+static char *make_line(const struct bench_line *spec)
+{
+    char *line = calloc(1, (size_t)spec->num_words * 32 + 1);
+    for (int i = 0; i < spec->num_words; i++)
+    {
+        if (i > 0)
+            strcat(line, " ");
+        if (spec->dollar_every && i % spec->dollar_every == 0)
+            strcat(line, "dir$$/file$$.$$.tmp");
+        else
+            strcat(line, "argument");
+    }
+    return line;
+}
+
+/*  Tokenizes LINE the way the shell did before the lexer: strtok_r on a
+    copy of the line, then copy_and_expand_dollar into a calloc'd buffer for
+    each token, all freed afterwards. Returns the number of tokens.
+ */
+static int old_path(const char *line, char *work, char **args)
+{
+    strcpy(work, line);
+    int num_args = 0;
+    char *saveptr = NULL;
+    for (char *token = strtok_r(work, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr))
+    {
+        // Sized for pids of up to 8 digits
+        args[num_args] = calloc(1, 4 * strlen(token) + 1);
+        copy_and_expand_dollar(args[num_args], token);
+        num_args++;
+    }
+    for (int i = 0; i < num_args; i++)
+        free(args[i]);
+    return num_args;
+}
+
+int main(int argc, char **argv)
+{
+    const struct bench_line specs[] = {
+        {"short, no $$", 8, 0},
+        {"short, $$-heavy", 8, 1},
+        {"long, no $$", 2000, 0},
+        {"long, $$ every 4th word", 2000, 4},
+        {"long, $$-heavy", 2000, 1},
+    };
+    long iterations = argc > 1 ? atol(argv[1]) : 2000;
+
+    lex_init();
+    struct arena arena, split_arena;
+    arena_init(&arena, 16384);
+    arena_init(&split_arena, 16384);
+
+    printf("{\n  \"lexer\": [\n");
+    size_t num_specs = sizeof(specs) / sizeof(specs[0]);
+    for (size_t s = 0; s < num_specs; s++)
+    {
+        char *line = make_line(&specs[s]);
+        size_t len = strlen(line);
+        char *work = malloc(len + 1);
+        char **args = malloc(sizeof(char *) * (len / 2 + 2));
+        long scale = specs[s].num_words < 100 ? 100 : 1;
+        long n = iterations * scale;
+
+        int old_tokens = 0, new_tokens = 0;
+        double start = now_ns();
+        for (long i = 0; i < n; i++)
+            old_tokens = old_path(line, work, args);
+        double old_ns = (now_ns() - start) / n;
+
+        start = now_ns();
+        for (long i = 0; i < n; i++)
+        {
+            struct token *tokens;
+            arena_reset(&arena);
+            new_tokens = lex_line(&arena, line, len, &tokens);
+        }
+        double new_ns = (now_ns() - start) / n;
+
+        arena_reset(&split_arena);
+        struct token *split;
+        int num_split = lex_split(&split_arena, line, len, &split);
+        int compiled_tokens = 0;
+        start = now_ns();
+        for (long i = 0; i < n; i++)
+        {
+            arena_reset(&arena);
+            struct token *tokens = arena_alloc(&arena, (num_split + 1) * sizeof(struct token));
+            memcpy(tokens, split, num_split * sizeof(struct token));
+            compiled_tokens = lex_expand_tokens(&arena, tokens, num_split);
+        }
+        double compiled_ns = (now_ns() - start) / n;
+
+        if (old_tokens != new_tokens || compiled_tokens != new_tokens)
+            fprintf(stderr, "%s: token count mismatch (%d vs %d vs %d)\n", specs[s].name,
+                    old_tokens, new_tokens, compiled_tokens);
+
+        // Bytes per nanosecond is GB/s; the JSON reports MB/s
+        printf("    {\"line\": \"%s\", \"bytes\": %zu, \"tokens\": %d, "
+               "\"old_ns\": %.0f, \"lex_ns\": %.0f, \"compiled_ns\": %.0f, \"speedup\": %.2f, "
+               "\"old_mb_per_s\": %.1f, \"lex_mb_per_s\": %.1f}%s\n",
+               specs[s].name, len, new_tokens, old_ns, new_ns, compiled_ns, old_ns / new_ns,
+               len / old_ns * 1e3, len / new_ns * 1e3, s + 1 < num_specs ? "," : "");
+        free(line);
+        free(work);
+        free(args);
+    }
+    printf("  ]\n}\n");
+
+    arena_destroy(&arena);
+    arena_destroy(&split_arena);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+// posix_spawn, wait4, mkstemp
+// Benchmarks of the shell's process hot paths, printed as one JSON object:
+//   spawn    latency of spawn_process() from launch to reaped exit of
+//            /bin/true, for each launch engine
+//   reap     cost of the prompt's background check and of reaping one child
+//            through the event loop and job table, as a function of the
+//            number of live background jobs
+//   scripts  end-to-end runtime of the smallsh binary on generated scripts
+// Build with: ./compile.sh bench
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../smallsh.h"
+#include "../smallsh_spawn.h"
+#include "../smallsh_events.h"
+#include "../smallsh_jobs.h"
+
+extern char **environ;
+
+// Numbers of live background jobs the reap benchmark is run with
+static const int reap_job_counts[] = {1, 16, 128, 1024};
+
+// A generated script: BODY repeated REPEAT times
+struct bench_script
+{
+    const char *name;
+    const char *body;
+    int repeat;
+};
+
+static const struct bench_script scripts[] = {
+    // Per-line overhead of the shell itself: no child processes
+    {"builtins", "status\n# comment\n\ncd .\n", 5000},
+    // One spawn per line. A path, so the in-process true is not used.
+    {"spawn", "/bin/true\n", 1000},
+    // Mix of the commands run by p3testscript
+    {"p3mix",
+     "ls\nls > junk\nstatus\ncat junk\nwc < junk\nwc < junk > junk2\n"
+     "test -f badfile\nstatus\necho $$\nsleep 0 &\ncd .\npwd\n"
+     "ls | wc -l\n", 100},
+};
+
+/*  Returns the current time of the monotonic clock in nanoseconds.
+ */
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*  Prints the JSON object for the spawn latencies of ENGINE in the N
+    samples of SAMPLES, which are sorted.
+ */
+static void print_latencies(const char *engine, double *samples, int n)
+{
+    qsort(samples, n, sizeof(double), compare_double);
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += samples[i];
+    printf("    {\"engine\": \"%s\", \"iterations\": %d, \"min_ns\": %.0f, "
+           "\"median_ns\": %.0f, \"p99_ns\": %.0f, \"mean_ns\": %.0f}",
+           engine, n, samples[0], samples[n / 2], samples[(int)(n * 0.99)], sum / n);
+}
+
+/*  Measures ITERATIONS launches of /bin/true with each launch engine, from
+    the call to spawn_process() until waitpid() returns its exit.
+ */
+static void bench_spawn(int iterations)
+{
+    char *args[] = {"true", NULL};
+    struct user_input stage = {0};
+    stage.cmd = args[0];
+    stage.cmd_args = args;
+    stage.num_cmd_args = 1;
+
+    const enum spawn_mode modes[] = {SPAWN_POSIX, SPAWN_FORK};
+    double *samples = malloc(iterations * sizeof(double));
+
+    printf("  \"spawn\": [\n");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        spawn_mode = modes[m];
+        for (int i = 0; i < iterations; i++)
+        {
+            double start = now_ns();
+            pid_t pid = spawn_process(&stage, -1, -1, SPAWN_BG, -1);
+            if (pid == -1)
+                exit(EXIT_FAILURE);
+            int status;
+            waitpid(pid, &status, 0);
+            samples[i] = now_ns() - start;
+        }
+        print_latencies(spawn_mode_name(), samples, iterations);
+        printf(m + 1 < sizeof(modes) / sizeof(modes[0]) ? ",\n" : "\n");
+    }
+    printf("  ],\n");
+
+    spawn_mode = SPAWN_POSIX;
+    free(samples);
+}
+
+/*  Measures, with NUM_JOBS live background jobs: the cost of one background
+    check as made before each prompt when no child has changed state, and the
+    cost per child of reaping all of them (ev_reap, job lookup, update and
+    removal) once they have all terminated.
+ */
+static void bench_reap_jobs(int num_jobs)
+{
+    char *args[] = {"sleep", "1000", NULL};
+    struct user_input stage = {0};
+    stage.cmd = args[0];
+    stage.cmd_args = args;
+    stage.num_cmd_args = 2;
+
+    pid_t *pids = malloc(num_jobs * sizeof(pid_t));
+    for (int i = 0; i < num_jobs; i++)
+    {
+        pids[i] = spawn_process(&stage, -1, -1, SPAWN_BG, -1);
+        if (pids[i] == -1)
+            exit(EXIT_FAILURE);
+        job_add(&pids[i], 1, 0, "sleep 1000 &", 1);
+    }
+
+    // Background check with nothing to report
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    while (ev_reap(&pid, &status, NULL, 0) == 1)
+        ;
+    int checks = 100000;
+    double start = now_ns();
+    for (int i = 0; i < checks; i++)
+        ev_reap(&pid, &status, NULL, 0);
+    double check_ns = (now_ns() - start) / checks;
+
+    // Terminate every job, and let them all become zombies before timing
+    for (int i = 0; i < num_jobs; i++)
+        kill(pids[i], SIGKILL);
+    for (int i = 0; i < num_jobs; i++)
+    {
+        siginfo_t info;
+        waitid(P_PID, pids[i], &info, WEXITED | WNOWAIT);
+    }
+
+    int reaped = 0;
+    start = now_ns();
+    while (reaped < num_jobs && ev_reap(&pid, &status, &usage, 1) == 1)
+    {
+        struct job *job = job_find_pid(pid);
+        if (job && job_update(job, pid, status, &usage) && job->state == JOB_DONE)
+        {
+            job_remove(job);
+            reaped++;
+        }
+    }
+    double reap_ns = (now_ns() - start) / num_jobs;
+
+    printf("    {\"jobs\": %d, \"idle_check_ns\": %.1f, \"reap_ns_per_child\": %.0f}",
+           num_jobs, check_ns, reap_ns);
+    free(pids);
+}
+
+static void bench_reap(void)
+{
+    printf("  \"reap\": [\n");
+    int n = sizeof(reap_job_counts) / sizeof(reap_job_counts[0]);
+    for (int i = 0; i < n; i++)
+    {
+        bench_reap_jobs(reap_job_counts[i]);
+        printf(i + 1 < n ? ",\n" : "\n");
+    }
+    printf("  ],\n");
+}
+
+/*  Writes SCRIPT to a new temporary file, running in DIR, and returns its
+    path, or NULL.
+ */
+static char *write_script(const struct bench_script *script, const char *dir)
+{
+    char *path = strdup("/tmp/smallsh_bench_XXXXXX");
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        perror("mkstemp()");
+        free(path);
+        return NULL;
+    }
+    FILE *file = fdopen(fd, "w");
+    fprintf(file, "cd %s\n", dir);
+    for (int i = 0; i < script->repeat; i++)
+        fputs(script->body, file);
+    fclose(file);
+    return path;
+}
+
+/*  Runs SHELL on each generated script RUNS times, and reports the best and
+    mean wall time of a run, and the mean CPU time of the shell and its
+    children.
+ */
+static void bench_scripts(const char *shell, int runs)
+{
+    char dir[] = "/tmp/smallsh_bench_dir_XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp()");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("  \"scripts\": [\n");
+    int n = sizeof(scripts) / sizeof(scripts[0]);
+    for (int s = 0; s < n; s++)
+    {
+        char *path = write_script(&scripts[s], dir);
+        if (path == NULL)
+            exit(EXIT_FAILURE);
+        int lines = 1;
+        for (const char *p = scripts[s].body; *p; p++)
+            lines += (*p == '\n') * scripts[s].repeat;
+
+        double best = 0, total = 0, user = 0, sys = 0;
+        int failed = 0;
+        for (int r = 0; r < runs; r++)
+        {
+            // Output is discarded, so only the shell's work is measured
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init(&actions);
+            posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+            posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+            char *args[] = {(char *)shell, path, NULL};
+
+            double start = now_ns();
+            pid_t pid;
+            int result = posix_spawn(&pid, shell, &actions, NULL, args, environ);
+            posix_spawn_file_actions_destroy(&actions);
+            if (result != 0)
+            {
+                fprintf(stderr, "posix_spawn(): %s: %s\n", shell, strerror(result));
+                exit(EXIT_FAILURE);
+            }
+            int status;
+            struct rusage usage;
+            wait4(pid, &status, 0, &usage);
+            double elapsed = now_ns() - start;
+            if (!WIFEXITED(status))
+                failed++;
+
+            total += elapsed;
+            if (r == 0 || elapsed < best)
+                best = elapsed;
+            user += usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3;
+            sys += usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+        }
+
+        printf("    {\"name\": \"%s\", \"lines\": %d, \"runs\": %d, \"failed_runs\": %d, "
+               "\"best_ms\": %.2f, \"mean_ms\": %.2f, \"us_per_line\": %.2f, "
+               "\"user_ms\": %.2f, \"sys_ms\": %.2f}%s\n",
+               scripts[s].name, lines, runs, failed, best / 1e6, total / runs / 1e6,
+               best / 1e3 / lines, user / runs, sys / runs, s + 1 < n ? "," : "");
+        unlink(path);
+        free(path);
+    }
+    printf("  ]\n");
+
+    // Remove the files left by the scripts
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0)
+        fprintf(stderr, "could not remove %s\n", dir);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 2000;
+    int runs = 3;
+    const char *shell = "./smallsh";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 's':
+            shell = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n spawn_iterations] [-r script_runs] [-s shell]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (iterations < 1 || runs < 1)
+    {
+        fprintf(stderr, "%s: iterations and runs must be positive\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("{\n");
+    bench_spawn(iterations);
+
+    // Reaping goes through the signalfd event loop, as in the shell
+    if (ev_init() == -1)
+        return EXIT_FAILURE;
+    bench_reap();
+
+    bench_scripts(shell, runs);
+    printf("}\n");
+    return EXIT_SUCCESS;
+}
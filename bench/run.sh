@@ -0,0 +1,21 @@
+# Builds the optimized shell and the benchmarks, runs them all and writes the
+# combined results as JSON, tagged with the git revision, to
+# bench/results-<revision>.json (or to the file given as the first argument).
+#   bash bench/run.sh [output.json]
+
+cd "$(dirname "$0")/.." || exit 1
+bash compile.sh bench || exit 1
+
+revision=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+output=${1:-bench/results-$revision.json}
+
+{
+    printf '{\n"revision": "%s",\n"date": "%s",\n' "$revision" "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    printf '"bench_lex": '
+    ./bench_lex || exit 1
+    printf ',\n"bench_shell": '
+    ./bench_shell -s ./smallsh || exit 1
+    printf '}\n'
+} > "$output" || exit 1
+
+echo "results written to $output"
@@ -1,3 +1,19 @@
 # Script to compile smallsh for assignment 3.
+#   ./compile.sh           debug build (-O0 -g3)
+#   ./compile.sh release   optimized build (-O2)
+#   ./compile.sh bench     optimized build plus the benchmarks in bench/
 
-gcc -std=c11 -Wall -Werror -g3 -O0 smallsh.c smallsh_funcs.c -o smallsh
+SOURCES="smallsh.c smallsh_funcs.c smallsh_spawn.c smallsh_pathcache.c smallsh_events.c smallsh_jobs.c smallsh_arena.c smallsh_lex.c smallsh_input.c smallsh_parallel.c smallsh_stats.c smallsh_trace.c smallsh_zygote.c smallsh_serve.c smallsh_builtins.c smallsh_history.c smallsh_controls.c smallsh_glob.c smallsh_vars.c smallsh_cache.c smallsh_script.c"
+
+CFLAGS="-std=c11 -Wall -Werror -g3 -O0"
+if [ "$1" = "release" ] || [ "$1" = "bench" ]; then
+    CFLAGS="-std=c11 -Wall -Werror -g -O2 -DNDEBUG"
+fi
+
+gcc $CFLAGS $SOURCES -o smallsh || exit 1
+
+# Benchmarks, run by bench/run.sh
+if [ "$1" = "bench" ]; then
+    gcc $CFLAGS bench/bench_lex.c smallsh_lex.c smallsh_glob.c smallsh_vars.c smallsh_arena.c smallsh_funcs.c -o bench_lex || exit 1
+    gcc $CFLAGS bench/bench_shell.c smallsh_spawn.c smallsh_pathcache.c smallsh_events.c smallsh_jobs.c smallsh_stats.c smallsh_trace.c smallsh_zygote.c smallsh_controls.c smallsh_arena.c -o bench_shell || exit 1
+fi
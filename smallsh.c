@@ -4,16 +4,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "smallsh.h"
 #include "smallsh_funcs.h"
+#include "smallsh_spawn.h"
+#include "smallsh_pathcache.h"
+#include "smallsh_events.h"
+#include "smallsh_jobs.h"
+#include "smallsh_arena.h"
+#include "smallsh_lex.h"
+#include "smallsh_input.h"
+#include "smallsh_parallel.h"
+#include "smallsh_stats.h"
+#include "smallsh_trace.h"
+#include "smallsh_serve.h"
+#include "smallsh_builtins.h"
+#include "smallsh_history.h"
+#include "smallsh_controls.h"
+#include "smallsh_glob.h"
+#include "smallsh_vars.h"
+#include "smallsh_cache.h"
+#include "smallsh_script.h"
 
 #define REDIRI_SYM "<"
 #define REDIRO_SYM ">"
 #define BG_SYM "&"
-#define MAX_ARGS 512
+#define PIPE_SYM "|"
 
 #define DEBUGINPUT 0
 #define DEBUG1 0
@@ -23,6 +46,20 @@
 /* GLOBAL VARIABLES */
 int _fg_only_mode = 0;  // Specifies shell mode. 0: normal. !0: fg-only mode.
 
+// Exit status of the most recent foreground process termination, and the
+// status of each stage if it was a pipeline
+static int fg_status = 0;
+static int fg_num_stages = 0;
+static int *fg_stage_statuses = NULL;
+
+// Wall time and resource usage (of all stages) of the most recent
+// foreground job
+static struct timespec fg_wall = {0};
+static struct rusage fg_usage = {0};
+
+// Set by -e: the shell exits when a foreground command fails
+static int exit_on_error = 0;
+
 /*  SIGTSTP HANDLER
     Changes a global variable that toggles to the shell to a state where all
     commands are run in the foreground, regardless of an input background
@@ -46,26 +83,438 @@ void handle_SIGTERM(int signum)
         exit(EXIT_FAILURE);
 }
 
-/*  SIGCHLD HANDLER
-    Unpauses execution
+/*  Returns the command line rebuilt from the parsed pipeline USER_INPUT, as
+    shown by the jobs command, allocated from ARENA.
+*/
+char *build_cmd_line(struct arena *arena, struct user_input *user_input)
+{
+    size_t len = 3;
+    for (struct user_input *stage = user_input; stage; stage = stage->next)
+    {
+        for (int i = 0; i < stage->num_cmd_args; i++)
+            len += strlen(stage->cmd_args[i]) + 1;
+        if (stage->input_file)
+            len += strlen(stage->input_file) + 3;
+        if (stage->output_file)
+            len += strlen(stage->output_file) + 3;
+        len += 2;
+    }
+
+    char *cmd_line = arena_calloc(arena, len);
+    for (struct user_input *stage = user_input; stage; stage = stage->next)
+    {
+        for (int i = 0; i < stage->num_cmd_args; i++)
+        {
+            strcat(cmd_line, stage->cmd_args[i]);
+            strcat(cmd_line, " ");
+        }
+        if (stage->input_file)
+        {
+            strcat(cmd_line, "< ");
+            strcat(cmd_line, stage->input_file);
+            strcat(cmd_line, " ");
+        }
+        if (stage->output_file)
+        {
+            strcat(cmd_line, "> ");
+            strcat(cmd_line, stage->output_file);
+            strcat(cmd_line, " ");
+        }
+        if (stage->next)
+            strcat(cmd_line, "| ");
+    }
+    if (user_input->bg_process)
+        strcat(cmd_line, "&");
+    else
+        cmd_line[strlen(cmd_line) - 1] = '\0';
+    return cmd_line;
+}
+
+/*  Records in the run histogram the time from the launch of JOB until now.
+*/
+void record_run_time(struct job *job)
+{
+    uint64_t start = (uint64_t)job->start_time.tv_sec * 1000000000u + (uint64_t)job->start_time.tv_nsec;
+    stats_record(STAT_RUN, start);
+}
+
+/*  Prints that process PID of background job JOB has changed state to the
+    wait status STATUS. Once every process of the job has terminated and been
+    reported, the job is removed.
+*/
+void report_background(struct job *job, pid_t pid, int status)
+{
+    if (WIFSTOPPED(status))
+    {
+        printf("background pid %d is stopped by signal %d\n", pid, WSTOPSIG(status));
+    }
+    else if (WIFEXITED(status) || WIFSIGNALED(status))
+    {
+        printf("background pid %d is done: ", pid);
+        // Process changed state. See if it terminated.
+        if (WIFEXITED(status))
+        {
+            printf("exit value %d\n", WEXITSTATUS(status));
+        }
+        else if (WIFSIGNALED(status))
+        {
+            printf("terminated by signal %d\n", WTERMSIG(status));
+        }
+        // Time from reaping the process to this report
+        for (int i = 0; i < job->num_procs; i++)
+        {
+            if (job->procs[i].pid == pid && job->procs[i].end_ns)
+                stats_record(STAT_NOTIFY, job->procs[i].end_ns);
+        }
+        job->num_reported++;
+        if (job->num_reported == job->num_procs)
+        {
+            record_run_time(job);
+            job_remove(job);
+        }
+    }
+    fflush(stdout);
+}
+
+/*  Reports the background children reaped while the shell was busy, then
+    reaps and reports every other child that has changed state. If
+    AFTER_PROMPT is set, a prompt is on the screen, and the first report
+    starts on a new line. Returns the number of reports printed.
+*/
+int check_background(int after_prompt)
+{
+    // Only children that have changed state are reaped, and their jobs are
+    // found through the job table. Those reaped while waiting for a
+    // foreground process were deferred.
+    uint64_t reap_start = stats_now();
+    int num_reports = 0;
+    pid_t bg_pid;
+    int bg_status;
+    struct rusage bg_usage;
+    while (1)
+    {
+        struct job *job;
+        if (ev_undefer(&bg_pid, &bg_status) == 1)
+            job = job_find_pid(bg_pid);
+        else if (ev_reap(&bg_pid, &bg_status, &bg_usage, 0) == 1)
+        {
+            job = job_find_pid(bg_pid);
+            if (job && !job_update(job, bg_pid, bg_status, &bg_usage))
+                job = NULL;
+        }
+        else
+            break;
+
+        // A process that continued is not reported
+        if (job == NULL || WIFCONTINUED(bg_status))
+            continue;
+        if (after_prompt && num_reports == 0)
+            printf("\n");
+        report_background(job, bg_pid, bg_status);
+        num_reports++;
+    }
+    stats_record(STAT_REAP, reap_start);
+    return num_reports;
+}
+
+/*  Waits until a line typed at the terminal can be read from SCRIPT. The
+    wait is made in the event loop, so a background child that terminates
+    meanwhile is reaped and reported at once, instead of staying a zombie
+    until the next line is entered; PROMPT is then displayed again. Returns
+    0 once a line can be read, or -1 if a signal interrupted the wait.
+*/
+int wait_for_input(struct reader *script, const char *prompt)
+{
+    while (!reader_has_line(script))
+    {
+        int ready = ev_wait_input(script->fd);
+        if (ready == -1)
+            return -1;
+        if (ready == 1)
+            return 0;
+        if (check_background(1) > 0)
+        {
+            printf("%s", prompt);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+/*  Reads the body of a here-doc: the lines of input up to one equal to
+    DELIM, or the end of input, each followed by a newline and with every
+    "$$" and variable expanded. Lines come from SCRIPT, each after a "> "
+    prompt if PROMPT is set. Returns the body, allocated from ARENA, and
+    stores its length in *LEN.
+*/
+char *read_here_doc(struct arena *arena, struct reader *script, int prompt,
+                    const char *delim, size_t *len)
+{
+    size_t delim_len = strlen(delim);
+    char *body = NULL;
+    size_t body_len = 0, body_size = 0;
+
+    while (1)
+    {
+        if (prompt)
+        {
+            printf("> ");
+            fflush(stdout);
+            if (wait_for_input(script, "> ") == -1)
+                continue;
+        }
+        size_t line_len;
+        const char *line = reader_getline(script, &line_len);
+        if (line == NULL)
+        {
+            // A read interrupted by a signal is retried
+            if (!script->eof)
+                continue;
+            break;
+        }
+        if (line_len == delim_len && memcmp(line, delim, delim_len) == 0)
+            break;
+
+        size_t needed = body_len + lex_expand_len(line, line_len) + 1;
+        if (needed > body_size)
+        {
+            body_size = needed > 2 * body_size ? needed : 2 * body_size;
+            char *new_body = realloc(body, body_size);
+            if (new_body == NULL)
+            {
+                perror("here-doc: realloc()");
+                break;
+            }
+            body = new_body;
+        }
+        body_len += lex_expand(body + body_len, line, line_len);
+        body[body_len++] = '\n';
+    }
+
+    char *data = arena_alloc(arena, body_len + 1);
+    if (body_len > 0)
+        memcpy(data, body, body_len);
+    *len = body_len;
+    free(body);
+    return data;
+}
+
+/*  Waits in the event loop until every process of the foreground job JOB has
+    terminated, or until all of its live processes are stopped. Background
+    children reaped meanwhile are deferred, to be reported at the next prompt.
+    Returns 0 if the job terminated, or 1 if it was stopped, in which case it
+    becomes a background job.
+*/
+int wait_job(struct job *job)
+{
+    while (job->num_live > 0 && job->state != JOB_STOPPED)
+    {
+        pid_t pid;
+        int status;
+        struct rusage usage;
+        if (ev_reap(&pid, &status, &usage, 1) != 1)
+            break;
+
+        uint64_t reap_start = stats_now();
+        struct job *owner = job_find_pid(pid);
+        if (owner)
+            job_update(owner, pid, status, &usage);
+        if (owner && owner != job)
+            ev_defer(pid, status);
+        stats_record(STAT_REAP, reap_start);
+    }
+
+    if (job->state != JOB_STOPPED)
+        return 0;
+
+    // Processes that already terminated are not reported again
+    job_set_background(job);
+    job->num_reported = job->num_procs - job->num_live;
+    printf("\n[%d] Stopped\t%s\n", job->id, job->cmd_line);
+    fflush(stdout);
+    return 1;
+}
+
+/*  Stores in *ELAPSED the time from START to now on the monotonic clock.
 */
-void handle_SIGCHLD(int signum)
+void elapsed_since(const struct timespec *start, struct timespec *elapsed)
 {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed->tv_sec = now.tv_sec - start->tv_sec;
+    elapsed->tv_nsec = now.tv_nsec - start->tv_nsec;
+    if (elapsed->tv_nsec < 0)
+    {
+        elapsed->tv_sec--;
+        elapsed->tv_nsec += 1000000000L;
+    }
+}
+
+/*  Prints to STREAM the wall time WALL and the resource usage USAGE of a job,
+    as reported by the time prefix and by status -v.
+*/
+void print_usage(FILE *stream, const struct timespec *wall, const struct rusage *usage)
+{
+    fprintf(stream, "real\t%ldm%.3fs\n", (long)wall->tv_sec / 60,
+            wall->tv_sec % 60 + wall->tv_nsec / 1e9);
+    fprintf(stream, "user\t%ldm%.3fs\n", (long)usage->ru_utime.tv_sec / 60,
+            usage->ru_utime.tv_sec % 60 + usage->ru_utime.tv_usec / 1e6);
+    fprintf(stream, "sys\t%ldm%.3fs\n", (long)usage->ru_stime.tv_sec / 60,
+            usage->ru_stime.tv_sec % 60 + usage->ru_stime.tv_usec / 1e6);
+    fprintf(stream, "maxrss\t%ld KB\n", usage->ru_maxrss);
+    fprintf(stream, "faults\t%ld major, %ld minor\n", usage->ru_majflt, usage->ru_minflt);
+    fprintf(stream, "ctxsw\t%ld voluntary, %ld involuntary\n", usage->ru_nvcsw, usage->ru_nivcsw);
+    fflush(stream);
+}
+
+/*  Returns the background job named by the job spec SPEC: "%N" or "N" for
+    job number N, or "%%" or "%+" for the most recent job. Returns NULL if
+    there is no such job.
+*/
+struct job *parse_job_spec(const char *spec)
+{
+    if (spec[0] == '%')
+        spec++;
+    if (strcmp(spec, "%") == 0 || strcmp(spec, "+") == 0 || *spec == '\0')
+        return job_last();
+
+    char *end;
+    long id = strtol(spec, &end, 10);
+    if (*end != '\0')
+        return NULL;
+    return job_find_id((int)id);
+}
+
+/*  Returns the exit value a wait status STATUS stands for: the exit value of
+    a process that exited, or 128 plus the number of the terminating signal.
+*/
+int exit_value(int status)
+{
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/*  Terminates every job and process started by the shell, then exits the
+    shell with exit value EXIT_VALUE.
+*/
+void exit_shell(int exit_value)
+{
+    fflush(stdout);
+    history_end();
+    serve_finish();
+    stats_dump();
+    trace_flush();
+    // Background jobs run in their own process groups
+    for (struct job *job = job_next(NULL); job; job = job_next(job))
+        job_signal(job, SIGTERM);
+    int kill_result = killpg(0, SIGTERM);
+    if (kill_result == -1)
+        killpg(0, SIGKILL);
+    exit(exit_value);
 }
 
-// Struct for holding parsed user input
-struct user_input
+/*  Sets the foreground status to the exit value VALUE of a command that was
+    not launched, such as a built-in or a replayed cached command: it has no
+    stages, wall time or resource usage. Exits the shell if VALUE is an
+    error and -e was given.
+*/
+void set_fg_value(int value)
 {
-    char *cmd;
-    char bg_process;
-    char *input_file, *output_file;
-    int num_cmd_args;
-    char **cmd_args;
-};
+    free(fg_stage_statuses);
+    fg_stage_statuses = NULL;
+    fg_num_stages = 0;
+    fg_status = value << 8;
+    history_set_status(value);
+    memset(&fg_wall, '\0', sizeof(struct timespec));
+    memset(&fg_usage, '\0', sizeof(struct rusage));
+    if (exit_on_error && value != 0)
+        exit_shell(value);
+}
 
 /* MAIN PROGRAM */
 int main(int argc, char **argv)
 {
+    /* COMMAND-LINE OPTIONS */
+
+    // smallsh [-e] [-i] [script]
+    // smallsh [-e] --serve PATH [-j N]
+    // smallsh --connect PATH [command ...]
+    //   -e  exit as soon as a foreground command fails or a line cannot be
+    //       parsed (batch mode)
+    //   -i  interactive: display the prompt even if input is not a terminal
+    //   --serve PATH
+    //       run command lines sent by clients over a Unix domain socket at
+    //       PATH, at most N at once (-j, default the number of CPUs)
+    //   --connect PATH
+    //       send the command, or the script on stdin, to a server at PATH
+    int force_interactive = 0;
+    const char *serve_path = NULL;
+    const char *connect_path = NULL;
+    long max_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    static const struct option long_options[] = {
+        {"serve", required_argument, NULL, 'S'},
+        {"connect", required_argument, NULL, 'C'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    // Options end at the first word, so a command given to --connect keeps
+    // its own
+    while ((opt = getopt_long(argc, argv, "+eij:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            exit_on_error = 1;
+            break;
+        case 'i':
+            force_interactive = 1;
+            break;
+        case 'j':
+            max_workers = atol(optarg);
+            break;
+        case 'S':
+            serve_path = optarg;
+            break;
+        case 'C':
+            connect_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e] [-i] [script]\n", argv[0]);
+            fprintf(stderr, "       %s [-e] --serve PATH [-j N]\n", argv[0]);
+            fprintf(stderr, "       %s --connect PATH [command ...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (connect_path)
+        exit(serve_connect(connect_path, argc - optind, argv + optind));
+
+    // Commands are read from the script, if one is given, or else from
+    // stdin. Unless reading from a terminal, the shell runs in batch mode:
+    // no prompt is displayed and input is read in large blocks (or mapped)
+    // instead of line by line. See smallsh_input.c.
+    int batch_mode = (optind < argc || !isatty(STDIN_FILENO)) && !force_interactive;
+    struct reader script = {0};
+    if (serve_path)
+    {
+        // Returns in a worker forked for each request, which runs the
+        // request's command lines as a script (see smallsh_serve.c)
+        if (serve_run(serve_path, max_workers > 0 ? (int)max_workers : 1, &script) == -1)
+            exit(EXIT_FAILURE);
+        batch_mode = 1;
+    }
+    else if (optind < argc)
+    {
+        if (reader_open_file(&script, argv[optind]) == -1)
+            exit(EXIT_FAILURE);
+    }
+    else if (batch_mode && reader_open_fd(&script, STDIN_FILENO) == -1)
+        exit(EXIT_FAILURE);
+    // A terminal is read a line at a time, however long
+    else if (!batch_mode && reader_open_interactive(&script, STDIN_FILENO) == -1)
+        exit(EXIT_FAILURE);
+
     // Create a session, which initializes a new process group ID
     setsid();
 
@@ -73,12 +522,7 @@ int main(int argc, char **argv)
     /* SIGNAL HANDLING */
 
     struct sigaction SIGTSTP_action = {0}, SIGTERM_action = {0},
-        SIGCHLD_action = {0}, ignore_action = {0}, default_action = {0};
-
-    // Default actions
-    default_action.sa_handler = SIG_DFL;
-    sigemptyset(&default_action.sa_mask);
-    default_action.sa_flags = 0;
+        ignore_action = {0};
 
     // Set signals to ignore
     ignore_action.sa_handler = SIG_IGN;
@@ -98,58 +542,90 @@ int main(int argc, char **argv)
     SIGTERM_action.sa_flags = 0;
     sigaction(SIGTERM, &SIGTERM_action, NULL);
 
-    // Set handler for SIGCHLD
-    SIGCHLD_action.sa_handler = handle_SIGCHLD;
-    sigfillset(&SIGCHLD_action.sa_mask);
-    SIGCHLD_action.sa_flags = 0;
+    // Shell variables start as the environment, which the shell keeps
+    // built for commands from then on (see smallsh_vars.c)
+    vars_init();
+
+    // Block SIGCHLD and receive it through a signalfd, so terminated
+    // children are reaped by the event loop (see smallsh_events.c)
+    if (ev_init() == -1)
+        exit(EXIT_FAILURE);
+
+    // Children launched by fork or the zygote report stale remembered
+    // command paths through a shared page, set up before the zygote starts
+    pathcache_init();
+
+    // Select the launch engine for non built-in commands
+    spawn_init();
+
+    // Cache the expansion of "$$"
+    lex_init();
+
+    // A script file is split into tokens once and the result kept for its
+    // later runs (see smallsh_script.c)
+    if (script.map)
+        script_load(&script);
+
+    // Phase latency statistics are written to SMALLSH_STATS_FILE on exit
+    if (getenv("SMALLSH_STATS_FILE"))
+        stats_set_dump_file(getenv("SMALLSH_STATS_FILE"));
+
+    // Every launched process is recorded in SMALLSH_TRACE, if set
+    trace_init();
+
+    // Interactive command lines are recorded in the shared history file
+    history_init(!batch_mode);
 
     // Local shell mode. 0 = normal mode, !0 = foreground-only mode.
     // Comparison made to _fg_only_mode for mode change whenever the command
     // prompt is about to be displayed
     int fg_only_mode = 0;
 
-    // Hold exit status of most recent foreground process termination
-    int fg_status = 0;
+    // Arena owning all parsed state of the current command, including the
+    // user_input struct for holding parsed user input. Reset once per
+    // command instead of freeing each string.
+    struct arena parse_arena;
+    arena_init(&parse_arena, 16384);
+    struct user_input *user_input = NULL;
 
-    // Initialize variables that hold background process information
-    int num_bg_procs = 0;
-    int bg_pids_arr_size = 8;
-    int *bg_pids_arr = calloc(bg_pids_arr_size, sizeof(int));
+    // Bytes the arguments of a command may take, pointers included
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0)
+        arg_max = _POSIX_ARG_MAX;
 
-    // Initialize user_input struct for holding parsed user input
-    struct user_input *user_input = calloc(1, sizeof(struct user_input));
-    user_input->cmd_args = calloc(MAX_ARGS, sizeof(char *));
+    // Current input line. Lines from the reader are not null-terminated.
+    const char *line = NULL;
+    size_t line_len = 0;
 
-    // Initialize input string buffer input_buf
-    size_t input_buf_size = 2052;
-    char *input_buf = calloc(input_buf_size, sizeof(char));
+    // Start of the built-in dispatch of the previous command, or 0. A
+    // built-in runs until the next iteration of the main loop.
+    uint64_t builtin_start = 0;
 
 
     /* MAIN LOOP */
 
     while (1)
     {
-        /* Clear any data from user_input struct */
-        if (user_input->cmd)
-            free(user_input->cmd);
-        if (user_input->input_file)
-            free(user_input->input_file);
-        if (user_input->output_file)
-            free(user_input->output_file);
-        if (user_input->cmd_args[0])
+        if (builtin_start)
         {
-            for (int i = 0; i < user_input->num_cmd_args; i++)
-            {
-                free(user_input->cmd_args[i]);
-            }
+            stats_record(STAT_BUILTIN, builtin_start);
+            builtin_start = 0;
         }
-        memset(user_input, '\0', sizeof(struct user_input) - sizeof(char **));
-        memset(user_input->cmd_args, '\0', sizeof(char *) * MAX_ARGS);
+
+        // The previous command line is done
+        history_end();
+
+        /* Release the previous command's parsed state in one step */
+        arena_reset(&parse_arena);
+        user_input = arena_calloc(&parse_arena, sizeof(struct user_input));
+        user_input->cmd_args = arena_alloc(&parse_arena, INIT_ARGS * sizeof(char *));
 
 
         /* Display command-line prompt until user enters a valid string */
         do
         {
+            line_len = 0;
+
             if (DEBUGPROMPT)
                 printf("Checking for shell mode change...\n");
 
@@ -171,156 +647,256 @@ int main(int argc, char **argv)
                 printf("Checking for background process termination...\n");
 
             /* Check for termination of background processes */
-            int bg_status;
-            for (int i = 0; i < num_bg_procs; i++)
-            {
-                // Iterate through the bg processes
-                if (waitpid(bg_pids_arr[i], &bg_status, WNOHANG) == bg_pids_arr[i])
-                {
-                    printf("background pid %d is done: ", bg_pids_arr[i]);
-                    // Process changed state. See if it terminated.
-                    if (WIFEXITED(bg_status))
-                    {
-                        printf("exit value %d\n", WEXITSTATUS(bg_status));
-                    }
-                    else if (WIFSIGNALED(bg_status))
-                    {
-                        printf("terminated by signal %d\n", WTERMSIG(bg_status));
-                    }
-                    fflush(stdout);
-                    if (arr_del(&bg_pids_arr, &bg_pids_arr_size, i, &num_bg_procs) != 0)
-                        exit(1);
-                    i--;
-                }
-            }
+            check_background(0);
 
             if (DEBUGPROMPT)
-                printf("Clearing input buffer and displaying prompt...\n");
+                printf("Displaying prompt...\n");
 
-            /* Clear input buffer, display prompt, then get input */
-            memset(input_buf, '\0', input_buf_size);
-            printf(": ");
-            fflush(stdout);
-            char *input_ptr = NULL;
+            uint64_t read_start = stats_now();
 
-            input_ptr = fgets(input_buf, input_buf_size, stdin);
-            // Check for read error
-            if (input_ptr == NULL)
+            /* Display prompt, unless in batch mode, then get input */
+            if (!batch_mode)
             {
-                // Read error. Clear error then display prompt again.
-                clearerr(stdin);
-                continue;
+                printf(": ");
+                fflush(stdout);
+                // Background jobs ending while the line is typed are
+                // reported right away
+                if (wait_for_input(&script, ": ") == -1)
+                    continue;
             }
-            // Remove trailing newline char
-            size_t input_len = strlen(input_buf);
-            if (input_buf[input_len-1] == '\n')
-                input_buf[input_len-1] = '\0';
-        } while (strlen(input_buf) == 0 || input_buf[0] == '#');
+            line = reader_getline(&script, &line_len);
+            if (line == NULL)
+            {
+                // A read interrupted by a signal displays the prompt again
+                if (!script.eof)
+                    continue;
+                // End of input (CTRL+D at the terminal) exits the shell with
+                // the status of the last command
+                if (!batch_mode)
+                    printf("\n");
+                exit_shell(exit_value(fg_status));
+            }
+            stats_record(STAT_READ, read_start);
+        } while (line_len == 0 || line[0] == '#');
         // End prompt
 
+        history_begin(line, line_len);
+
         if (DEBUGINPUT)
-            printf("string_buf: %s\n", input_buf);
+            printf("string_buf: %.*s\n", (int)line_len, line);
 
         /*  PARSE USER INPUT
-            Iterate through space-delimited arguments in input_buf, expanding
-            every substring of "$$" to the current process pid, then copying
-            the expanded argument to the appropriate struct members of
-            user_input.
-
-            Since the max pid length is 5 digits, each "$$" substring of 2
-            characters may need to expand up to 5 characters, so memory
-            allocated for each argument will be 2.5x the length of each input
-            argument.
+            Split the input line into space-delimited tokens in a single pass,
+            expanding every substring of "$$" to the shell's pid, and "$?",
+            "$!" and variables to their values, as they are copied (see
+            smallsh_lex.c), then assign the tokens to the appropriate struct
+            members of user_input. All of it comes from parse_arena. Lines of
+            a compiled script are already split, and only their words with
+            a '$' are expanded.
         */
-        char *saveptr = NULL;
-        char *token = strtok_r(input_buf, " ", &saveptr);
-
-        // First argument is the command
-        user_input->cmd = calloc(1, (size_t)(2.5 * strlen(token) + 1));
-        copy_and_expand_dollar(user_input->cmd, token);
-
-        user_input->num_cmd_args = 0;
-        user_input->cmd_args[user_input->num_cmd_args] = calloc(1, strlen(user_input->cmd) + 1);
-        strcpy(user_input->cmd_args[user_input->num_cmd_args], user_input->cmd);
-        user_input->num_cmd_args++;
+        uint64_t parse_start = stats_now();
+        vars_set_status(exit_value(fg_status));
+        struct token *tokens;
+        int num_tokens = script_tokens(&parse_arena, &script, line, line_len, &tokens);
+        if (num_tokens == -1)
+            num_tokens = lex_line(&parse_arena, line, line_len, &tokens);
+        struct token *token = NULL;
+
+        // Stage of the pipeline currently being parsed. Its first word
+        // argument is its command.
+        struct user_input *stage = user_input;
+        int parse_error = 0;
+
+        // Size of the current stage's cmd_args, which doubles whenever it is
+        // full, and the bytes its arguments take in execve(), limited by
+        // ARG_MAX
+        int max_cmd_args = INIT_ARGS;
+        size_t arg_bytes = 0;
+        int too_long = 0;
+
+        // Leading prefixes, in any order: "time" reports the resource usage
+        // of the command, nice, pin and limit set controls applied to each
+        // of its processes (see smallsh_controls.c), and "cached" reuses
+        // the output of an earlier identical run (see smallsh_cache.c)
+        int timed = 0;
+        struct spawn_controls *controls = NULL;
+        struct cache_request *cache = NULL;
+        int t = 0;
+        int used = 0;
+        while (t < num_tokens - 1)
+        {
+            if (tokens[t].type == TOK_WORD && strcmp(tokens[t].text, "time") == 0)
+            {
+                timed = 1;
+                used = 1;
+            }
+            else if ((used = controls_parse(&parse_arena, &controls, &tokens[t],
+                                            num_tokens - t)) == 0)
+                used = cache_parse(&parse_arena, &cache, &tokens[t], num_tokens - t);
+            if (used <= 0)
+                break;
+            t += used;
+        }
+        // Invalid control or cached prefix, already reported
+        if (used == -1)
+        {
+            if (exit_on_error)
+                exit_shell(EXIT_FAILURE);
+            continue;
+        }
 
-        token = strtok_r(NULL, " ", &saveptr);
-        while (token)
+        for (; t < num_tokens; t++)
         {
+            token = &tokens[t];
+
             // Input redirection
-            if (strcmp(token, "<") == 0)
+            if (token->type == TOK_REDIR_IN)
             {
                 // Next token is input file
-                token = strtok_r(NULL, " ", &saveptr);
-                user_input->input_file = calloc(1, (size_t)(2.5 * strlen(token) + 1));
-                copy_and_expand_dollar(user_input->input_file, token);
+                if (t + 1 == num_tokens)
+                {
+                    parse_error = 1;
+                    break;
+                }
+                token = &tokens[++t];
+                stage->input_file = token->text;
+                stage->here_data = NULL;
             }
-            // Output redirection
-            else if (strcmp(token, ">") == 0)
+            // Here-string: the next word and a newline are the input
+            else if (token->type == TOK_HERE_STRING)
             {
-                // Next token is output file
-                token = strtok_r(NULL, " ", &saveptr);
-                user_input->output_file = calloc(1, (size_t)(2.5 * strlen(token) + 1));
-                copy_and_expand_dollar(user_input->output_file, token);
+                if (t + 1 == num_tokens)
+                {
+                    parse_error = 1;
+                    break;
+                }
+                token = &tokens[++t];
+                stage->here_len = token->len + 1;
+                stage->here_data = arena_alloc(&parse_arena, stage->here_len);
+                memcpy(stage->here_data, token->text, token->len);
+                stage->here_data[token->len] = '\n';
+                stage->input_file = NULL;
             }
-            // Background process
-            else if (strcmp(token, "&") == 0)
+            // Here-doc: the following input lines, up to one consisting of
+            // the next word, are the input
+            else if (token->type == TOK_HERE_DOC)
             {
-                // See if token is last arg in string
-                token = strtok_r(NULL, " ", &saveptr);
-                if (!token)
+                if (t + 1 == num_tokens)
                 {
-                    // Run process in background. Set bg_process to non-NULL
-                    if (!fg_only_mode)
-                        user_input->bg_process = 'T';
+                    parse_error = 1;
                     break;
                 }
-                else
+                token = &tokens[++t];
+                stage->here_data = read_here_doc(&parse_arena, &script, !batch_mode,
+                                                 token->text, &stage->here_len);
+                stage->input_file = NULL;
+            }
+            // Output redirection
+            else if (token->type == TOK_REDIR_OUT)
+            {
+                // Next token is output file
+                if (t + 1 == num_tokens)
                 {
-                    // "&" is part of command arguments. Add to cmd_args.
-                    if (user_input->num_cmd_args >= MAX_ARGS)
-                    {
-                        // Too many arguments
-                        user_input->num_cmd_args++;
-                        break;
-                    }
-                    user_input->cmd_args[user_input->num_cmd_args] = malloc(2 * sizeof(char));
-                    strcpy(user_input->cmd_args[user_input->num_cmd_args], "&");
-                    user_input->num_cmd_args++;
-                    continue;
+                    parse_error = 1;
+                    break;
                 }
+                token = &tokens[++t];
+                stage->output_file = token->text;
             }
-            // Command argument
-            else
+            // Pipe to the next stage of the pipeline
+            else if (token->type == TOK_PIPE)
             {
-                // Check that we are below the maximum number of arguments
-                if (user_input->num_cmd_args >= MAX_ARGS)
+                // The stage being ended must have a command
+                if (!stage->cmd)
                 {
-                    // Too many arguments
-                    user_input->num_cmd_args++;
+                    parse_error = 1;
                     break;
                 }
+                stage->cmd_args[stage->num_cmd_args] = NULL;
 
-                user_input->cmd_args[user_input->num_cmd_args] = calloc(1, (size_t)(2.5 * strlen(token) + 1));
-                copy_and_expand_dollar(user_input->cmd_args[user_input->num_cmd_args], token);
-                user_input->num_cmd_args++;
+                stage->next = arena_calloc(&parse_arena, sizeof(struct user_input));
+                stage->next->cmd_args = arena_alloc(&parse_arena, INIT_ARGS * sizeof(char *));
+                stage = stage->next;
+                max_cmd_args = INIT_ARGS;
+                arg_bytes = 0;
+            }
+            // Background process, if it is the last token
+            else if (token->type == TOK_BG && t + 1 == num_tokens)
+            {
+                // Run the whole pipeline in background. Set bg_process of the
+                // first stage to non-NULL
+                if (!fg_only_mode)
+                    user_input->bg_process = 'T';
+                token = NULL;
             }
+            // Command argument. An "&" that is not last is an argument too.
+            else
+            {
+                // A word with a wildcard is replaced by the paths matching
+                // it, if any (see smallsh_glob.c)
+                char **words = &token->text;
+                int num_matches = 0;
+                if (token->flags & TOK_GLOB)
+                    num_matches = glob_expand(&parse_arena, token->text, &words);
+                if (num_matches == 0)
+                {
+                    words = &token->text;
+                    num_matches = 1;
+                }
+
+                // Check that the arguments still fit in ARG_MAX
+                for (int i = 0; i < num_matches; i++)
+                    arg_bytes += strlen(words[i]) + 1 + sizeof(char *);
+                if (arg_bytes > (size_t)arg_max)
+                {
+                    too_long = 1;
+                    break;
+                }
 
-            // Get next token in string input_buf
-            token = strtok_r(NULL, " ", &saveptr);
+                // Grow cmd_args, keeping room for the NULL after the last
+                if (stage->num_cmd_args + num_matches >= max_cmd_args)
+                {
+                    while (stage->num_cmd_args + num_matches >= max_cmd_args)
+                        max_cmd_args *= 2;
+                    char **cmd_args = arena_alloc(&parse_arena, max_cmd_args * sizeof(char *));
+                    memcpy(cmd_args, stage->cmd_args, stage->num_cmd_args * sizeof(char *));
+                    stage->cmd_args = cmd_args;
+                }
+                memcpy(stage->cmd_args + stage->num_cmd_args, words, num_matches * sizeof(char *));
+                if (!stage->cmd)
+                    stage->cmd = stage->cmd_args[0];
+                stage->num_cmd_args += num_matches;
+            }
+            token = NULL;
         }
 
         // Check for any overflow of arguments
-        if (user_input->num_cmd_args >= MAX_ARGS)
+        if (too_long)
         {
             // Too many arguments. Print error
-            fprintf(stderr, "Error: arguments entered exceeds %d\n", MAX_ARGS);
+            fprintf(stderr, "Error: arguments exceed ARG_MAX (%ld bytes)\n", arg_max);
             fflush(stderr);
+            if (exit_on_error)
+                exit_shell(EXIT_FAILURE);
+            continue;
+        }
+
+        // Check for a missing command, redirection file or pipeline stage
+        if (parse_error || !stage->cmd)
+        {
+            fprintf(stderr, "Error: syntax error near '%s'\n", token ? token->text : "newline");
+            fflush(stderr);
+            if (exit_on_error)
+                exit_shell(EXIT_FAILURE);
             continue;
         }
 
         // Explicitly initialize a pointer to NULL after the last cmd_args
-        user_input->cmd_args[user_input->num_cmd_args] = NULL;
+        stage->cmd_args[stage->num_cmd_args] = NULL;
+
+        // Every stage of the pipeline is launched with the controls
+        for (stage = user_input; stage; stage = stage->next)
+            stage->controls = controls;
 
         if (DEBUGINPUT)
         {
@@ -338,23 +914,61 @@ int main(int argc, char **argv)
             }
         }
 
+        stats_record(STAT_PARSE, parse_start);
+
         /* BUILT-IN COMMANDS */
 
+        builtin_start = stats_now();
+
         if (DEBUG1)
             printf("Checking for built-in command...\n");
 
+        // One switch on the command's first characters (see
+        // smallsh_builtins.c) instead of a strcmp per built-in
+        enum builtin_id builtin = builtin_lookup(user_input->cmd);
+
+        // Only a foreground command that is launched has an output to store
+        if (cache && (user_input->bg_process ||
+                      (builtin != BUILTIN_NONE && builtin < BUILTIN_FIRST_COMMAND)))
+        {
+            if (user_input->bg_process)
+                fprintf(stderr, "cached: cannot run in the background\n");
+            else
+                fprintf(stderr, "cached: %s: is a shell built-in\n", user_input->cmd);
+            fflush(stderr);
+            set_fg_value(EXIT_FAILURE);
+            // Reset prompt
+            continue;
+        }
+
+        /* VARIABLE ASSIGNMENTS */
+        // A command made only of NAME=VALUE words sets shell variables
+        if (builtin == BUILTIN_NONE && user_input->next == NULL &&
+            vars_is_assignment(user_input->cmd))
+        {
+            int num_assignments = 1;
+            while (num_assignments < user_input->num_cmd_args &&
+                   vars_is_assignment(user_input->cmd_args[num_assignments]))
+                num_assignments++;
+            if (num_assignments == user_input->num_cmd_args)
+            {
+                for (int i = 0; i < num_assignments; i++)
+                    vars_assign(user_input->cmd_args[i]);
+                spawn_context_changed();
+                // Reset prompt
+                continue;
+            }
+        }
+
         /* EXIT COMMAND */
-        if (strcmp(user_input->cmd, "exit") == 0)
+        if (builtin == BUILTIN_EXIT)
         {
             // Exit all processes and jobs running then terminate
-            int kill_result = killpg(0, SIGTERM);
-            if (kill_result == -1)
-                killpg(0, SIGKILL);
-            exit(EXIT_SUCCESS);
+            exit_shell(EXIT_SUCCESS);
         }
 
         /* CD COMMAND */
-        if (strcmp(user_input->cmd, "cd") == 0)
+        if (builtin == BUILTIN_CD)
         {
             // Change directory. Takes one optional argument.
             // Ignores redirect of input/output and background process requests.
@@ -373,7 +987,8 @@ int main(int argc, char **argv)
                 {
                     if (DEBUGCD)
                         printf("setting pwd...\n");
-                    setenv("PWD", dest_dir, 1);
+                    vars_set("PWD", 3, dest_dir, 1);
+                    spawn_context_changed();
                 }
             }
             else if (user_input->num_cmd_args == 2)
@@ -394,11 +1009,12 @@ int main(int argc, char **argv)
                     char *cur_dir = getcwd(NULL, 0);
                     if (cur_dir)
                     {
-                        setenv("PWD", cur_dir, 1);
+                        vars_set("PWD", 3, cur_dir, 1);
                         free(cur_dir);
                     }
                     else
                         perror("getcwd()");
+                    spawn_context_changed();
                 }
             }
             else
@@ -412,7 +1028,7 @@ int main(int argc, char **argv)
         }
 
         /* STATUS COMMAND */
-        if (strcmp(user_input->cmd, "status") == 0)
+        if (builtin == BUILTIN_STATUS)
         {
             // Prints out either the exit status or terminating signal of the
             // last foreground process ran.
@@ -422,155 +1038,415 @@ int main(int argc, char **argv)
                 printf("exit value %d\n", WEXITSTATUS(fg_status));
             else if (WIFSIGNALED(fg_status))
                 printf("terminated by signal %d\n", WTERMSIG(fg_status));
+
+            // status -v also reports the resource usage of the last
+            // foreground job and the shell's own parser memory footprint
+            if (user_input->num_cmd_args > 1 && strcmp(user_input->cmd_args[1], "-v") == 0)
+            {
+                fflush(stdout);
+                print_usage(stdout, &fg_wall, &fg_usage);
+                arena_print(&parse_arena, "parse arena");
+            }
+
+            // For a pipeline, also print the status of each stage
+            for (int i = 0; fg_num_stages > 1 && i < fg_num_stages; i++)
+            {
+                printf("  stage %d: ", i + 1);
+                if (WIFEXITED(fg_stage_statuses[i]))
+                    printf("exit value %d\n", WEXITSTATUS(fg_stage_statuses[i]));
+                else if (WIFSIGNALED(fg_stage_statuses[i]))
+                    printf("terminated by signal %d\n", WTERMSIG(fg_stage_statuses[i]));
+            }
             fflush(stdout);
             // Reset prompt
             continue;
         }
 
+        /* HASH COMMAND */
+        if (builtin == BUILTIN_HASH)
+        {
+            // Lists, clears or adds to the cache of resolved command paths.
+            //   hash           list remembered commands and their hit counts
+            //   hash -r        forget all remembered commands
+            //   hash -s        print cache hit/miss counts
+            //   hash name ...  resolve and remember each name
+            if (user_input->num_cmd_args == 1)
+            {
+                pathcache_print();
+                pathcache_print_counts();
+            }
+            else if (strcmp(user_input->cmd_args[1], "-r") == 0)
+                pathcache_clear();
+            else if (strcmp(user_input->cmd_args[1], "-s") == 0)
+                pathcache_print_counts();
+            else
+            {
+                for (int i = 1; i < user_input->num_cmd_args; i++)
+                {
+                    if (pathcache_add(user_input->cmd_args[i]) == -1)
+                        fprintf(stderr, "hash: %s: not found\n", user_input->cmd_args[i]);
+                }
+            }
+            fflush(stdout);
+            fflush(stderr);
+            // Reset prompt
+            continue;
+        }
 
-        /* NON BUILT-IN COMMANDS */
-
-        if (DEBUG1)
-            printf("Not a built-in command...\n");
 
-        // Fork process
-        pid_t spawnpid = fork();
-        switch (spawnpid)
+        /* JOBS COMMAND */
+        if (builtin == BUILTIN_JOBS)
         {
-        case -1:
-            /* FORK ERROR */
-
-            // Print error, then break to get back to command prompt.
-            perror("fork()");
-            break;
+            // Lists background jobs with their state, pids and command line
+            for (struct job *job = job_next(NULL); job; job = job_next(job))
+                job_print(job);
+            fflush(stdout);
+            // Reset prompt
+            continue;
+        }
 
-        case 0:
-            /* CHILD PROCESS BRANCH */
+        /* FG AND BG COMMANDS */
+        if (builtin == BUILTIN_FG || builtin == BUILTIN_BG)
+        {
+            // Resumes a job, the most recent one if none is given, in the
+            // foreground (fg) or in the background (bg).
+            struct job *job = job_last();
+            if (user_input->num_cmd_args > 1)
+                job = parse_job_spec(user_input->cmd_args[1]);
+            if (job == NULL)
+            {
+                fprintf(stderr, "%s: no such job\n", user_input->cmd);
+                fflush(stderr);
+                continue;
+            }
 
-            // All children processes ignore SIGTSTP
-            sigaction(SIGTSTP, &ignore_action, NULL);
+            if (builtin == BUILTIN_BG)
+            {
+                job_continue(job);
+                printf("[%d] %s\n", job->id, job->cmd_line);
+                fflush(stdout);
+                continue;
+            }
 
-            // Foreground child processes terminate on SIGINT
-            if (user_input->bg_process == '\0')
-                sigaction(SIGINT, &default_action, NULL);
+            printf("%s\n", job->cmd_line);
+            fflush(stdout);
+            job_continue(job);
+            if (wait_job(job) == 0)
+            {
+                // The job's status becomes the foreground status
+                free(fg_stage_statuses);
+                fg_num_stages = job->num_procs;
+                fg_stage_statuses = calloc(fg_num_stages, sizeof(int));
+                for (int i = 0; i < fg_num_stages; i++)
+                    fg_stage_statuses[i] = job->procs[i].status;
+                fg_status = fg_stage_statuses[fg_num_stages - 1];
+                history_set_status(exit_value(fg_status));
+                elapsed_since(&job->start_time, &fg_wall);
+                job_usage(job, &fg_usage);
+                record_run_time(job);
+                if (WIFSIGNALED(fg_status))
+                    printf("terminated by signal %d\n", WTERMSIG(fg_status));
+                fflush(stdout);
+                job_remove(job);
+            }
+            continue;
+        }
 
-            // Redirect input if specified, or a background process
-            if (user_input->input_file || user_input->bg_process)
+        /* KILL COMMAND */
+        // Only handled here when a job spec (%N) is given. Plain pids are
+        // left to the external kill command.
+        int kill_has_job_spec = 0;
+        for (int i = 1; builtin == BUILTIN_KILL && i < user_input->num_cmd_args; i++)
+        {
+            if (user_input->cmd_args[i][0] == '%')
+                kill_has_job_spec = 1;
+        }
+        if (kill_has_job_spec)
+        {
+            // kill [-s SIGNAL | -SIGNAL] %N | pid ...
+            int signum = SIGTERM;
+            int i = 1;
+            if (strcmp(user_input->cmd_args[i], "-s") == 0 && i + 1 < user_input->num_cmd_args)
+            {
+                signum = parse_signal(user_input->cmd_args[i + 1]);
+                i += 2;
+            }
+            else if (user_input->cmd_args[i][0] == '-')
+            {
+                signum = parse_signal(user_input->cmd_args[i] + 1);
+                i++;
+            }
+            if (signum == -1)
             {
-                // Get the input file name, if specified
-                char *input_file = "/dev/null";
-                if (user_input->input_file)
-                    input_file = user_input->input_file;
+                fprintf(stderr, "kill: %s: invalid signal specification\n", user_input->cmd_args[i - 1]);
+                fflush(stderr);
+                continue;
+            }
 
-                // Open the input file
-                int input_fd = open(input_file, O_RDONLY);
-                if (input_fd == -1)
+            for (; i < user_input->num_cmd_args; i++)
+            {
+                char *target = user_input->cmd_args[i];
+                if (target[0] == '%')
                 {
-                    fprintf(stderr, "error redirecting input to %s: open(): ", input_file);
-                    perror("");
-                    fflush(stderr);
-                    exit(EXIT_FAILURE);
+                    struct job *job = parse_job_spec(target);
+                    if (job == NULL)
+                        fprintf(stderr, "kill: %s: no such job\n", target);
+                    else if (job_signal(job, signum) == -1)
+                    {
+                        fprintf(stderr, "kill: %s: ", target);
+                        perror("");
+                    }
+                    // A killed stopped job must be continued to act on it
+                    else if (job->state == JOB_STOPPED && signum != SIGSTOP)
+                        job_continue(job);
                 }
-
-                // Point stdin to input_fd
-                int input_result = dup2(input_fd, STDIN_FILENO);
-                if (input_result == -1)
+                else if (kill(atoi(target), signum) == -1)
                 {
-                    fprintf(stderr, "error redirecting input to %s: dup2(): ", input_file);
+                    fprintf(stderr, "kill: %s: ", target);
                     perror("");
-                    fflush(stderr);
-                    exit(EXIT_FAILURE);
                 }
-
-                // Set file descriptor flag for input_fd to close on exec
-                fcntl(input_fd, F_SETFD, FD_CLOEXEC);
             }
+            fflush(stderr);
+            continue;
+        }
+
+        /* STATS COMMAND */
+        if (builtin == BUILTIN_STATS)
+        {
+            // Prints or resets the latency histograms of the main loop
+            // phases (see smallsh_stats.c).
+            //   stats          print count, p50, p99, max and mean per phase
+            //   stats -j       print the same as JSON
+            //   stats -r       reset every histogram
+            //   stats -o file  write them as JSON to FILE when the shell exits
+            if (user_input->num_cmd_args == 1)
+                stats_print(stdout);
+            else if (strcmp(user_input->cmd_args[1], "-j") == 0)
+                stats_print_json(stdout);
+            else if (strcmp(user_input->cmd_args[1], "-r") == 0)
+                stats_reset();
+            else if (strcmp(user_input->cmd_args[1], "-o") == 0 && user_input->num_cmd_args == 3)
+                stats_set_dump_file(user_input->cmd_args[2]);
+            else
+                fprintf(stderr, "usage: stats [-j | -r | -o file]\n");
+            fflush(stderr);
+            // Reset prompt
+            continue;
+        }
 
-            // Redirect output if specified, or a background process
-            if (user_input->output_file || user_input->bg_process)
+        /* PARALLEL COMMAND */
+        if (builtin == BUILTIN_PARALLEL && user_input->next == NULL)
+        {
+            // Runs a command once per argument, N at a time, in the
+            // foreground (see smallsh_parallel.c). Its status is the number
+            // of commands that failed. It cannot run in the background.
+            int parallel_value;
+            if (user_input->bg_process)
             {
-                // Get the output file name, if specified
-                char *output_file = "/dev/null";
-                if (user_input->output_file)
-                    output_file = user_input->output_file;
+                fprintf(stderr, "parallel: cannot run in the background\n");
+                fflush(stderr);
+                parallel_value = EXIT_FAILURE;
+            }
+            else
+                parallel_value = parallel_run(&parse_arena, user_input);
+            set_fg_value(parallel_value);
+            continue;
+        }
 
-                // Open the output file
-                int output_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (output_fd == -1)
-                {
-                    fprintf(stderr, "error redirecting output to %s: open(): ", output_file);
-                    perror("");
-                    fflush(stderr);
-                    exit(EXIT_FAILURE);
-                }
+        /* EXPORT AND UNSET COMMANDS */
+        if (builtin == BUILTIN_EXPORT || builtin == BUILTIN_UNSET)
+        {
+            // Set, export and unset shell variables (see smallsh_vars.c).
+            // Commands launched by the zygote must see the new environment.
+            // Their status, 1 for an invalid name, is the foreground status.
+            int vars_value;
+            if (builtin == BUILTIN_EXPORT)
+                vars_value = vars_export(user_input);
+            else
+                vars_value = vars_unset(user_input);
+            spawn_context_changed();
+            set_fg_value(vars_value);
+            // Reset prompt
+            continue;
+        }
 
-                // Point stdout to output_fd
-                int output_result = dup2(output_fd, STDOUT_FILENO);
-                if (output_result == -1)
-                {
-                    fprintf(stderr, "error redirecting output to %s: dup2(): ", output_file);
-                    perror("");
-                    fflush(stderr);
-                    exit(EXIT_FAILURE);
-                }
+        /* HISTORY AND ENABLE COMMANDS */
+        if (builtin == BUILTIN_HISTORY || builtin == BUILTIN_ENABLE)
+        {
+            // history lists or searches the command history of every shell
+            // on the host (see smallsh_history.c). enable disables (-n) or
+            // re-enables in-process built-ins, or lists them (see
+            // smallsh_builtins.c). Their status is the foreground status.
+            int builtin_value;
+            if (builtin == BUILTIN_HISTORY)
+                builtin_value = history_print(user_input);
+            else
+                builtin_value = builtin_enable(user_input);
+            set_fg_value(builtin_value);
+            // Reset prompt
+            continue;
+        }
 
-                // Set file descriptor flag for output_fd to close on exec
-                fcntl(output_fd, F_SETFD, FD_CLOEXEC);
-            }
+        /* IN-PROCESS COMMANDS */
+        // echo, true, false, test, [, pwd and printf run in the shell itself
+        // instead of being launched, unless part of a pipeline, in the
+        // background, timed, cached or given controls. Their status is the
+        // foreground status.
+        if (builtin >= BUILTIN_FIRST_COMMAND && user_input->next == NULL &&
+            user_input->bg_process == '\0' && !timed && controls == NULL && cache == NULL)
+        {
+            int builtin_value = builtin_run(builtin, user_input);
+            set_fg_value(builtin_value);
+            if (!batch_mode)
+                fflush(stdout);
+            continue;
+        }
 
-            // Call exec function to replace process
-            execvp(user_input->cmd, user_input->cmd_args);
+        /* NON BUILT-IN COMMANDS */
 
-            // If function returned, error occurred. Print error and exit.
-            fprintf(stderr, "execvp(): %s: ", user_input->cmd);
-            perror("");
-            fflush(stderr);
-            exit(EXIT_FAILURE);
+        // Only the dispatch is counted for external commands
+        stats_record(STAT_BUILTIN, builtin_start);
+        builtin_start = 0;
 
-        default:
-            /* PARENT PROCESS BRANCH */
+        if (DEBUG1)
+            printf("Not a built-in command...\n");
 
-            // Child is a foreground process
-            if (user_input->bg_process == '\0')
+        // Launch every stage of the pipeline with the selected engine
+        // (see smallsh_spawn.c)
+        int num_stages = 0;
+        for (struct user_input *stage = user_input; stage; stage = stage->next)
+            num_stages++;
+        pid_t *stage_pids = arena_alloc(&parse_arena, num_stages * sizeof(pid_t));
+
+        // A cached foreground command whose result is stored is not run:
+        // its output is replayed and its exit value is the status. On a
+        // miss, the output is captured until the pipeline completes.
+        int cache_state = -1;
+        if (cache)
+        {
+            int cached_value = 0;
+            cache_state = cache_begin(cache, user_input, &cached_value);
+            if (cache_state == 1)
             {
-                // Wait here until child process completes.
-                sigaction(SIGCHLD, &SIGCHLD_action, NULL);
-                while(waitpid(spawnpid, &fg_status, WNOHANG) != spawnpid)
-                    pause();
-                sigaction(SIGCHLD, &default_action, NULL);
-                if (WIFSIGNALED(fg_status))
-                    printf("terminated by signal %d\n", WTERMSIG(fg_status));
+                set_fg_value(cached_value);
+                if (!batch_mode)
+                    fflush(stdout);
+                continue;
             }
+        }
 
-            // Child is a background process
-            else
+        // Output of built-ins must come before any output of the children.
+        // stdout is not flushed after each line in batch mode.
+        fflush(stdout);
+        struct timespec launch_time;
+        clock_gettime(CLOCK_MONOTONIC, &launch_time);
+        uint64_t spawn_start = stats_now();
+        int num_launched = spawn_pipeline(user_input, stage_pids);
+        stats_record(STAT_SPAWN, spawn_start);
+
+        // Jobs list the command's own output file, not the capture
+        if (cache_state == 0)
+        {
+            struct user_input *last = user_input;
+            while (last->next)
+                last = last->next;
+            last->output_file = cache->output_file;
+        }
+
+        // Track the launched processes as a job. A background job's
+        // process group is led by its first launched stage.
+        struct job *job = NULL;
+        if (num_launched > 0)
+        {
+            pid_t pgid = 0;
+            for (int i = 0; user_input->bg_process && pgid == 0 && i < num_stages; i++)
             {
-                // Print pid of background process
-                printf("background pid is %d\n", spawnpid);
+                if (stage_pids[i] != -1)
+                    pgid = stage_pids[i];
+            }
+            char *cmd_line = build_cmd_line(&parse_arena, user_input);
+            job = job_add(stage_pids, num_stages, pgid, cmd_line, user_input->bg_process != '\0');
+        }
+
+        // Pipeline is a foreground process
+        if (user_input->bg_process == '\0')
+        {
+            // Wait here until every stage completes, unless the job is
+            // stopped. A stage that could not be launched has exit status 1,
+            // as if its child had exited with it. The status of the pipeline
+            // is that of its last stage.
+            if (job == NULL || wait_job(job) == 0)
+            {
+                free(fg_stage_statuses);
+                fg_stage_statuses = calloc(num_stages, sizeof(int));
+                fg_num_stages = num_stages;
+                for (int i = 0, p = 0; i < num_stages; i++)
+                {
+                    if (stage_pids[i] == -1)
+                        fg_stage_statuses[i] = EXIT_FAILURE << 8;
+                    else
+                        fg_stage_statuses[i] = job->procs[p++].status;
+                }
+                elapsed_since(&launch_time, &fg_wall);
+                memset(&fg_usage, '\0', sizeof(struct rusage));
+                if (job)
+                {
+                    job_usage(job, &fg_usage);
+                    record_run_time(job);
+                    job_remove(job);
+                }
+                fg_status = fg_stage_statuses[num_stages - 1];
+                history_set_status(exit_value(fg_status));
+                if (cache_state == 0)
+                    cache_finish(cache, fg_status, num_launched == num_stages);
+
+                // Report the first stage terminated by a signal. SIGPIPE in a
+                // stage that is not last is the normal end of an early reader.
+                for (int i = 0; i < num_stages; i++)
+                {
+                    if (WIFSIGNALED(fg_stage_statuses[i]) &&
+                        !(i < num_stages - 1 && WTERMSIG(fg_stage_statuses[i]) == SIGPIPE))
+                    {
+                        printf("terminated by signal %d\n", WTERMSIG(fg_stage_statuses[i]));
+                        break;
+                    }
+                }
 
-                // Store child's pid in bg_pids_arr.
-                if (arr_add(&bg_pids_arr, &bg_pids_arr_size, spawnpid, &num_bg_procs) != 0)
-                    exit(1);
+                if (timed)
+                {
+                    fflush(stdout);
+                    print_usage(stderr, &fg_wall, &fg_usage);
+                }
+
+                if (exit_on_error && fg_status != 0)
+                    exit_shell(exit_value(fg_status));
             }
+            // A stopped job's output so far is delivered, but not stored
+            else if (cache_state == 0)
+                cache_finish(cache, fg_status, 0);
         }
+
+        // Pipeline is a background process
+        else
+        {
+            // Print pid of each background process
+            for (int i = 0; i < num_stages; i++)
+            {
+                if (stage_pids[i] != -1)
+                {
+                    printf("background pid is %d\n", stage_pids[i]);
+                    vars_set_last_bg(stage_pids[i]);
+                }
+            }
+        }
+        if (!batch_mode)
+            fflush(stdout);
     } // Main loop
 
     // Free memory. Won't be reached anyway.
-    if (user_input->cmd)
-        free(user_input->cmd);
-    if (user_input->input_file)
-        free(user_input->input_file);
-    if (user_input->output_file)
-        free(user_input->output_file);
-    if (user_input->cmd_args[0])
-    {
-        for (int i = 0; i < user_input->num_cmd_args; i++)
-            free(user_input->cmd_args[i]);
-    }
-    free(user_input->cmd_args);
-    free(user_input);
-    free(input_buf);
-    free(bg_pids_arr);
+    arena_destroy(&parse_arena);
+    reader_close(&script);
+    free(fg_stage_statuses);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,24 @@
+#ifndef SMALLSH_H
+#define SMALLSH_H
+
+// Initial size of cmd_args, which is doubled as arguments are added
+#define INIT_ARGS 16
+
+struct spawn_controls;
+
+// Struct for holding parsed user input. A pipeline is a list of these linked
+// through next; bg_process is only meaningful on the first stage.
+struct user_input
+{
+    char *cmd;
+    char bg_process;
+    char *input_file, *output_file;
+    char *here_data;    // Input given by a here-doc or here-string, or NULL
+    size_t here_len;
+    struct spawn_controls *controls;    // Given by nice, pin and limit, or NULL
+    int num_cmd_args;
+    char **cmd_args;
+    struct user_input *next;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smallsh_arena.h"
+
+#define DEBUGARENA 0
+
+// Every allocation is aligned to this many bytes
+#define ARENA_ALIGN 16
+
+/*  Initializes ARENA, whose blocks will hold at least BLOCK_SIZE bytes.
+    No memory is allocated until the first allocation.
+ */
+void arena_init(struct arena *arena, size_t block_size)
+{
+    memset(arena, '\0', sizeof(struct arena));
+    arena->block_size = block_size;
+}
+
+/*  Returns a new block able to hold at least SIZE bytes.
+ */
+static struct arena_block *new_block(struct arena *arena, size_t size)
+{
+    if (size < arena->block_size)
+        size = arena->block_size;
+
+    struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+    if (block == NULL)
+    {
+        perror("arena: malloc()");
+        exit(1);
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    arena->reserved += size;
+    arena->num_blocks++;
+
+    if (DEBUGARENA)
+        printf("arena: new block of %zu bytes\n", size);
+
+    return block;
+}
+
+/*  Returns SIZE bytes of uninitialized memory from ARENA, valid until the
+    next arena_reset(). Blocks kept from earlier commands are reused before
+    new ones are allocated.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (arena->cur == NULL)
+    {
+        if (arena->first == NULL)
+            arena->first = new_block(arena, size);
+        arena->cur = arena->first;
+    }
+
+    // Move on to the next kept block that fits, or append a new one
+    while (arena->cur->used + size > arena->cur->size)
+    {
+        if (arena->cur->next == NULL)
+            arena->cur->next = new_block(arena, size);
+        arena->cur = arena->cur->next;
+    }
+
+    void *ptr = arena->cur->data + arena->cur->used;
+    arena->cur->used += size;
+
+    arena->in_use += size;
+    if (arena->in_use > arena->high_water)
+        arena->high_water = arena->in_use;
+
+    return ptr;
+}
+
+/*  Same as arena_alloc(), but the memory is zeroed.
+ */
+void *arena_calloc(struct arena *arena, size_t size)
+{
+    void *ptr = arena_alloc(arena, size);
+    memset(ptr, '\0', size);
+    return ptr;
+}
+
+/*  Returns a copy of STR allocated from ARENA.
+ */
+char *arena_strdup(struct arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+/*  Releases everything allocated from ARENA in one step. Its blocks are kept
+    for reuse.
+ */
+void arena_reset(struct arena *arena)
+{
+    for (struct arena_block *block = arena->first; block; block = block->next)
+        block->used = 0;
+    arena->cur = arena->first;
+    arena->in_use = 0;
+}
+
+/*  Frees every block of ARENA.
+ */
+void arena_destroy(struct arena *arena)
+{
+    struct arena_block *block = arena->first;
+    while (block)
+    {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena_init(arena, arena->block_size);
+}
+
+/*  Prints the memory footprint of ARENA, labeled NAME.
+ */
+void arena_print(struct arena *arena, const char *name)
+{
+    printf("%s: %zu bytes in use, high-water %zu bytes, %zu bytes reserved in %d blocks\n",
+           name, arena->in_use, arena->high_water, arena->reserved, arena->num_blocks);
+}
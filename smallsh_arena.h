@@ -0,0 +1,36 @@
+#ifndef SMALLSH_ARENA_H
+#define SMALLSH_ARENA_H
+
+#include <stddef.h>
+
+// A block of memory that allocations are carved from
+struct arena_block
+{
+    struct arena_block *next;
+    size_t size;        // Usable bytes in data
+    size_t used;
+    char data[];
+};
+
+// Bump allocator. Everything allocated from it is released at once by
+// arena_reset().
+struct arena
+{
+    struct arena_block *first;  // First block, kept across resets
+    struct arena_block *cur;    // Block allocations are currently made from
+    size_t block_size;          // Minimum size of a new block
+    size_t in_use;              // Bytes allocated since the last reset
+    size_t high_water;          // Largest in_use ever reached
+    size_t reserved;            // Bytes held in all blocks
+    int num_blocks;
+};
+
+void arena_init(struct arena *arena, size_t block_size);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_calloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+void arena_reset(struct arena *arena);
+void arena_destroy(struct arena *arena);
+void arena_print(struct arena *arena, const char *name);
+
+#endif
@@ -0,0 +1,775 @@
+#define _GNU_SOURCE
+// F_DUPFD_CLOEXEC, faccessat with AT_EACCESS
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "smallsh_builtins.h"
+#include "smallsh_spawn.h"
+
+#define DEBUGBUILTINS 0
+
+static const char *builtin_names[NUM_BUILTINS] = {
+    NULL, "exit", "cd", "status", "hash", "jobs", "fg", "bg", "kill", "stats",
+    "parallel", "enable", "history", "export", "unset", "echo", "true", "false",
+    "test", "[", "pwd", "printf"
+};
+
+// In-process built-ins disabled with "enable -n"
+static char disabled[NUM_BUILTINS];
+
+/*  Returns ID if NAME is the name of built-in ID, or else BUILTIN_NONE.
+ */
+static enum builtin_id match(const char *name, enum builtin_id id)
+{
+    return strcmp(name, builtin_names[id]) == 0 ? id : BUILTIN_NONE;
+}
+
+/*  Returns the built-in named NAME, enabled or not, or BUILTIN_NONE. The
+    first one or two characters select the only possible match, so at most
+    two strcmp() are made, however many built-ins there are.
+ */
+static enum builtin_id find_builtin(const char *name)
+{
+    switch (name[0])
+    {
+    case '[':
+        return match(name, BUILTIN_BRACKET);
+    case 'b':
+        return match(name, BUILTIN_BG);
+    case 'c':
+        return match(name, BUILTIN_CD);
+    case 'e':
+        if (name[1] == 'x')
+            return match(name, name[2] == 'i' ? BUILTIN_EXIT : BUILTIN_EXPORT);
+        return match(name, name[1] == 'c' ? BUILTIN_ECHO : BUILTIN_ENABLE);
+    case 'f':
+        return match(name, name[1] == 'g' ? BUILTIN_FG : BUILTIN_FALSE);
+    case 'h':
+        return match(name, name[1] == 'a' ? BUILTIN_HASH : BUILTIN_HISTORY);
+    case 'j':
+        return match(name, BUILTIN_JOBS);
+    case 'k':
+        return match(name, BUILTIN_KILL);
+    case 'p':
+        if (name[1] == 'a')
+            return match(name, BUILTIN_PARALLEL);
+        return match(name, name[1] == 'w' ? BUILTIN_PWD : BUILTIN_PRINTF);
+    case 's':
+        if (match(name, BUILTIN_STATUS))
+            return BUILTIN_STATUS;
+        return match(name, BUILTIN_STATS);
+    case 't':
+        return match(name, name[1] == 'r' ? BUILTIN_TRUE : BUILTIN_TEST);
+    case 'u':
+        return match(name, BUILTIN_UNSET);
+    default:
+        return BUILTIN_NONE;
+    }
+}
+
+/*  Returns the built-in command named NAME, or BUILTIN_NONE if it is not
+    one or is an in-process built-in that has been disabled.
+ */
+enum builtin_id builtin_lookup(const char *name)
+{
+    enum builtin_id id = find_builtin(name);
+    if (disabled[id])
+        return BUILTIN_NONE;
+    return id;
+}
+
+
+/* ESCAPES */
+
+/*  Prints the character escaped by the backslash sequence at P (pointing
+    past the backslash), and returns the number of characters of it read.
+    With ECHO_OCTAL, octal escapes are "\0NNN", as for echo -e and %b;
+    otherwise "\NNN", as in a printf format. Sets *STOP for "\c".
+ */
+static size_t print_escape(const char *p, int echo_octal, int *stop)
+{
+    static const char *from = "\\abefnrtv\"";
+    static const char *to = "\\\a\b\033\f\n\r\t\v\"";
+
+    const char *found = *p ? strchr(from, *p) : NULL;
+    if (found)
+    {
+        putchar(to[found - from]);
+        return 1;
+    }
+    if (*p == 'c')
+    {
+        *stop = 1;
+        return 1;
+    }
+
+    // Octal, and hexadecimal "\xHH"
+    size_t len = 0;
+    int value = 0;
+    if (*p >= '0' && *p <= '7' && (!echo_octal || *p == '0'))
+    {
+        if (echo_octal && *p == '0')
+            len++;
+        size_t start = len;
+        while (len - start < 3 && p[len] >= '0' && p[len] <= '7')
+            value = value * 8 + (p[len++] - '0');
+        putchar(value);
+        return len;
+    }
+    if (*p == 'x')
+    {
+        len = 1;
+        while (len < 3 && p[len] && strchr("0123456789abcdefABCDEF", p[len]))
+        {
+            char c = p[len++];
+            value = value * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+        }
+        if (len > 1)
+        {
+            putchar(value);
+            return len;
+        }
+    }
+
+    // Not an escape: print it as it is
+    putchar('\\');
+    return 0;
+}
+
+/*  Prints STR, interpreting backslash escapes as echo -e does. Returns 1 if
+    "\c" stopped the output, or else 0.
+ */
+static int print_escaped(const char *str)
+{
+    int stop = 0;
+    for (const char *p = str; *p && !stop; p++)
+    {
+        if (*p == '\\' && p[1])
+            p += print_escape(p + 1, 1, &stop);
+        else
+            putchar(*p);
+    }
+    return stop;
+}
+
+
+/* COMMANDS */
+
+/*  echo [-neE] [string ...]
+    Options are recognized as by /bin/echo: only words made entirely of
+    n, e and E after the '-'.
+ */
+static int run_echo(int argc, char **argv)
+{
+    int newline = 1;
+    int escapes = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+        if (argv[i][strspn(argv[i] + 1, "neE") + 1] != '\0')
+            break;
+        for (const char *p = argv[i] + 1; *p; p++)
+        {
+            if (*p == 'n')
+                newline = 0;
+            else
+                escapes = *p == 'e';
+        }
+    }
+
+    for (; i < argc; i++)
+    {
+        if (escapes && print_escaped(argv[i]))
+            return EXIT_SUCCESS;
+        if (!escapes)
+            fputs(argv[i], stdout);
+        if (i + 1 < argc)
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+    return EXIT_SUCCESS;
+}
+
+static int run_true(int argc, char **argv)
+{
+    return EXIT_SUCCESS;
+}
+
+static int run_false(int argc, char **argv)
+{
+    return EXIT_FAILURE;
+}
+
+/*  pwd [-L | -P]
+    Prints the physical working directory, or with -L, $PWD if it names the
+    same directory.
+ */
+static int run_pwd(int argc, char **argv)
+{
+    int logical = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-L") == 0)
+            logical = 1;
+        else if (strcmp(argv[i], "-P") == 0)
+            logical = 0;
+        else
+        {
+            fprintf(stderr, "pwd: %s: invalid argument\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char *pwd = getenv("PWD");
+    struct stat pwd_st, dot_st;
+    if (logical && pwd && pwd[0] == '/' && stat(pwd, &pwd_st) == 0 && stat(".", &dot_st) == 0 &&
+        pwd_st.st_dev == dot_st.st_dev && pwd_st.st_ino == dot_st.st_ino)
+    {
+        puts(pwd);
+        return EXIT_SUCCESS;
+    }
+
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+    {
+        perror("pwd: getcwd()");
+        return EXIT_FAILURE;
+    }
+    puts(cwd);
+    free(cwd);
+    return EXIT_SUCCESS;
+}
+
+
+/* TEST */
+
+// Arguments of test being parsed, and whether they were malformed
+struct test_args
+{
+    char **argv;
+    int argc;
+    int pos;
+    int error;
+};
+
+/*  Prints the error MESSAGE about ARG and marks ARGS as malformed.
+ */
+static void test_error(struct test_args *args, const char *message, const char *arg)
+{
+    if (!args->error)
+    {
+        if (arg)
+            fprintf(stderr, "test: %s: %s\n", arg, message);
+        else
+            fprintf(stderr, "test: %s\n", message);
+    }
+    args->error = 1;
+}
+
+static int is_binary_op(const char *op)
+{
+    static const char *ops[] = {
+        "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        if (strcmp(op, ops[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int is_unary_op(const char *op)
+{
+    return op[0] == '-' && op[1] && strchr("bcdefghkLnprsStuwxzGO", op[1]) && op[2] == '\0';
+}
+
+/*  Returns the integer ARG, or 0 after marking ARGS as malformed.
+ */
+static long long test_integer(struct test_args *args, const char *arg)
+{
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 10);
+    while (*end == ' ' || *end == '\t')
+        end++;
+    if (end == arg || *end != '\0' || errno == ERANGE)
+        test_error(args, "integer expression expected", arg);
+    return value;
+}
+
+/*  Evaluates the unary primary OP ARG.
+ */
+static int test_unary(struct test_args *args, const char *op, const char *arg)
+{
+    struct stat st;
+    switch (op[1])
+    {
+    case 'n':
+        return arg[0] != '\0';
+    case 'z':
+        return arg[0] == '\0';
+    case 't':
+        return isatty((int)test_integer(args, arg));
+    case 'h':
+    case 'L':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r':
+        return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+    case 'w':
+        return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+    case 'x':
+        return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+    }
+
+    if (stat(arg, &st) == -1)
+        return 0;
+    switch (op[1])
+    {
+    case 'b':
+        return S_ISBLK(st.st_mode);
+    case 'c':
+        return S_ISCHR(st.st_mode);
+    case 'd':
+        return S_ISDIR(st.st_mode);
+    case 'f':
+        return S_ISREG(st.st_mode);
+    case 'p':
+        return S_ISFIFO(st.st_mode);
+    case 'S':
+        return S_ISSOCK(st.st_mode);
+    case 'g':
+        return (st.st_mode & S_ISGID) != 0;
+    case 'u':
+        return (st.st_mode & S_ISUID) != 0;
+    case 'k':
+        return (st.st_mode & S_ISVTX) != 0;
+    case 's':
+        return st.st_size > 0;
+    case 'G':
+        return st.st_gid == getegid();
+    case 'O':
+        return st.st_uid == geteuid();
+    default:
+        // -e
+        return 1;
+    }
+}
+
+/*  Evaluates the binary primary LEFT OP RIGHT.
+ */
+static int test_binary(struct test_args *args, const char *left, const char *op, const char *right)
+{
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        return strcmp(left, right) == 0;
+    if (strcmp(op, "!=") == 0)
+        return strcmp(left, right) != 0;
+
+    if ((op[1] == 'n' && op[2] == 't') || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f'))
+    {
+        struct stat left_st, right_st;
+        int left_ok = stat(left, &left_st) == 0;
+        int right_ok = stat(right, &right_st) == 0;
+        if (op[1] == 'e')
+            return left_ok && right_ok && left_st.st_dev == right_st.st_dev &&
+                   left_st.st_ino == right_st.st_ino;
+        if (op[1] == 'o')
+        {
+            const char *swap = left;
+            left = right;
+            right = swap;
+            struct stat swap_st = left_st;
+            left_st = right_st;
+            right_st = swap_st;
+            int swap_ok = left_ok;
+            left_ok = right_ok;
+            right_ok = swap_ok;
+        }
+        if (!left_ok)
+            return 0;
+        if (!right_ok)
+            return 1;
+        return left_st.st_mtim.tv_sec > right_st.st_mtim.tv_sec ||
+               (left_st.st_mtim.tv_sec == right_st.st_mtim.tv_sec &&
+                left_st.st_mtim.tv_nsec > right_st.st_mtim.tv_nsec);
+    }
+
+    long long a = test_integer(args, left);
+    long long b = test_integer(args, right);
+    switch (op[1] << 8 | op[2])
+    {
+    case 'e' << 8 | 'q':
+        return a == b;
+    case 'n' << 8 | 'e':
+        return a != b;
+    case 'l' << 8 | 't':
+        return a < b;
+    case 'l' << 8 | 'e':
+        return a <= b;
+    case 'g' << 8 | 't':
+        return a > b;
+    default:
+        return a >= b;
+    }
+}
+
+static int test_or(struct test_args *args);
+
+/*  primary: ( expression ) | string op string | -op string | string
+    A binary operator in second place takes precedence, as POSIX requires
+    for three arguments.
+ */
+static int test_primary(struct test_args *args)
+{
+    if (args->pos >= args->argc)
+    {
+        test_error(args, "argument expected", NULL);
+        return 0;
+    }
+    char **argv = args->argv;
+    int pos = args->pos;
+
+    if (pos + 2 < args->argc && is_binary_op(argv[pos + 1]))
+    {
+        args->pos += 3;
+        return test_binary(args, argv[pos], argv[pos + 1], argv[pos + 2]);
+    }
+    if (strcmp(argv[pos], "(") == 0 && pos + 1 < args->argc)
+    {
+        args->pos++;
+        int result = test_or(args);
+        if (args->pos >= args->argc || strcmp(argv[args->pos], ")") != 0)
+            test_error(args, "')' expected", NULL);
+        args->pos++;
+        return result;
+    }
+    if (is_unary_op(argv[pos]) && pos + 1 < args->argc)
+    {
+        args->pos += 2;
+        return test_unary(args, argv[pos], argv[pos + 1]);
+    }
+    args->pos++;
+    return argv[pos][0] != '\0';
+}
+
+/*  not: ! not | primary
+ */
+static int test_not(struct test_args *args)
+{
+    if (args->pos + 1 < args->argc && strcmp(args->argv[args->pos], "!") == 0)
+    {
+        args->pos++;
+        return !test_not(args);
+    }
+    return test_primary(args);
+}
+
+/*  and: not [-a and]
+ */
+static int test_and(struct test_args *args)
+{
+    int result = test_not(args);
+    while (args->pos < args->argc && strcmp(args->argv[args->pos], "-a") == 0)
+    {
+        args->pos++;
+        result = test_not(args) && result;
+    }
+    return result;
+}
+
+/*  expression: and [-o expression]
+ */
+static int test_or(struct test_args *args)
+{
+    int result = test_and(args);
+    while (args->pos < args->argc && strcmp(args->argv[args->pos], "-o") == 0)
+    {
+        args->pos++;
+        result = test_and(args) || result;
+    }
+    return result;
+}
+
+/*  test expression, or [ expression ]
+    Exits with 0 if the expression is true, 1 if false, or 2 if malformed.
+ */
+static int run_test(int argc, char **argv)
+{
+    if (strcmp(argv[0], "[") == 0)
+    {
+        if (strcmp(argv[argc - 1], "]") != 0)
+        {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    struct test_args args = {argv + 1, argc - 1, 0, 0};
+    if (args.argc == 0)
+        return EXIT_FAILURE;
+    int result = test_or(&args);
+    if (args.pos < args.argc)
+        test_error(&args, "extra argument", args.argv[args.pos]);
+    if (args.error)
+        return 2;
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* PRINTF */
+
+/*  Returns the numeric argument ARG of printf: decimal, octal with a leading
+    0, hexadecimal with 0x, or the code of the character after a leading
+    quote. Sets *STATUS to 1 after printing an error if it is not a number.
+ */
+static long long printf_integer(const char *arg, int *status)
+{
+    if (arg[0] == '\'' || arg[0] == '"')
+        return (unsigned char)arg[1];
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if ((*end != '\0' || errno == ERANGE) && *arg != '\0')
+    {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = EXIT_FAILURE;
+    }
+    return value;
+}
+
+/*  As printf_integer(), for floating-point arguments.
+ */
+static double printf_double(const char *arg, int *status)
+{
+    if (arg[0] == '\'' || arg[0] == '"')
+        return (unsigned char)arg[1];
+    char *end;
+    double value = strtod(arg, &end);
+    if (*end != '\0' && *arg != '\0')
+    {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = EXIT_FAILURE;
+    }
+    return value;
+}
+
+/*  printf format [argument ...]
+    The format is reused until every argument is consumed, as by
+    /bin/printf. Supports the escapes of the format and %b, and the
+    conversions s, b, c, d, i, o, u, x, X, e, E, f, F, g, G, a, A and %,
+    with flags, width and precision (not '*').
+ */
+static int run_printf(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "printf: missing operand\n");
+        return EXIT_FAILURE;
+    }
+    const char *format = argv[1];
+    int arg = 2;
+    int status = EXIT_SUCCESS;
+
+    do
+    {
+        int first_arg = arg;
+        for (const char *p = format; *p; p++)
+        {
+            if (*p == '\\' && p[1])
+            {
+                int stop = 0;
+                p += print_escape(p + 1, 0, &stop);
+                if (stop)
+                    return status;
+                continue;
+            }
+            if (*p != '%')
+            {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%')
+            {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            // Copy the flags, width and precision, leaving room for a
+            // length modifier and the conversion
+            char spec[32];
+            size_t len = 0;
+            spec[len++] = '%';
+            const char *q = p + 1;
+            while (*q && strchr("-+ #0123456789.", *q) && len < sizeof(spec) - 4)
+                spec[len++] = *q++;
+            const char *value = arg < argc ? argv[arg++] : "";
+
+            switch (*q)
+            {
+            case 's':
+                spec[len++] = 's';
+                spec[len] = '\0';
+                printf(spec, value);
+                break;
+            case 'b':
+                if (print_escaped(value))
+                    return status;
+                break;
+            case 'c':
+                if (*value)
+                    putchar(*value);
+                break;
+            case 'd':
+            case 'i':
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = 'd';
+                spec[len] = '\0';
+                printf(spec, printf_integer(value, &status));
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = *q;
+                spec[len] = '\0';
+                printf(spec, (unsigned long long)printf_integer(value, &status));
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                spec[len++] = *q;
+                spec[len] = '\0';
+                printf(spec, printf_double(value, &status));
+                break;
+            default:
+                fprintf(stderr, "printf: %.*s: invalid conversion\n", (int)(q - p + (*q != '\0')), p);
+                return EXIT_FAILURE;
+            }
+            p = q;
+        }
+
+        // A format that uses no argument is printed once
+        if (arg == first_arg)
+            break;
+    } while (arg < argc);
+
+    return status;
+}
+
+
+/* DISPATCH */
+
+static int (*const commands[NUM_BUILTINS])(int argc, char **argv) = {
+    [BUILTIN_ECHO] = run_echo,
+    [BUILTIN_TRUE] = run_true,
+    [BUILTIN_FALSE] = run_false,
+    [BUILTIN_TEST] = run_test,
+    [BUILTIN_BRACKET] = run_test,
+    [BUILTIN_PWD] = run_pwd,
+    [BUILTIN_PRINTF] = run_printf,
+};
+
+/*  Runs the in-process built-in ID for the command USER_INPUT, which must
+    not be part of a pipeline, and returns its exit value. Redirections are
+    opened as for an external command, and the shell's own stdout is pointed
+    at the output file while the built-in runs. None of the built-ins read
+    input, but an input file is still opened, so a missing one is an error
+    as before. Output goes through the stdio buffer of the shell, so in batch
+    mode it is written in large blocks with the shell's own output.
+ */
+int builtin_run(enum builtin_id id, struct user_input *user_input)
+{
+    int in_fd, out_fd;
+    if (spawn_open_redirections(user_input, 0, 0, &in_fd, &out_fd) == -1)
+        return EXIT_FAILURE;
+    if (in_fd != -1)
+        close(in_fd);
+
+    int saved_fd = -1;
+    if (out_fd != -1)
+    {
+        fflush(stdout);
+        saved_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        if (saved_fd == -1 || dup2(out_fd, STDOUT_FILENO) == -1)
+        {
+            perror("error redirecting output: dup2()");
+            fflush(stderr);
+            close(out_fd);
+            if (saved_fd != -1)
+                close(saved_fd);
+            return EXIT_FAILURE;
+        }
+        close(out_fd);
+    }
+
+    if (DEBUGBUILTINS)
+        fprintf(stderr, "builtin: running %s in-process\n", builtin_names[id]);
+    int value = commands[id](user_input->num_cmd_args, user_input->cmd_args);
+
+    if (saved_fd != -1)
+    {
+        fflush(stdout);
+        dup2(saved_fd, STDOUT_FILENO);
+        close(saved_fd);
+    }
+    fflush(stderr);
+    return value;
+}
+
+/*  enable [-n] [name ...]
+    With no names, lists the in-process built-ins and whether each is
+    enabled. Otherwise enables each one named, or with -n disables it, so
+    the external command of that name runs instead. Returns 0, or 1 if a
+    name is not an in-process built-in.
+ */
+int builtin_enable(struct user_input *user_input)
+{
+    int i = 1;
+    int disable = 0;
+    if (i < user_input->num_cmd_args && strcmp(user_input->cmd_args[i], "-n") == 0)
+    {
+        disable = 1;
+        i++;
+    }
+
+    if (i == user_input->num_cmd_args)
+    {
+        for (int id = BUILTIN_FIRST_COMMAND; id < NUM_BUILTINS; id++)
+        {
+            if (!disable || disabled[id])
+                printf("enable %s%s\n", disabled[id] ? "-n " : "", builtin_names[id]);
+        }
+        fflush(stdout);
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (; i < user_input->num_cmd_args; i++)
+    {
+        enum builtin_id id = find_builtin(user_input->cmd_args[i]);
+        if (id < BUILTIN_FIRST_COMMAND)
+        {
+            fprintf(stderr, "enable: %s: not an in-process built-in\n", user_input->cmd_args[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        disabled[id] = disable;
+    }
+    fflush(stderr);
+    return status;
+}
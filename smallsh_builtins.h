@@ -0,0 +1,44 @@
+#ifndef SMALLSH_BUILTINS_H
+#define SMALLSH_BUILTINS_H
+
+#include "smallsh.h"
+
+// Built-in commands, as found by builtin_lookup()
+enum builtin_id
+{
+    BUILTIN_NONE,       // Not a built-in: an external command
+    // Shell built-ins, run by main()
+    BUILTIN_EXIT,
+    BUILTIN_CD,
+    BUILTIN_STATUS,
+    BUILTIN_HASH,
+    BUILTIN_JOBS,
+    BUILTIN_FG,
+    BUILTIN_BG,
+    BUILTIN_KILL,
+    BUILTIN_STATS,
+    BUILTIN_PARALLEL,
+    BUILTIN_ENABLE,
+    BUILTIN_HISTORY,
+    BUILTIN_EXPORT,
+    BUILTIN_UNSET,
+    // In-process versions of external commands, run by builtin_run(). Each
+    // can be disabled with "enable -n", so the external command runs.
+    BUILTIN_ECHO,
+    BUILTIN_TRUE,
+    BUILTIN_FALSE,
+    BUILTIN_TEST,
+    BUILTIN_BRACKET,
+    BUILTIN_PWD,
+    BUILTIN_PRINTF,
+    NUM_BUILTINS
+};
+
+// First in-process built-in
+#define BUILTIN_FIRST_COMMAND BUILTIN_ECHO
+
+enum builtin_id builtin_lookup(const char *name);
+int builtin_run(enum builtin_id id, struct user_input *user_input);
+int builtin_enable(struct user_input *user_input);
+
+#endif
@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+// copy_file_range, O_CLOEXEC
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "smallsh_cache.h"
+#include "smallsh_pathcache.h"
+#include "smallsh_controls.h"
+
+#define DEBUGCACHE 0
+
+// The index is a fixed table of CACHE_SLOTS records after a header, mapped
+// MAP_SHARED and locked with flock() by every shell using the cache
+#define CACHE_MAGIC 0x31484353534d53ull     // "SMSCHH1"
+#define CACHE_SLOTS 4096
+
+// Total size of the stored outputs, unless SMALLSH_CACHE_SIZE is set
+#define CACHE_DEFAULT_SIZE (256ull << 20)
+
+struct cache_header
+{
+    uint64_t magic;
+    uint64_t total_size;        // Bytes of all stored outputs
+    char pad[48];
+};
+
+// A stored result. Its output is the file named by the key in hex.
+struct cache_record
+{
+    unsigned char key[16];
+    uint64_t size;              // Bytes of output
+    uint64_t last_used;         // Wall time of the last store or hit, in ns
+    int32_t status;             // Exit value
+    int32_t used;               // Non-zero if the record holds a result
+};
+
+_Static_assert(sizeof(struct cache_header) == 64, "cache header size");
+_Static_assert(sizeof(struct cache_record) == 40, "cache record size");
+
+// Cache directory and mapped index, set up on first use by cache_open()
+static char cache_dir[4096];
+static int index_fd = -1;
+static struct cache_header *header = NULL;
+static struct cache_record *records = NULL;
+static uint64_t size_cap = CACHE_DEFAULT_SIZE;
+static int open_failed = 0;
+
+// 128-bit FNV-1a
+__extension__ typedef unsigned __int128 hash128;
+
+/*  Adds the LEN bytes at DATA, preceded by their length so that fields
+    cannot run together, to the hash *HASH.
+ */
+static void hash_field(hash128 *hash, const void *data, size_t len)
+{
+    const hash128 prime = ((hash128)1 << 88) | 0x13b;
+    uint64_t len64 = len;
+    const unsigned char *parts[2] = {(const unsigned char *)&len64, data};
+    size_t lens[2] = {sizeof(len64), len};
+    for (int part = 0; part < 2; part++)
+    {
+        for (size_t i = 0; i < lens[part]; i++)
+        {
+            *hash ^= parts[part][i];
+            *hash *= prime;
+        }
+    }
+}
+
+/*  Adds the identity and modification time of the file at PATH, or the
+    error that prevents finding them, to the hash *HASH. A file is assumed
+    unchanged while these are.
+ */
+static void hash_file(hash128 *hash, const char *path)
+{
+    struct stat st;
+    int64_t fields[5] = {0};
+    if (stat(path, &st) == 0)
+    {
+        fields[0] = (int64_t)st.st_ino;
+        fields[1] = (int64_t)st.st_dev;
+        fields[2] = (int64_t)st.st_size;
+        fields[3] = (int64_t)st.st_mtim.tv_sec;
+        fields[4] = (int64_t)st.st_mtim.tv_nsec;
+    }
+    else
+        fields[0] = -errno;
+    hash_field(hash, path, strlen(path));
+    hash_field(hash, fields, sizeof(fields));
+}
+
+/*  Returns the current wall time in nanoseconds.
+ */
+static uint64_t wall_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/*  Returns the cache directory, $SMALLSH_CACHE_DIR, or else smallsh in
+    $XDG_CACHE_HOME or ~/.cache, creating it on first use. Returns NULL,
+    with errno set, if it cannot be created.
+ */
+static const char *cache_directory(void)
+{
+    static int created = 0;
+    if (created)
+        return cache_dir;
+
+    char *dir = getenv("SMALLSH_CACHE_DIR");
+    if (dir && *dir)
+        snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+    else
+    {
+        char parent[4080];
+        char *xdg = getenv("XDG_CACHE_HOME");
+        char *home = getenv("HOME");
+        if (xdg && *xdg)
+            snprintf(parent, sizeof(parent), "%s", xdg);
+        else if (home)
+            snprintf(parent, sizeof(parent), "%s/.cache", home);
+        else
+        {
+            errno = ENOENT;
+            return NULL;
+        }
+        mkdir(parent, 0700);
+        snprintf(cache_dir, sizeof(cache_dir), "%s/smallsh", parent);
+    }
+    if (mkdir(cache_dir, 0700) == -1 && errno != EEXIST)
+        return NULL;
+    created = 1;
+    return cache_dir;
+}
+
+/*  Maps the index of the cache directory, creating it if needed.
+    SMALLSH_CACHE_SIZE, in bytes with an optional K, M or G, caps the total
+    size of the stored outputs. Returns 0, or -1 if the cache is unusable,
+    after printing an error the first time if REPORT is set. Failures are
+    not remembered while unreported, so the first "cached" command reports
+    them.
+ */
+static int cache_open(int report)
+{
+    if (header)
+        return 0;
+    if (open_failed)
+        return -1;
+    open_failed = report;
+
+    if (cache_directory() == NULL)
+    {
+        if (report)
+        {
+            fprintf(stderr, "cached: %s: ", cache_dir[0] ? cache_dir : "no cache directory");
+            perror("mkdir()");
+            fflush(stderr);
+        }
+        return -1;
+    }
+
+    // An invalid size is reported, whatever REPORT, and the default kept
+    char *size = getenv("SMALLSH_CACHE_SIZE");
+    unsigned long long cap;
+    if (size && *size)
+    {
+        if (controls_parse_size(size, strlen(size), &cap) == 0)
+            size_cap = cap;
+        else
+        {
+            fprintf(stderr, "cached: SMALLSH_CACHE_SIZE: invalid size '%s'\n", size);
+            fflush(stderr);
+        }
+    }
+
+    char path[CACHE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/index", cache_dir);
+    index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    size_t map_size = sizeof(struct cache_header) + CACHE_SLOTS * sizeof(struct cache_record);
+    struct stat st;
+    if (index_fd == -1 || fstat(index_fd, &st) == -1 ||
+        ((size_t)st.st_size < map_size && ftruncate(index_fd, (off_t)map_size) == -1))
+    {
+        if (report)
+        {
+            fprintf(stderr, "cached: %s: ", path);
+            perror("");
+            fflush(stderr);
+        }
+        if (index_fd != -1)
+            close(index_fd);
+        index_fd = -1;
+        return -1;
+    }
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        if (report)
+        {
+            perror("cached: mmap()");
+            fflush(stderr);
+        }
+        close(index_fd);
+        index_fd = -1;
+        return -1;
+    }
+
+    // A new index is set up under the lock, so only one shell does it
+    struct cache_header *new_header = map;
+    flock(index_fd, LOCK_EX);
+    if (new_header->magic == 0)
+        new_header->magic = CACHE_MAGIC;
+    uint64_t magic = new_header->magic;
+    flock(index_fd, LOCK_UN);
+    if (magic != CACHE_MAGIC)
+    {
+        if (report)
+        {
+            fprintf(stderr, "cached: %s: not a cache index of this version\n", path);
+            fflush(stderr);
+        }
+        munmap(map, map_size);
+        close(index_fd);
+        index_fd = -1;
+        return -1;
+    }
+
+    header = new_header;
+    records = (struct cache_record *)(header + 1);
+    open_failed = 0;
+    return 0;
+}
+
+/*  Stores in PATH, which holds CACHE_PATH_SIZE bytes, the path of the output stored
+    under KEY.
+ */
+static void blob_path(char *path, const unsigned char *key)
+{
+    int len = snprintf(path, CACHE_PATH_SIZE, "%s/", cache_dir);
+    for (int i = 0; i < 16; i++)
+        len += snprintf(path + len, CACHE_PATH_SIZE - len, "%02x", key[i]);
+}
+
+/*  Removes record I and its output. The index must be locked.
+ */
+static void drop_record(int i)
+{
+    char path[CACHE_PATH_SIZE];
+    blob_path(path, records[i].key);
+    unlink(path);
+    header->total_size -= records[i].size;
+    records[i].used = 0;
+}
+
+/*  Returns a read-only descriptor of the output stored under KEY, whose
+    record is marked as used and whose exit value is stored in *VALUE, or
+    -1 if there is none. A record is kept only while its output is there.
+ */
+static int find_record(const unsigned char *key, int *value)
+{
+    char path[CACHE_PATH_SIZE];
+    blob_path(path, key);
+    flock(index_fd, LOCK_EX);
+    int found = -1;
+    for (int i = 0; i < CACHE_SLOTS && found == -1; i++)
+    {
+        if (records[i].used && memcmp(records[i].key, key, 16) == 0)
+            found = i;
+    }
+    int blob_fd = -1;
+    if (found != -1)
+    {
+        blob_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (blob_fd == -1)
+            drop_record(found);
+        else
+        {
+            records[found].last_used = wall_ns();
+            *value = records[found].status;
+        }
+    }
+    flock(index_fd, LOCK_UN);
+    return blob_fd;
+}
+
+/*  Stores the file TMP_PATH of SIZE bytes, renaming it into the cache, as
+    the output under KEY with exit value STATUS. The least recently used
+    records are dropped to keep the outputs within the size cap. TMP_PATH is
+    removed if it cannot be stored.
+ */
+static void store_record(const unsigned char *key, const char *tmp_path, uint64_t size, int status)
+{
+    char path[CACHE_PATH_SIZE];
+    blob_path(path, key);
+    flock(index_fd, LOCK_EX);
+
+    // Another shell may have stored the same result meanwhile
+    for (int i = 0; i < CACHE_SLOTS; i++)
+    {
+        if (records[i].used && memcmp(records[i].key, key, 16) == 0)
+            drop_record(i);
+    }
+
+    // Evict until the output fits and a record is free
+    int slot = -1;
+    while (1)
+    {
+        int oldest = -1;
+        slot = -1;
+        for (int i = 0; i < CACHE_SLOTS; i++)
+        {
+            if (!records[i].used)
+                slot = slot == -1 ? i : slot;
+            else if (oldest == -1 || records[i].last_used < records[oldest].last_used)
+                oldest = i;
+        }
+        if (slot != -1 && header->total_size + size <= size_cap)
+            break;
+        if (oldest == -1)
+            break;
+        if (DEBUGCACHE)
+            printf("cached: evicting record %d\n", oldest);
+        drop_record(oldest);
+    }
+
+    if (slot != -1 && rename(tmp_path, path) == 0)
+    {
+        memcpy(records[slot].key, key, 16);
+        records[slot].size = size;
+        records[slot].last_used = wall_ns();
+        records[slot].status = status;
+        records[slot].used = 1;
+        header->total_size += size;
+    }
+    else
+        unlink(tmp_path);
+    flock(index_fd, LOCK_UN);
+}
+
+/*  Copies the SIZE bytes of the file FROM to TO. A new, empty output file
+    (FRESH set) shares the blocks of FROM where the filesystem can reflink
+    them. Otherwise copy_file_range copies within the kernel, falling back
+    to sendfile and then to read and write for pipes and terminals.
+    Returns 0, or -1 on an error.
+ */
+static int copy_output(int from, int to, off_t size, int fresh)
+{
+    if (fresh && ioctl(to, FICLONE, from) == 0)
+        return 0;
+
+    loff_t offset = 0;
+    while (offset < size)
+    {
+        ssize_t n = copy_file_range(from, &offset, to, NULL, (size_t)(size - offset), 0);
+        if (n <= 0)
+            break;
+    }
+    off_t sent = offset;
+    while (sent < size)
+    {
+        ssize_t n = sendfile(to, from, &sent, (size_t)(size - sent));
+        if (n <= 0)
+            break;
+    }
+    char buf[65536];
+    while (sent < size)
+    {
+        ssize_t n = pread(from, buf, sizeof(buf), sent);
+        if (n <= 0)
+            return -1;
+        for (ssize_t done = 0; done < n;)
+        {
+            ssize_t w = write(to, buf + done, (size_t)(n - done));
+            if (w == -1 && errno == EINTR)
+                continue;
+            if (w == -1)
+                return -1;
+            done += w;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+/*  Copies the output in the file FROM to OUTPUT_FILE, created or
+    truncated as by '>', or to stdout if it is NULL. Returns 0, or -1 after
+    printing an error.
+ */
+static int deliver_output(int from, const char *output_file)
+{
+    struct stat st;
+    if (fstat(from, &st) == -1)
+        return -1;
+    int to = STDOUT_FILENO;
+    if (output_file)
+    {
+        to = open(output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (to == -1)
+        {
+            fprintf(stderr, "error redirecting output to %s: open(): ", output_file);
+            perror("");
+            fflush(stderr);
+            return -1;
+        }
+    }
+    else
+        fflush(stdout);
+    int result = copy_output(from, to, st.st_size, output_file != NULL);
+    if (result == -1)
+    {
+        perror("cached: copying output");
+        fflush(stderr);
+    }
+    if (to != STDOUT_FILENO)
+        close(to);
+    return result;
+}
+
+/*  Parses the prefix at TOKENS, of which there are NUM_TOKENS:
+        cached [-d path]... command...
+    allocating *REQUEST from ARENA. Returns the number of tokens used, 0 if
+    TOKENS do not start with the prefix followed by a command, or -1 after
+    printing an error.
+ */
+int cache_parse(struct arena *arena, struct cache_request **request,
+                struct token *tokens, int num_tokens)
+{
+    if (tokens[0].type != TOK_WORD || strcmp(tokens[0].text, "cached") != 0)
+        return 0;
+
+    int used = 1;
+    struct cache_request *new_request = arena_calloc(arena, sizeof(struct cache_request));
+    while (used + 1 < num_tokens && tokens[used + 1].type == TOK_WORD &&
+           strcmp(tokens[used].text, "-d") == 0)
+    {
+        if (new_request->num_deps == CACHE_MAX_DEPS)
+        {
+            fprintf(stderr, "cached: more than %d dependencies\n", CACHE_MAX_DEPS);
+            fflush(stderr);
+            return -1;
+        }
+        new_request->deps[new_request->num_deps++] = tokens[used + 1].text;
+        used += 2;
+    }
+    if (used >= num_tokens || tokens[used].type != TOK_WORD ||
+        strcmp(tokens[used].text, "-d") == 0)
+        return 0;
+    *request = new_request;
+    return used;
+}
+
+/*  Looks up the result of the foreground pipeline USER_INPUT run with the
+    "cached" prefix. Its key is the hash of the working directory, of each
+    stage's arguments, command file, input file and here-doc body, and of
+    the declared dependencies; files are identified by inode, size and
+    modification time.
+
+    On a hit, the stored output is copied to the last stage's output file,
+    or to stdout, the exit value is stored in *VALUE and 1 is returned: the
+    command is not run. On a miss, the last stage's output is redirected to
+    a temporary file in the cache and 0 is returned; cache_finish() must be
+    called once the pipeline has completed. Returns -1, with USER_INPUT
+    unchanged, if the cache cannot be used.
+ */
+int cache_begin(struct cache_request *request, struct user_input *user_input, int *value)
+{
+    if (cache_open(1) == -1)
+        return -1;
+
+    hash128 hash = ((hash128)0x6c62272e07bb0142ull << 64) | 0x62b821756295c58dull;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd)
+    {
+        hash_field(&hash, cwd, strlen(cwd));
+        free(cwd);
+    }
+    struct user_input *last = user_input;
+    for (struct user_input *stage = user_input; stage; stage = stage->next)
+    {
+        for (int i = 0; i < stage->num_cmd_args; i++)
+            hash_field(&hash, stage->cmd_args[i], strlen(stage->cmd_args[i]));
+        const char *cmd_path = pathcache_lookup(stage->cmd);
+        hash_file(&hash, cmd_path ? cmd_path : "");
+        if (stage->input_file)
+            hash_file(&hash, stage->input_file);
+        if (stage->here_data)
+            hash_field(&hash, stage->here_data, stage->here_len);
+        hash_field(&hash, "|", 1);
+        last = stage;
+    }
+    for (int i = 0; i < request->num_deps; i++)
+        hash_file(&hash, request->deps[i]);
+    for (int i = 0; i < 16; i++)
+        request->key[i] = (unsigned char)(hash >> (8 * i));
+
+    char path[CACHE_PATH_SIZE];
+    blob_path(path, request->key);
+    int blob_fd = find_record(request->key, value);
+    if (blob_fd != -1)
+    {
+        if (DEBUGCACHE)
+            printf("cached: hit %s\n", path);
+        if (deliver_output(blob_fd, last->output_file) == -1)
+            *value = EXIT_FAILURE;
+        close(blob_fd);
+        return 1;
+    }
+
+    // Capture the output of the last stage through the usual redirection
+    static unsigned long num_captures = 0;
+    snprintf(request->tmp_path, sizeof(request->tmp_path), "%s/tmp.%d.%lu", cache_dir,
+             (int)getpid(), num_captures++);
+    request->output_file = last->output_file;
+    last->output_file = request->tmp_path;
+    if (DEBUGCACHE)
+        printf("cached: miss %s\n", path);
+    return 0;
+}
+
+/*  Completes a miss of cache_begin() for REQUEST, whose pipeline ended with
+    the wait status STATUS: copies the captured output to its destination
+    and, if the pipeline exited and every stage was launched (COMPLETE),
+    stores it with the exit value. The least recently used results are
+    dropped to keep the outputs within the size cap.
+ */
+void cache_finish(struct cache_request *request, int status, int complete)
+{
+    int fd = open(request->tmp_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    deliver_output(fd, request->output_file);
+    struct stat st;
+    int store = complete && WIFEXITED(status) && fstat(fd, &st) == 0 &&
+                (uint64_t)st.st_size <= size_cap;
+    close(fd);
+    if (!store)
+    {
+        unlink(request->tmp_path);
+        return;
+    }
+
+    store_record(request->key, request->tmp_path, (uint64_t)st.st_size, WEXITSTATUS(status));
+}
+
+/*  Returns a read-only descriptor of the data stored under KEY by
+    cache_store(), which is marked as used, or -1 if there is none or the
+    cache is unusable.
+ */
+int cache_lookup(const unsigned char *key)
+{
+    if (cache_open(0) == -1)
+        return -1;
+    int value;
+    return find_record(key, &value);
+}
+
+/*  Stores the SIZE bytes at DATA under KEY, for cache_lookup(). Data other
+    than command outputs, such as compiled scripts, is kept this way so that
+    it counts toward the size cap and is evicted with the rest. Errors are
+    ignored.
+ */
+void cache_store(const unsigned char *key, const void *data, size_t size)
+{
+    if (cache_open(0) == -1 || size > size_cap)
+        return;
+
+    static unsigned long num_stores = 0;
+    char tmp_path[CACHE_PATH_SIZE];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/tmp.%d.s%lu", cache_dir,
+             (int)getpid(), num_stores++);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return;
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = write(fd, (const char *)data + done, size - done);
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    if (close(fd) == -1 || done < size)
+        unlink(tmp_path);
+    else
+        store_record(key, tmp_path, size, 0);
+}
+
@@ -0,0 +1,32 @@
+#ifndef SMALLSH_CACHE_H
+#define SMALLSH_CACHE_H
+
+#include "smallsh.h"
+#include "smallsh_arena.h"
+#include "smallsh_lex.h"
+
+// Most dependency paths declared with "cached -d"
+#define CACHE_MAX_DEPS 32
+
+// Size of the paths of files in the cache directory, whose own path is
+// at most PATH_MAX
+#define CACHE_PATH_SIZE 4200
+
+// A command run with the "cached" prefix
+struct cache_request
+{
+    const char *deps[CACHE_MAX_DEPS];
+    int num_deps;
+    unsigned char key[16];      // Set by cache_begin()
+    char *output_file;          // Destination of the output on a miss, or NULL
+    char tmp_path[CACHE_PATH_SIZE]; // Where the output is captured on a miss
+};
+
+int cache_parse(struct arena *arena, struct cache_request **request,
+                struct token *tokens, int num_tokens);
+int cache_begin(struct cache_request *request, struct user_input *user_input, int *value);
+void cache_finish(struct cache_request *request, int status, int complete);
+int cache_lookup(const unsigned char *key);
+void cache_store(const unsigned char *key, const void *data, size_t size);
+
+#endif
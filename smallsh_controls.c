@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+// sched_setaffinity, CPU_SET
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include "smallsh_controls.h"
+
+#define DEBUGCONTROLS 0
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+// Niceness added by "nice" without an adjustment, as by nice(1)
+#define DEFAULT_NICE 10
+
+// CPUs background processes are spread across, in order, when
+// SMALLSH_BG_SPREAD is set. Empty if they are not.
+static int spread_cpus[CONTROLS_MAX_CPUS];
+static int num_spread_cpus = 0;
+static int next_spread_cpu = 0;
+
+/*  Enables the round-robin placement of background processes if
+    SMALLSH_BG_SPREAD is set to anything but "0": each one is pinned to the
+    next CPU the shell itself may run on.
+ */
+void controls_init(void)
+{
+    char *spread = getenv("SMALLSH_BG_SPREAD");
+    if (spread == NULL || *spread == '\0' || strcmp(spread, "0") == 0)
+        return;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        perror("SMALLSH_BG_SPREAD: sched_getaffinity()");
+        fflush(stderr);
+        return;
+    }
+    for (int cpu = 0; cpu < CONTROLS_MAX_CPUS && cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+            spread_cpus[num_spread_cpus++] = cpu;
+    }
+
+    if (DEBUGCONTROLS)
+        printf("spreading background processes across %d CPUs\n", num_spread_cpus);
+}
+
+/*  Parses the CPU list TEXT, such as "0,2-3", into CONTROLS.
+    Returns 0, or -1 if it is not a valid list.
+ */
+static int parse_cpus(struct spawn_controls *controls, const char *text)
+{
+    memset(controls->cpus, '\0', sizeof(controls->cpus));
+    const char *p = text;
+    do
+    {
+        char *end;
+        errno = 0;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || errno || first < 0)
+            return -1;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || errno || last < first)
+                return -1;
+        }
+        if (last >= CONTROLS_MAX_CPUS)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            controls->cpus[cpu / WORD_BITS] |= 1ul << (cpu % WORD_BITS);
+        p = end;
+    } while (*p++ == ',');
+
+    if (p[-1] != '\0')
+        return -1;
+    controls->has_cpus = 1;
+    return 0;
+}
+
+/*  Parses the LEN bytes of TEXT, a number optionally followed by K, M or G
+    (powers of 1024), into *VALUE. Returns 0, or -1 if they are not valid
+    or the value does not fit.
+ */
+int controls_parse_size(const char *text, size_t len, unsigned long long *value)
+{
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(text, &end, 10);
+    if (end == text || errno || text[0] == '-')
+        return -1;
+    if (end < text + len)
+    {
+        int shift;
+        switch (*end++)
+        {
+        case 'G': case 'g':
+            shift = 30;
+            break;
+        case 'M': case 'm':
+            shift = 20;
+            break;
+        case 'K': case 'k':
+            shift = 10;
+            break;
+        default:
+            return -1;
+        }
+        if (number > (ULLONG_MAX >> shift))
+            return -1;
+        number <<= shift;
+    }
+    if (end != text + len)
+        return -1;
+    *value = number;
+    return 0;
+}
+
+/*  Parses the LEN bytes of TEXT, a size as taken by controls_parse_size()
+    or "unlimited", into *VALUE. Returns 0, or -1 if they are not valid.
+ */
+static int parse_limit(const char *text, size_t len, rlim_t *value)
+{
+    if (len == strlen("unlimited") && strncmp(text, "unlimited", len) == 0)
+    {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+
+    unsigned long long number;
+    if (controls_parse_size(text, len, &number) == -1)
+        return -1;
+    *value = (rlim_t)number;
+    return 0;
+}
+
+/*  Parses the resource limits TEXT, comma-separated settings of cpu
+    (seconds), as (bytes of address space, with K, M or G) and nofile (open
+    files), into CONTROLS. Returns 0, or -1 if they are not valid.
+ */
+static int parse_limits(struct spawn_controls *controls, const char *text)
+{
+    static const struct
+    {
+        const char *name;
+        int resource;
+    } resources[CONTROLS_MAX_LIMITS] = {
+        {"cpu", RLIMIT_CPU},
+        {"as", RLIMIT_AS},
+        {"nofile", RLIMIT_NOFILE},
+    };
+
+    const char *p = text;
+    while (*p)
+    {
+        const char *equals = strchr(p, '=');
+        if (equals == NULL)
+            return -1;
+        const char *value = equals + 1;
+        size_t value_len = strcspn(value, ",");
+
+        int i = 0;
+        while (i < CONTROLS_MAX_LIMITS &&
+               !(strlen(resources[i].name) == (size_t)(equals - p) &&
+                 strncmp(resources[i].name, p, equals - p) == 0))
+            i++;
+        if (i == CONTROLS_MAX_LIMITS)
+            return -1;
+
+        // A resource given twice keeps its last setting
+        int slot = 0;
+        while (slot < controls->num_limits && controls->limits[slot].resource != resources[i].resource)
+            slot++;
+        rlim_t limit;
+        if (parse_limit(value, value_len, &limit) == -1)
+            return -1;
+        controls->limits[slot].resource = resources[i].resource;
+        controls->limits[slot].limit.rlim_cur = limit;
+        controls->limits[slot].limit.rlim_max = limit;
+        if (slot == controls->num_limits)
+            controls->num_limits++;
+
+        p = value + value_len;
+        if (*p == ',' && *++p == '\0')
+            return -1;
+    }
+    return 0;
+}
+
+/*  Parses one control prefix at TOKENS, of which there are NUM_TOKENS:
+        nice [-n N | -N] command...
+        pin CPULIST command...
+        limit cpu=SECONDS,as=SIZE,nofile=COUNT command...
+    adding it to *CONTROLS, which is allocated from ARENA on first use.
+    Returns the number of tokens used, 0 if TOKENS do not start with a
+    prefix followed by a command, or -1 after printing an error.
+ */
+int controls_parse(struct arena *arena, struct spawn_controls **controls,
+                   struct token *tokens, int num_tokens)
+{
+    if (tokens[0].type != TOK_WORD)
+        return 0;
+
+    const char *name = tokens[0].text;
+    int used;
+    if (strcmp(name, "nice") == 0)
+    {
+        // "-n N" or "-N", as taken by nice(1)
+        int adjustment = DEFAULT_NICE;
+        used = 1;
+        const char *arg = NULL;
+        if (num_tokens > 2 && strcmp(tokens[1].text, "-n") == 0)
+        {
+            arg = tokens[2].text;
+            used = 3;
+        }
+        else if (num_tokens > 1 && tokens[1].text[0] == '-' && tokens[1].text[1] != '\0')
+        {
+            arg = tokens[1].text + 1;
+            used = 2;
+        }
+        if (arg)
+        {
+            char *end;
+            long value = strtol(arg, &end, 10);
+            if (end == arg || *end != '\0' || value < INT_MIN || value > INT_MAX)
+            {
+                fprintf(stderr, "nice: invalid adjustment '%s'\n", arg);
+                fflush(stderr);
+                return -1;
+            }
+            adjustment = (int)value;
+        }
+        if (used >= num_tokens || tokens[used].type != TOK_WORD)
+            return 0;
+        if (*controls == NULL)
+            *controls = arena_calloc(arena, sizeof(struct spawn_controls));
+        (*controls)->has_nice = 1;
+        (*controls)->nice = adjustment;
+        return used;
+    }
+
+    if (strcmp(name, "pin") != 0 && strcmp(name, "limit") != 0)
+        return 0;
+    used = 2;
+    if (used >= num_tokens || tokens[used].type != TOK_WORD)
+        return 0;
+
+    if (*controls == NULL)
+        *controls = arena_calloc(arena, sizeof(struct spawn_controls));
+    if (name[0] == 'p' && parse_cpus(*controls, tokens[1].text) == -1)
+    {
+        fprintf(stderr, "pin: invalid CPU list '%s'\n", tokens[1].text);
+        fflush(stderr);
+        return -1;
+    }
+    if (name[0] == 'l' && parse_limits(*controls, tokens[1].text) == -1)
+    {
+        fprintf(stderr, "limit: invalid limits '%s'\n", tokens[1].text);
+        fflush(stderr);
+        return -1;
+    }
+    return used;
+}
+
+/*  Returns the controls for a background process given CONTROLS, which may
+    be NULL. When background processes are spread across the CPUs and
+    CONTROLS do not pin the process, those are copied to SPREAD, which is
+    pinned to the next CPU in turn and returned.
+ */
+const struct spawn_controls *controls_spread(const struct spawn_controls *controls,
+                                             struct spawn_controls *spread)
+{
+    if (num_spread_cpus == 0 || (controls && controls->has_cpus))
+        return controls;
+
+    if (controls)
+        *spread = *controls;
+    else
+        memset(spread, '\0', sizeof(*spread));
+    int cpu = spread_cpus[next_spread_cpu];
+    next_spread_cpu = (next_spread_cpu + 1) % num_spread_cpus;
+    spread->has_cpus = 1;
+    spread->cpus[cpu / WORD_BITS] = 1ul << (cpu % WORD_BITS);
+    return spread;
+}
+
+/*  Applies CONTROLS to the calling process, a child about to execute its
+    command. Returns 0, or -1 after printing an error if its CPUs or limits
+    could not be set. A niceness that cannot be set is only warned about, as
+    by nice(1).
+ */
+int controls_apply(const struct spawn_controls *controls)
+{
+    if (controls->has_cpus)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < CONTROLS_MAX_CPUS && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (controls->cpus[cpu / WORD_BITS] & (1ul << (cpu % WORD_BITS)))
+                CPU_SET(cpu, &cpus);
+        }
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+        {
+            perror("pin: sched_setaffinity()");
+            fflush(stderr);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < controls->num_limits; i++)
+    {
+        if (setrlimit(controls->limits[i].resource, &controls->limits[i].limit) == -1)
+        {
+            perror("limit: setrlimit()");
+            fflush(stderr);
+            return -1;
+        }
+    }
+
+    if (controls->has_nice)
+    {
+        errno = 0;
+        if (nice(controls->nice) == -1 && errno != 0)
+        {
+            perror("nice: nice()");
+            fflush(stderr);
+        }
+    }
+    return 0;
+}
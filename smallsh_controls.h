@@ -0,0 +1,39 @@
+#ifndef SMALLSH_CONTROLS_H
+#define SMALLSH_CONTROLS_H
+
+#include <sys/resource.h>
+#include "smallsh_arena.h"
+#include "smallsh_lex.h"
+
+// Largest CPU number that can be pinned to, plus one
+#define CONTROLS_MAX_CPUS 1024
+#define CONTROLS_CPU_WORDS (CONTROLS_MAX_CPUS / (8 * sizeof(unsigned long)))
+
+// Resources limit can set
+#define CONTROLS_MAX_LIMITS 3
+
+// Controls applied to a command's processes before it is executed, given by
+// the prefixes nice, pin and limit
+struct spawn_controls
+{
+    int has_cpus;           // Pinned to the CPUs set in cpus
+    unsigned long cpus[CONTROLS_CPU_WORDS];
+    int has_nice;           // Niceness raised by nice
+    int nice;
+    int num_limits;
+    struct
+    {
+        int resource;       // RLIMIT_*
+        struct rlimit limit;
+    } limits[CONTROLS_MAX_LIMITS];
+};
+
+void controls_init(void);
+int controls_parse(struct arena *arena, struct spawn_controls **controls,
+                   struct token *tokens, int num_tokens);
+const struct spawn_controls *controls_spread(const struct spawn_controls *controls,
+                                             struct spawn_controls *spread);
+int controls_apply(const struct spawn_controls *controls);
+int controls_parse_size(const char *text, size_t len, unsigned long long *value);
+
+#endif
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+// signalfd, epoll
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include "smallsh_events.h"
+#include "smallsh_zygote.h"
+
+#define DEBUGEVENTS 0
+
+// SIGCHLD is blocked and delivered through sigchld_fd, which is registered
+// with epoll_fd along with the zygote's socket, if any (see ev_watch()).
+static int sigchld_fd = -1;
+static int epoll_fd = -1;
+
+// Input descriptor registered by ev_wait_input(), or -1
+static int input_fd = -1;
+
+// Set once sigchld_fd has been drained, until waitpid reports that no more
+// children have changed state. signalfd coalesces signals, so every child
+// must be reaped after a read before the next read can be trusted.
+static int reap_pending = 1;
+
+// Children already reaped but handed back with ev_defer(), in FIFO order
+struct deferred_child
+{
+    pid_t pid;
+    int status;
+};
+static struct deferred_child *deferred = NULL;
+static size_t deferred_size = 0, deferred_head = 0, deferred_tail = 0;
+
+/*  Blocks SIGCHLD and routes it to a signalfd watched by epoll. Must be called
+    before any child is launched. Returns 0 on success, or -1 after printing
+    an error.
+ */
+int ev_init(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    {
+        perror("ev_init(): sigprocmask()");
+        return -1;
+    }
+
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd == -1)
+    {
+        perror("ev_init(): signalfd()");
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        perror("ev_init(): epoll_create1()");
+        return -1;
+    }
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.fd = sigchld_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sigchld_fd, &event) == -1)
+    {
+        perror("ev_init(): epoll_ctl()");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*  Adds FD to the descriptors that wake a blocking ev_reap(). Used for the
+    socket the zygote reports the state changes of its children on. Returns
+    0 on success, or -1 after printing an error.
+ */
+int ev_watch(int fd)
+{
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        perror("ev_watch(): epoll_ctl()");
+        return -1;
+    }
+    return 0;
+}
+
+/*  Sleeps in epoll_wait until FD, the shell's input, is readable, or until
+    a child may have changed state. FD is added to the watched descriptors
+    on first use; one that epoll cannot watch (a regular file) is always
+    readable. Returns 1 if FD is readable, 0 if children are to be reaped
+    with ev_reap(), or -1 if interrupted by a signal.
+ */
+int ev_wait_input(int fd)
+{
+    if (fd != input_fd)
+    {
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (input_fd != -1)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, input_fd, NULL);
+        input_fd = -1;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+            return 1;
+        input_fd = fd;
+    }
+
+    struct epoll_event events[4];
+    int n = epoll_wait(epoll_fd, events, 4, -1);
+    if (n == -1)
+        return errno == EINTR ? -1 : 1;
+    for (int i = 0; i < n; i++)
+    {
+        if (events[i].data.fd == fd)
+            return 1;
+    }
+    // SIGCHLD, or a report from the zygote
+    return 0;
+}
+
+/*  Reads every queued SIGCHLD from sigchld_fd. Returns non-zero if at least
+    one was read.
+ */
+static int drain_sigchld(void)
+{
+    struct signalfd_siginfo info[16];
+    int got_signal = 0;
+    ssize_t n;
+    while ((n = read(sigchld_fd, info, sizeof(info))) > 0)
+        got_signal = 1;
+    return got_signal;
+}
+
+/*  Reaps the next child that has terminated, stopped or continued, stores its
+    pid and wait status in *PID and *STATUS, and returns 1. If USAGE is not
+    NULL, the resource usage of a terminated child (and of the descendants it
+    waited for) is stored there. Children of the zygote, which reports their
+    state changes, are returned first. Only children that actually changed
+    state are waited for: waitpid is not called at all unless a SIGCHLD has
+    arrived since the last time it reported none.
+    If BLOCK is zero and no child has changed state, returns 0. If BLOCK is
+    non-zero, sleeps in epoll_wait until one does. Returns -1 if there are no
+    children left to wait for.
+ */
+int ev_reap(pid_t *pid, int *status, struct rusage *usage, int block)
+{
+    while (1)
+    {
+        if (zygote_reap(pid, status, usage) == 1)
+            return 1;
+
+        if (!reap_pending)
+            reap_pending = drain_sigchld();
+
+        if (reap_pending)
+        {
+            // wait4 returns the rusage of the child at no extra cost
+            pid_t result = wait4(-1, status, WNOHANG | WUNTRACED | WCONTINUED, usage);
+            if (result > 0)
+            {
+                if (DEBUGEVENTS)
+                    printf("ev_reap: pid %d status %d\n", result, *status);
+                *pid = result;
+                return 1;
+            }
+            // Every child that changed state has been reaped
+            reap_pending = 0;
+            if (result == -1 && errno == ECHILD)
+                return -1;
+        }
+
+        if (!block)
+            return 0;
+
+        // Sleep until the next SIGCHLD
+        struct epoll_event event;
+        if (epoll_wait(epoll_fd, &event, 1, -1) == -1 && errno != EINTR)
+        {
+            perror("ev_reap(): epoll_wait()");
+            return -1;
+        }
+    }
+}
+
+/*  Stores in *PID and *STATUS the oldest child handed back with ev_defer(),
+    and returns 1. Returns 0 if there is none.
+ */
+int ev_undefer(pid_t *pid, int *status)
+{
+    if (deferred_head == deferred_tail)
+        return 0;
+
+    *pid = deferred[deferred_head].pid;
+    *status = deferred[deferred_head].status;
+    deferred_head = (deferred_head + 1) % deferred_size;
+    return 1;
+}
+
+/*  Hands back a child that was reaped by ev_reap(), to be returned later by
+    ev_undefer(). Used for background children reaped while waiting for a
+    foreground one.
+ */
+void ev_defer(pid_t pid, int status)
+{
+    // Grow the ring buffer when full, keeping one slot free
+    if (deferred_size == 0 || (deferred_tail + 1) % deferred_size == deferred_head)
+    {
+        size_t new_size = deferred_size ? deferred_size * 2 : 8;
+        struct deferred_child *new_deferred = malloc(new_size * sizeof(struct deferred_child));
+        if (new_deferred == NULL)
+        {
+            perror("ev_defer(): malloc()");
+            exit(1);
+        }
+        size_t n = 0;
+        for (size_t i = deferred_head; i != deferred_tail; i = (i + 1) % deferred_size)
+            new_deferred[n++] = deferred[i];
+        free(deferred);
+        deferred = new_deferred;
+        deferred_size = new_size;
+        deferred_head = 0;
+        deferred_tail = n;
+    }
+
+    deferred[deferred_tail].pid = pid;
+    deferred[deferred_tail].status = status;
+    deferred_tail = (deferred_tail + 1) % deferred_size;
+}
@@ -0,0 +1,14 @@
+#ifndef SMALLSH_EVENTS_H
+#define SMALLSH_EVENTS_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+int ev_init(void);
+int ev_watch(int fd);
+int ev_wait_input(int fd);
+int ev_reap(pid_t *pid, int *status, struct rusage *usage, int block);
+int ev_undefer(pid_t *pid, int *status);
+void ev_defer(pid_t pid, int status);
+
+#endif
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
 
 #define DEBUGFUNCS 0
 
@@ -64,7 +65,7 @@ void copy_and_expand_dollar(char *dst, char *src)
 
     // Get current process ID as a string
     pid_t this_pid = getpid();
-    char this_pid_str[6] = {'\0'};
+    char this_pid_str[12] = {'\0'};
     sprintf(this_pid_str, "%d", this_pid);
 
     // Until in_str is completely parsed, cat this_pid_string and token to
@@ -76,63 +77,41 @@ void copy_and_expand_dollar(char *dst, char *src)
     }
 }
 
-/*  Appends the value VAL to the array ARR that has size ARR_SIZE and number of
-    elements NUM_ELEMS. Increments NUM_ELEMS.
-    If (NUM_ELEMS is > 3/4 * ARR_SIZE) before the operation, then ARR is
-    reallocated to double ARR_SIZE, and ARR_SIZE is updated.
+/*  Returns the number of the signal named NAME, which may be a number
+    ("15"), or a name with or without its "SIG" prefix ("SIGTERM", "TERM").
+    Returns -1 if NAME is not a known signal.
  */
-int arr_add(int **arr, int *arr_size, int val, int *num_elems)
+int parse_signal(const char *name)
 {
-    if (*num_elems > (*arr_size * 3 / 4))
+    static const struct
     {
-        int *arr_ptr = realloc(*arr, (*arr_size) * sizeof(int) * 2);
-        if (arr_ptr == NULL)
-        {
-            perror("arr_add(): realloc()");
-            exit(1);
-        }
-        *arr_size *= 2;
-    }
-    (*arr)[*num_elems] = val;
-    (*num_elems)++;
-
-    if (DEBUGFUNCS)
-    {
-        printf("arr[%d]: %d, arr_size: %d, num_elems: %d\n", *num_elems-1, (*arr)[*num_elems-1], *arr_size, *num_elems);
-    }
-
-    return EXIT_SUCCESS;
-}
-
-/*  Removes the element located at index IDX of array ARR that has size
-    ARR_SIZE and number of elements NUM_ELEMS. Decrements NUM_ELEMS.
-    If (NUM_ELEMS < ARR_SIZE / 4) before the operation, then ARR is reallocated
-    to half of ARR_SIZE, and ARR_SIZE is updated.
- */
-int arr_del(int **arr, int *arr_size, int idx, int *num_elems)
-{
-    // Move the block of the array starting at arr[idx+1] to arr[idx]
-    memmove(&(*arr)[idx], &(*arr)[(idx+1)], sizeof(int) * (*num_elems - idx));
-
-    if (DEBUGFUNCS)
-        printf("arr_del: checking to see if realloc necessary...\n");
-
-    if ((*num_elems < (*arr_size / 4)) && (*arr_size > 8))
+        const char *name;
+        int signum;
+    } signals[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"ILL", SIGILL},
+        {"TRAP", SIGTRAP}, {"ABRT", SIGABRT}, {"BUS", SIGBUS}, {"FPE", SIGFPE},
+        {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"SEGV", SIGSEGV},
+        {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+        {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT},
+        {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN},
+        {"TTOU", SIGTTOU}, {"URG", SIGURG}, {"XCPU", SIGXCPU},
+        {"XFSZ", SIGXFSZ}, {"VTALRM", SIGVTALRM}, {"PROF", SIGPROF},
+        {"WINCH", SIGWINCH}, {"SYS", SIGSYS},
+    };
+
+    if (*name >= '0' && *name <= '9')
     {
-        int *arr_ptr = realloc(*arr, (*arr_size) * sizeof(int) / 2);
-        if (arr_ptr == NULL)
-        {
-            perror("arr_del(): realloc()");
-            exit(1);
-        }
-        *arr_size *= 0.5;
+        char *end;
+        long signum = strtol(name, &end, 10);
+        return (*end == '\0' && signum >= 0 && signum <= SIGRTMAX) ? (int)signum : -1;
     }
-    (*num_elems)--;
 
-    if (DEBUGFUNCS)
+    if (strncmp(name, "SIG", 3) == 0)
+        name += 3;
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
     {
-        printf("arr_size: %d, num_elems: %d\n", *arr_size, *num_elems);
+        if (strcmp(name, signals[i].name) == 0)
+            return signals[i].signum;
     }
-
-    return EXIT_SUCCESS;
+    return -1;
 }
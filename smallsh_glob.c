@@ -0,0 +1,484 @@
+#define _POSIX_C_SOURCE 200809L
+// fdopendir, O_DIRECTORY, st_mtim
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "smallsh_glob.h"
+
+#define DEBUGGLOB 0
+
+// Number of directory listings kept. The least recently used is replaced.
+#define GLOB_CACHE_SLOTS 32
+
+// A listing is only reused if it was read at least this long after the
+// directory's last change. File times come from a clock that only advances
+// once per timer tick, so a change made just after an earlier listing could
+// otherwise leave the time unchanged.
+#define GLOB_RACY_NS 20000000LL
+
+// A name in a directory listing
+struct dir_entry
+{
+    uint32_t offset;    // Into the listing's names
+    uint32_t len;
+};
+
+// The names in a directory, other than "." and "..", sorted with strcmp.
+// Identified by the directory's device, inode and modification time, which
+// changes whenever a name is added or removed.
+struct dir_listing
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int racy;               // Read too soon after mtime to be reused
+    uint64_t last_used;     // 0 if the slot is empty
+    char *names;            // Null-terminated names, back to back
+    struct dir_entry *entries;
+    size_t num_entries;
+};
+
+static struct dir_listing cache[GLOB_CACHE_SLOTS];
+static uint64_t use_clock = 0;
+
+// Listings reused from the cache, and listings read from the directory
+static unsigned long total_hits = 0, total_misses = 0;
+
+// A pattern component compiled for matching against many names
+struct component
+{
+    const char *pat;
+    size_t len;
+    // Set if the pattern is PREFIX*SUFFIX with no other wildcard, which is
+    // matched with two memcmp calls
+    int simple;
+    size_t prefix_len, suffix_len;
+};
+
+// Matches collected by glob_expand()
+struct matches
+{
+    char **paths;
+    size_t num, size;
+};
+
+/*  Returns 1 if the word from WORD to END contains a wildcard: '*', '?', or
+    '[' followed later by ']'. A lone '[', as in "[ -f x ]", is literal.
+ */
+int glob_has_magic(const char *word, const char *end)
+{
+    for (const char *p = word; p < end; p++)
+    {
+        if (*p == '*' || *p == '?')
+            return 1;
+        if (*p == '[' && memchr(p + 1, ']', (size_t)(end - p - 1)))
+            return 1;
+    }
+    return 0;
+}
+
+/*  Returns the end of the bracket expression starting at P, which is at
+    most END, just after its ']', or NULL if it is not terminated.
+ */
+static const char *bracket_end(const char *p, const char *end)
+{
+    p++;
+    if (p < end && (*p == '!' || *p == '^'))
+        p++;
+    // A ']' first in the set is literal
+    if (p < end && *p == ']')
+        p++;
+    p = memchr(p, ']', (size_t)(end - p));
+    return p ? p + 1 : NULL;
+}
+
+/*  Returns 1 if the character C is in the bracket expression from P to END,
+    including the brackets.
+ */
+static int bracket_match(const char *p, const char *end, unsigned char c)
+{
+    p++;
+    end--;
+    int negate = (*p == '!' || *p == '^');
+    if (negate)
+        p++;
+    int found = 0;
+    for (const char *q = p; q < end && !found; q++)
+    {
+        unsigned char low = (unsigned char)*q;
+        unsigned char high = low;
+        if (q + 2 < end && q[1] == '-')
+        {
+            high = (unsigned char)q[2];
+            q += 2;
+        }
+        found = low <= c && c <= high;
+    }
+    return found != negate;
+}
+
+/*  Returns 1 if the name NAME of LEN bytes matches the LEN bytes of PAT.
+    A '*' is retried at later positions only while the rest fails, so the
+    match takes at most a pass per '*'.
+ */
+static int match(const char *pat, size_t pat_len, const char *name, size_t len)
+{
+    const char *p = pat, *pat_end = pat + pat_len;
+    const char *n = name, *name_end = name + len;
+    const char *star_p = NULL, *star_n = NULL;
+
+    while (n < name_end)
+    {
+        if (p < pat_end && *p == '*')
+        {
+            star_p = ++p;
+            star_n = n;
+            continue;
+        }
+        if (p < pat_end)
+        {
+            const char *next = p + 1;
+            int ok;
+            if (*p == '?')
+                ok = 1;
+            else if (*p == '[' && (next = bracket_end(p, pat_end)) != NULL)
+                ok = bracket_match(p, next, (unsigned char)*n);
+            else
+            {
+                next = p + 1;
+                ok = *p == *n;
+            }
+            if (ok)
+            {
+                p = next;
+                n++;
+                continue;
+            }
+        }
+        // Mismatch: let the last '*' take one more character
+        if (star_p == NULL)
+            return 0;
+        p = star_p;
+        n = ++star_n;
+    }
+    while (p < pat_end && *p == '*')
+        p++;
+    return p == pat_end;
+}
+
+/*  Compiles the LEN bytes of PAT into COMP.
+ */
+static void compile_component(struct component *comp, const char *pat, size_t len)
+{
+    comp->pat = pat;
+    comp->len = len;
+    comp->simple = 0;
+    const char *star = memchr(pat, '*', len);
+    if (star == NULL || memchr(star + 1, '*', len - (size_t)(star - pat) - 1) ||
+        memchr(pat, '?', len) || memchr(pat, '[', len))
+        return;
+    comp->simple = 1;
+    comp->prefix_len = (size_t)(star - pat);
+    comp->suffix_len = len - comp->prefix_len - 1;
+}
+
+/*  Returns 1 if the directory entry NAME of LEN bytes matches COMP. Names
+    starting with '.' only match a pattern starting with '.'.
+ */
+static int component_match(const struct component *comp, const char *name, size_t len)
+{
+    if (name[0] == '.' && comp->pat[0] != '.')
+        return 0;
+    if (comp->simple)
+        return len >= comp->prefix_len + comp->suffix_len &&
+               memcmp(name, comp->pat, comp->prefix_len) == 0 &&
+               memcmp(name + len - comp->suffix_len, comp->pat + comp->len - comp->suffix_len,
+                      comp->suffix_len) == 0;
+    return match(comp->pat, comp->len, name, len);
+}
+
+// Names of the listing being sorted by compare_entries()
+static const char *sort_names;
+
+static int compare_entries(const void *a, const void *b)
+{
+    const struct dir_entry *x = a, *y = b;
+    return strcmp(sort_names + x->offset, sort_names + y->offset);
+}
+
+/*  Reads the names in the directory DIR_PATH, whose status is ST, into
+    LISTING, replacing what it held. Returns 0, or -1 if the directory could
+    not be read.
+ */
+static int read_listing(struct dir_listing *listing, const char *dir_path,
+                        const struct stat *st)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
+
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL)
+    {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    size_t names_size = 4096, names_len = 0;
+    size_t entries_size = 64, num_entries = 0;
+    char *names = malloc(names_size);
+    struct dir_entry *entries = malloc(entries_size * sizeof(struct dir_entry));
+    struct dirent *dirent = NULL;
+    while (names && entries && (dirent = readdir(dir)) != NULL)
+    {
+        const char *name = dirent->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        size_t len = strlen(name);
+        if (names_len + len + 1 > names_size)
+        {
+            while (names_len + len + 1 > names_size)
+                names_size *= 2;
+            char *new_names = realloc(names, names_size);
+            if (new_names == NULL)
+                break;
+            names = new_names;
+        }
+        if (num_entries == entries_size)
+        {
+            entries_size *= 2;
+            struct dir_entry *new_entries = realloc(entries, entries_size * sizeof(struct dir_entry));
+            if (new_entries == NULL)
+                break;
+            entries = new_entries;
+        }
+        entries[num_entries].offset = (uint32_t)names_len;
+        entries[num_entries].len = (uint32_t)len;
+        num_entries++;
+        memcpy(names + names_len, name, len + 1);
+        names_len += len + 1;
+    }
+    int complete = names && entries && dirent == NULL;
+    closedir(dir);
+    if (!complete)
+    {
+        free(names);
+        free(entries);
+        return -1;
+    }
+
+    sort_names = names;
+    qsort(entries, num_entries, sizeof(struct dir_entry), compare_entries);
+
+    free(listing->names);
+    free(listing->entries);
+    listing->dev = st->st_dev;
+    listing->ino = st->st_ino;
+    listing->mtime = st->st_mtim;
+    int64_t age = (int64_t)(start.tv_sec - st->st_mtim.tv_sec) * 1000000000LL +
+                  (start.tv_nsec - st->st_mtim.tv_nsec);
+    listing->racy = age < GLOB_RACY_NS;
+    listing->names = names;
+    listing->entries = entries;
+    listing->num_entries = num_entries;
+    return 0;
+}
+
+/*  Returns the listing of the directory DIR_PATH, from the cache if the
+    directory has not changed since it was read, or NULL if it cannot be
+    read. The listing stays valid until the next call.
+ */
+static struct dir_listing *get_listing(const char *dir_path)
+{
+    struct stat st;
+    if (stat(dir_path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    struct dir_listing *victim = &cache[0];
+    for (int i = 0; i < GLOB_CACHE_SLOTS; i++)
+    {
+        struct dir_listing *listing = &cache[i];
+        if (listing->last_used && listing->dev == st.st_dev && listing->ino == st.st_ino)
+        {
+            listing->last_used = ++use_clock;
+            if (listing->racy || listing->mtime.tv_sec != st.st_mtim.tv_sec ||
+                listing->mtime.tv_nsec != st.st_mtim.tv_nsec)
+            {
+                total_misses++;
+                if (read_listing(listing, dir_path, &st) == -1)
+                {
+                    listing->last_used = 0;
+                    return NULL;
+                }
+            }
+            else
+                total_hits++;
+            return listing;
+        }
+        if (listing->last_used < victim->last_used)
+            victim = listing;
+    }
+
+    total_misses++;
+    if (read_listing(victim, dir_path, &st) == -1)
+    {
+        victim->last_used = 0;
+        return NULL;
+    }
+    victim->last_used = ++use_clock;
+    if (DEBUGGLOB)
+        printf("glob: read %s (%zu names), %lu hits, %lu misses\n", dir_path,
+               victim->num_entries, total_hits, total_misses);
+    return victim;
+}
+
+/*  Adds PATH, of LEN bytes, copied to ARENA, to MATCHES. Returns 0, or -1 if
+    out of memory.
+ */
+static int add_match(struct arena *arena, struct matches *matches, const char *path, size_t len)
+{
+    if (matches->num == matches->size)
+    {
+        size_t new_size = matches->size ? 2 * matches->size : 64;
+        char **new_paths = realloc(matches->paths, new_size * sizeof(char *));
+        if (new_paths == NULL)
+            return -1;
+        matches->paths = new_paths;
+        matches->size = new_size;
+    }
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, path, len);
+    copy[len] = '\0';
+    matches->paths[matches->num++] = copy;
+    return 0;
+}
+
+/*  Adds to MATCHES every existing path that starts with the PREFIX_LEN bytes
+    in PATH (empty, or ending in '/') and continues with a path matching
+    PATTERN. PATH has room for PATH_MAX bytes.
+ */
+static void expand(struct arena *arena, struct matches *matches, char *path,
+                   size_t prefix_len, const char *pattern)
+{
+    // Literal components are appended to the prefix as they are
+    const char *slash;
+    while ((slash = strchr(pattern, '/')) && !glob_has_magic(pattern, slash))
+    {
+        size_t len = (size_t)(slash - pattern) + 1;
+        if (prefix_len + len >= PATH_MAX)
+            return;
+        memcpy(path + prefix_len, pattern, len);
+        prefix_len += len;
+        pattern = slash + 1;
+    }
+    const char *comp_end = slash ? slash : pattern + strlen(pattern);
+
+    // A literal last component names at most one path, which must exist
+    if (!glob_has_magic(pattern, comp_end))
+    {
+        size_t len = (size_t)(comp_end - pattern);
+        struct stat st;
+        if (prefix_len + len >= PATH_MAX)
+            return;
+        memcpy(path + prefix_len, pattern, len);
+        path[prefix_len + len] = '\0';
+        if (lstat(prefix_len + len ? path : ".", &st) == 0)
+            add_match(arena, matches, path, prefix_len + len);
+        return;
+    }
+
+    path[prefix_len] = '\0';
+    struct dir_listing *listing = get_listing(prefix_len ? path : ".");
+    if (listing == NULL)
+        return;
+
+    struct component comp;
+    compile_component(&comp, pattern, (size_t)(comp_end - pattern));
+    if (slash == NULL)
+    {
+        for (size_t i = 0; i < listing->num_entries; i++)
+        {
+            const char *name = listing->names + listing->entries[i].offset;
+            size_t len = listing->entries[i].len;
+            if (component_match(&comp, name, len) && prefix_len + len < PATH_MAX)
+            {
+                memcpy(path + prefix_len, name, len);
+                if (add_match(arena, matches, path, prefix_len + len) == -1)
+                    return;
+            }
+        }
+        return;
+    }
+
+    // Descending into the matching names may replace this listing in the
+    // cache, so they are collected first
+    struct matches dirs = {NULL, 0, 0};
+    for (size_t i = 0; i < listing->num_entries; i++)
+    {
+        const char *name = listing->names + listing->entries[i].offset;
+        size_t len = listing->entries[i].len;
+        if (component_match(&comp, name, len))
+            add_match(arena, &dirs, name, len);
+    }
+    for (size_t i = 0; i < dirs.num; i++)
+    {
+        size_t len = strlen(dirs.paths[i]);
+        if (prefix_len + len + 1 >= PATH_MAX)
+            continue;
+        memcpy(path + prefix_len, dirs.paths[i], len);
+        path[prefix_len + len] = '/';
+        expand(arena, matches, path, prefix_len + len + 1, slash + 1);
+    }
+    free(dirs.paths);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*  Expands the wildcards '*', '?' and '[...]' in PATTERN against the
+    filesystem. Stores the matching paths, sorted and allocated from ARENA,
+    in *MATCHES and returns their number, or 0 if nothing matches. A wildcard
+    never matches a '/' or a leading '.'.
+
+    Directory listings are cached, sorted, by device, inode and modification
+    time, so a repeated glob over an unchanged directory costs one stat()
+    instead of a pass of readdir. Patterns of the common form PREFIX*SUFFIX
+    are matched with memcmp alone.
+ */
+int glob_expand(struct arena *arena, const char *pattern, char ***matches)
+{
+    static char path[PATH_MAX];
+    struct matches found = {NULL, 0, 0};
+
+    size_t prefix_len = 0;
+    while (pattern[0] == '/')
+    {
+        path[prefix_len++] = '/';
+        pattern++;
+    }
+    expand(arena, &found, path, prefix_len, pattern);
+
+    // Each listing is sorted, but names from different directories are
+    // interleaved differently, as in "a/x" and "a-b/x"
+    if (found.num > 1 && strchr(pattern, '/'))
+        qsort(found.paths, found.num, sizeof(char *), compare_paths);
+
+    *matches = NULL;
+    if (found.num > 0)
+    {
+        *matches = arena_alloc(arena, found.num * sizeof(char *));
+        memcpy(*matches, found.paths, found.num * sizeof(char *));
+    }
+    free(found.paths);
+    return (int)found.num;
+}
@@ -0,0 +1,9 @@
+#ifndef SMALLSH_GLOB_H
+#define SMALLSH_GLOB_H
+
+#include "smallsh_arena.h"
+
+int glob_has_magic(const char *word, const char *end);
+int glob_expand(struct arena *arena, const char *pattern, char ***matches);
+
+#endif
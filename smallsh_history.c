@@ -0,0 +1,286 @@
+#define _POSIX_C_SOURCE 200809L
+// clock_gettime, localtime_r
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "smallsh_history.h"
+#include "smallsh_stats.h"
+
+#define DEBUGHISTORY 0
+
+// The history file is a fixed-size ring of HISTORY_SLOTS entries of
+// HISTORY_ENTRY_SIZE bytes after a header, shared by every shell on the
+// host through a MAP_SHARED mapping
+#define HISTORY_MAGIC 0x31484853534d53ull   // "SMSSHH1"
+#define HISTORY_SLOTS 4096
+#define HISTORY_ENTRY_SIZE 256
+#define HISTORY_TEXT_MAX (HISTORY_ENTRY_SIZE - 40)
+
+struct history_header
+{
+    _Atomic uint64_t magic;     // HISTORY_MAGIC once the layout is set
+    uint32_t num_slots;
+    uint32_t entry_size;
+    // Number of entries ever appended. An appender reserves its slot by
+    // incrementing it.
+    _Atomic uint64_t head;
+    char pad[HISTORY_ENTRY_SIZE - 24];
+};
+
+struct history_entry
+{
+    // 2n + 2 once entry n has been written to this slot, odd while it is
+    // being written. Readers compare it before and after copying.
+    _Atomic uint64_t seq;
+    int64_t time;           // Wall time the command was started, in seconds
+    uint64_t duration_ns;
+    int32_t status;         // Exit value, or -1 if there is none
+    int32_t pid;            // Shell that ran the command
+    uint32_t len;
+    char text[HISTORY_TEXT_MAX];   // Not null-terminated
+};
+
+_Static_assert(sizeof(struct history_header) == HISTORY_ENTRY_SIZE, "history header size");
+_Static_assert(sizeof(struct history_entry) == HISTORY_ENTRY_SIZE, "history entry size");
+
+static struct history_header *header = NULL;
+static struct history_entry *entries = NULL;
+
+// Whether commands of this shell are recorded
+static int recording = 0;
+
+// Pid of this shell, recorded with each entry. glibc does not cache
+// getpid(), so it is read once by history_init().
+static int32_t shell_pid = 0;
+
+// The command being run, appended by history_end() once it is done
+static struct history_entry pending;
+static int have_pending = 0;
+static uint64_t pending_start = 0;
+
+/*  Maps the history file, $SMALLSH_HISTFILE or else ~/.smallsh_history,
+    and if RECORD is set, appends the commands of this shell to it, creating
+    it if needed. Any error leaves the shell without history.
+ */
+void history_init(int record)
+{
+    char *path = getenv("SMALLSH_HISTFILE");
+    char default_path[4096];
+    if (path == NULL || *path == '\0')
+    {
+        char *home = getenv("HOME");
+        if (home == NULL)
+            return;
+        snprintf(default_path, sizeof(default_path), "%s/.smallsh_history", home);
+        path = default_path;
+    }
+
+    int fd = open(path, O_RDWR | (record ? O_CREAT : 0) | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        if (DEBUGHISTORY)
+            perror("history: open()");
+        return;
+    }
+
+    // Growing the file is idempotent, so shells creating it at once agree
+    size_t size = sizeof(struct history_header) + HISTORY_SLOTS * sizeof(struct history_entry);
+    struct stat st;
+    if (fstat(fd, &st) == -1 || ((size_t)st.st_size < size && ftruncate(fd, (off_t)size) == -1))
+    {
+        perror("history: ftruncate()");
+        fflush(stderr);
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("history: mmap()");
+        fflush(stderr);
+        return;
+    }
+
+    // The first shell to see a new file sets the layout. Others racing with
+    // it write the same values.
+    struct history_header *new_header = map;
+    uint64_t magic = atomic_load(&new_header->magic);
+    if (magic == 0)
+    {
+        new_header->num_slots = HISTORY_SLOTS;
+        new_header->entry_size = HISTORY_ENTRY_SIZE;
+        atomic_compare_exchange_strong(&new_header->magic, &magic, HISTORY_MAGIC);
+        magic = HISTORY_MAGIC;
+    }
+    if (magic != HISTORY_MAGIC || new_header->num_slots != HISTORY_SLOTS ||
+        new_header->entry_size != HISTORY_ENTRY_SIZE)
+    {
+        fprintf(stderr, "history: %s: not a history file of this version\n", path);
+        fflush(stderr);
+        munmap(map, size);
+        return;
+    }
+
+    header = new_header;
+    entries = (struct history_entry *)(header + 1);
+    recording = record;
+    shell_pid = (int32_t)getpid();
+}
+
+/*  Notes the start of the command line of LEN bytes at LINE, to be
+    recorded by history_end().
+ */
+void history_begin(const char *line, size_t len)
+{
+    if (!recording)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pending.time = now.tv_sec;
+    pending.status = -1;
+    // Longer lines are truncated, leaving room for a null byte when read
+    pending.len = len < HISTORY_TEXT_MAX ? (uint32_t)len : HISTORY_TEXT_MAX - 1;
+    memcpy(pending.text, line, pending.len);
+    pending_start = stats_now();
+    have_pending = 1;
+}
+
+/*  Sets the exit value of the command being run.
+ */
+void history_set_status(int value)
+{
+    pending.status = value;
+}
+
+/*  Appends the command being run, if any, to the history file. Lock-free:
+    the slot is reserved by an atomic increment of the head, so shells
+    appending at once each get their own, and the entry is published by its
+    sequence number. Only stores to the mapping: no system call is made.
+ */
+void history_end(void)
+{
+    if (!have_pending)
+        return;
+    have_pending = 0;
+    pending.duration_ns = stats_now() - pending_start;
+    pending.pid = shell_pid;
+
+    uint64_t n = atomic_fetch_add(&header->head, 1);
+    struct history_entry *entry = &entries[n % HISTORY_SLOTS];
+    atomic_store_explicit(&entry->seq, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry->time = pending.time;
+    entry->duration_ns = pending.duration_ns;
+    entry->status = pending.status;
+    entry->pid = pending.pid;
+    entry->len = pending.len;
+    memcpy(entry->text, pending.text, pending.len);
+    atomic_store_explicit(&entry->seq, 2 * n + 2, memory_order_release);
+
+    if (DEBUGHISTORY)
+        printf("history: entry %llu\n", (unsigned long long)n);
+}
+
+/*  Copies entry N of the history to COPY, null-terminating its text.
+    Returns 0, or -1 if it has been overwritten or is still being written.
+ */
+static int read_entry(uint64_t n, struct history_entry *copy)
+{
+    struct history_entry *entry = &entries[n % HISTORY_SLOTS];
+    uint64_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+    if (seq != 2 * n + 2)
+        return -1;
+    copy->time = entry->time;
+    copy->duration_ns = entry->duration_ns;
+    copy->status = entry->status;
+    copy->pid = entry->pid;
+    copy->len = entry->len < HISTORY_TEXT_MAX ? entry->len : HISTORY_TEXT_MAX - 1;
+    memcpy(copy->text, entry->text, copy->len);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq)
+        return -1;
+    copy->text[copy->len] = '\0';
+    return 0;
+}
+
+/*  history [-n count] [text]
+    Prints the history of every shell on the host, oldest first: number,
+    start time, exit value, duration and command line. Only commands
+    containing TEXT are printed if it is given, and only the last COUNT of
+    those with -n. Returns 0, or 1 on a usage error or without history.
+ */
+int history_print(struct user_input *user_input)
+{
+    long count = -1;
+    const char *pattern = NULL;
+    for (int i = 1; i < user_input->num_cmd_args; i++)
+    {
+        char *end;
+        if (strcmp(user_input->cmd_args[i], "-n") == 0 && i + 1 < user_input->num_cmd_args &&
+            (count = strtol(user_input->cmd_args[i + 1], &end, 10)) >= 0 && *end == '\0')
+            i++;
+        else if (pattern == NULL && user_input->cmd_args[i][0] != '-')
+            pattern = user_input->cmd_args[i];
+        else
+        {
+            fprintf(stderr, "usage: history [-n count] [text]\n");
+            fflush(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+    if (header == NULL)
+    {
+        fprintf(stderr, "history: no history file\n");
+        fflush(stderr);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t head = atomic_load(&header->head);
+    uint64_t first = head > HISTORY_SLOTS ? head - HISTORY_SLOTS : 0;
+
+    // With a count, find where the last COUNT matches begin
+    static struct history_entry copy;
+    if (count >= 0)
+    {
+        uint64_t n = head;
+        long matches = 0;
+        while (n > first && matches < count)
+        {
+            n--;
+            if (read_entry(n, &copy) == 0 && (pattern == NULL || strstr(copy.text, pattern)))
+                matches++;
+        }
+        first = matches < count ? first : n;
+    }
+
+    for (uint64_t n = first; n < head; n++)
+    {
+        if (read_entry(n, &copy) == -1)
+            continue;
+        if (pattern && strstr(copy.text, pattern) == NULL)
+            continue;
+
+        char date[32];
+        time_t start = (time_t)copy.time;
+        struct tm tm;
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime_r(&start, &tm));
+        char status[16];
+        if (copy.status == -1)
+            strcpy(status, "-");
+        else
+            snprintf(status, sizeof(status), "%d", copy.status);
+        printf("%6llu  %s  %3s  %9.3fs  %s\n", (unsigned long long)n + 1, date, status,
+               copy.duration_ns / 1e9, copy.text);
+    }
+    fflush(stdout);
+    return EXIT_SUCCESS;
+}
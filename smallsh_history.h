@@ -0,0 +1,13 @@
+#ifndef SMALLSH_HISTORY_H
+#define SMALLSH_HISTORY_H
+
+#include <stddef.h>
+#include "smallsh.h"
+
+void history_init(int record);
+void history_begin(const char *line, size_t len);
+void history_set_status(int value);
+void history_end(void);
+int history_print(struct user_input *user_input);
+
+#endif
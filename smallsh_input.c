@@ -0,0 +1,220 @@
+#define _DEFAULT_SOURCE
+// madvise
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "smallsh_input.h"
+
+#define DEBUGREADER 0
+
+// Size of each read() in block mode. The buffer grows for longer lines.
+#define READER_BLOCK_SIZE 65536
+
+// Initial buffer size for a terminal, which returns a line per read()
+#define READER_LINE_SIZE 4096
+
+/*  Sets up READER to read lines from FD. A regular file is mapped into
+    memory whole; other files (pipes, terminals) are read in blocks of
+    READER_BLOCK_SIZE. FD is not closed by reader_close(). Returns 0 on
+    success, or -1 after printing an error.
+ */
+int reader_open_fd(struct reader *reader, int fd)
+{
+    memset(reader, '\0', sizeof(struct reader));
+    reader->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        // Map from the current offset, so input already consumed by
+        // whoever ran the shell is skipped
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset == -1)
+            offset = 0;
+        reader->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (reader->map != MAP_FAILED)
+        {
+            madvise(reader->map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            reader->map_len = (size_t)st.st_size;
+            reader->start = (size_t)offset < reader->map_len ? (size_t)offset : reader->map_len;
+            reader->end = reader->map_len;
+            reader->eof = 1;
+            if (DEBUGREADER)
+                printf("reader: mapped %zu bytes\n", reader->map_len);
+            return 0;
+        }
+        reader->map = NULL;
+    }
+
+    reader->buf_size = READER_BLOCK_SIZE;
+    reader->buf = malloc(reader->buf_size);
+    if (reader->buf == NULL)
+    {
+        perror("reader: malloc()");
+        return -1;
+    }
+    return 0;
+}
+
+/*  Sets up READER to read lines typed at the terminal FD. Lines of any
+    length are read without a fixed buffer limit, and only the bytes read
+    are ever touched: the buffer is not cleared between lines. A signal
+    interrupting a read makes reader_getline() return NULL without reaching
+    the end of input, so the caller can redisplay its prompt. Returns 0 on
+    success, or -1 after printing an error.
+ */
+int reader_open_interactive(struct reader *reader, int fd)
+{
+    memset(reader, '\0', sizeof(struct reader));
+    reader->fd = fd;
+    reader->interactive = 1;
+    reader->buf_size = READER_LINE_SIZE;
+    reader->buf = malloc(reader->buf_size);
+    if (reader->buf == NULL)
+    {
+        perror("reader: malloc()");
+        return -1;
+    }
+    return 0;
+}
+
+/*  Opens the file at PATH and sets up READER to read lines from it.
+    Returns 0 on success, or -1 after printing an error.
+ */
+int reader_open_file(struct reader *reader, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "%s: ", path);
+        perror("");
+        return -1;
+    }
+    if (reader_open_fd(reader, fd) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*  Sets up READER to read lines from the LEN bytes at BUF, which must have
+    been allocated with malloc() and is freed by reader_close().
+ */
+void reader_open_buffer(struct reader *reader, char *buf, size_t len)
+{
+    memset(reader, '\0', sizeof(struct reader));
+    reader->fd = -1;
+    reader->buf = buf;
+    reader->buf_size = len;
+    reader->end = len;
+    reader->eof = 1;
+}
+
+/*  Reads the next block of input into the buffer of READER, moving any
+    partial line to the front and growing the buffer when the partial line
+    fills it. Returns the number of bytes read, 0 at end of input, or -1.
+ */
+static ssize_t fill_buffer(struct reader *reader)
+{
+    if (reader->start > 0)
+    {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end == reader->buf_size)
+    {
+        char *new_buf = realloc(reader->buf, reader->buf_size * 2);
+        if (new_buf == NULL)
+        {
+            perror("reader: realloc()");
+            return -1;
+        }
+        reader->buf = new_buf;
+        reader->buf_size *= 2;
+    }
+
+    ssize_t n;
+    do
+        n = read(reader->fd, reader->buf + reader->end, reader->buf_size - reader->end);
+    while (n == -1 && errno == EINTR && !reader->interactive);
+    if (n == -1 && errno == EINTR)
+        return -1;
+
+    if (n > 0)
+        reader->end += (size_t)n;
+    else
+        reader->eof = 1;
+    return n;
+}
+
+/*  Returns 1 if reader_getline() can return a line without reading: a
+    whole line is buffered or the input has ended. Returns 0 otherwise.
+ */
+int reader_has_line(const struct reader *reader)
+{
+    const char *data = reader->map ? reader->map : reader->buf;
+    return reader->eof || memchr(data + reader->start, '\n', reader->end - reader->start) != NULL;
+}
+
+/*  Returns the next line of input, without its newline, and stores its
+    length in *LEN. The line is not null-terminated and is only valid until
+    the next call. Mapped lines are returned in place without copying.
+    Returns NULL at end of input, or if an interactive read was interrupted,
+    in which case eof is not set and the partial line is kept.
+ */
+const char *reader_getline(struct reader *reader, size_t *len)
+{
+    char *data = reader->map ? reader->map : reader->buf;
+    size_t scanned = reader->start;
+
+    while (1)
+    {
+        char *newline = memchr(data + scanned, '\n', reader->end - scanned);
+        if (newline)
+        {
+            const char *line = data + reader->start;
+            *len = (size_t)(newline - line);
+            reader->start = (size_t)(newline - data) + 1;
+            return line;
+        }
+
+        if (reader->eof)
+        {
+            // Last line without a trailing newline
+            if (reader->start == reader->end)
+                return NULL;
+            const char *line = data + reader->start;
+            *len = reader->end - reader->start;
+            reader->start = reader->end;
+            return line;
+        }
+
+        // Only the bytes read by this fill need to be searched
+        size_t partial = reader->end - reader->start;
+        if (fill_buffer(reader) == -1)
+        {
+            if (reader->interactive && errno == EINTR)
+                return NULL;
+            reader->eof = 1;
+        }
+        data = reader->buf;
+        scanned = partial;
+    }
+}
+
+/*  Releases the memory held by READER.
+ */
+void reader_close(struct reader *reader)
+{
+    if (reader->map)
+        munmap(reader->map, reader->map_len);
+    free(reader->buf);
+    memset(reader, '\0', sizeof(struct reader));
+}
@@ -0,0 +1,28 @@
+#ifndef SMALLSH_INPUT_H
+#define SMALLSH_INPUT_H
+
+#include <stddef.h>
+
+// Line reader. Regular files are mapped into memory; anything else is read
+// in large blocks, or as it arrives for a terminal.
+struct reader
+{
+    int fd;
+    char *map;          // Mapped file, or NULL when reading blocks
+    size_t map_len;
+    char *buf;          // Block buffer
+    size_t buf_size;
+    size_t start, end;  // Unconsumed bytes: map[start, end) or buf[start, end)
+    int eof;
+    int interactive;    // A read interrupted by a signal returns no line
+};
+
+int reader_open_file(struct reader *reader, const char *path);
+int reader_open_fd(struct reader *reader, int fd);
+int reader_open_interactive(struct reader *reader, int fd);
+void reader_open_buffer(struct reader *reader, char *buf, size_t len);
+int reader_has_line(const struct reader *reader);
+const char *reader_getline(struct reader *reader, size_t *len);
+void reader_close(struct reader *reader);
+
+#endif
@@ -0,0 +1,422 @@
+#define _DEFAULT_SOURCE
+// strdup, clock_gettime, timeradd
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "smallsh_jobs.h"
+#include "smallsh_trace.h"
+#include "smallsh_stats.h"
+
+#define DEBUGJOBS 0
+
+// Job records are allocated this many at a time
+#define JOB_SLAB_SIZE 64
+
+// Initial number of slots in the pid table. Always a power of two.
+#define PID_TABLE_INIT_SLOTS 64
+
+// A block of job records
+struct job_slab
+{
+    struct job jobs[JOB_SLAB_SIZE];
+    struct job_slab *next;
+};
+
+static struct job_slab *slabs = NULL;
+static struct job *free_jobs = NULL;
+
+// Open-addressed (linear probing) table from pid to job. Every process of
+// every job has an entry until its job is removed.
+struct pid_slot
+{
+    pid_t pid;          // 0 if the slot is empty
+    struct job *job;
+};
+static struct pid_slot *pid_table = NULL;
+static size_t pid_slots = 0;
+static size_t pid_used = 0;
+
+// Background jobs indexed by job number. jobs_by_id[0] is unused.
+static struct job **jobs_by_id = NULL;
+static int jobs_by_id_size = 0;
+static int max_job_id = 0;
+static int num_jobs = 0;
+
+/*  Returns the home slot of PID in the pid table.
+ */
+static size_t pid_hash(pid_t pid)
+{
+    // Fibonacci hashing spreads consecutive pids across the table
+    return ((size_t)pid * 11400714819323198485u) >> 32;
+}
+
+/*  Returns the slot holding PID, or the empty slot where it would be
+    inserted.
+ */
+static size_t find_pid_slot(pid_t pid)
+{
+    size_t mask = pid_slots - 1;
+    size_t i = pid_hash(pid) & mask;
+    while (pid_table[i].pid != 0 && pid_table[i].pid != pid)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/*  Doubles the number of slots in the pid table (or allocates it).
+ */
+static void grow_pid_table(void)
+{
+    struct pid_slot *old_table = pid_table;
+    size_t old_slots = pid_slots;
+
+    pid_slots = old_slots ? old_slots * 2 : PID_TABLE_INIT_SLOTS;
+    pid_table = calloc(pid_slots, sizeof(struct pid_slot));
+    if (pid_table == NULL)
+    {
+        perror("jobs: calloc()");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < old_slots; i++)
+    {
+        if (old_table[i].pid != 0)
+            pid_table[find_pid_slot(old_table[i].pid)] = old_table[i];
+    }
+    free(old_table);
+}
+
+/*  Adds PID to the pid table as a process of JOB.
+ */
+static void pid_insert(pid_t pid, struct job *job)
+{
+    // Keep the load factor at or below 1/2
+    if ((pid_used + 1) * 2 > pid_slots)
+        grow_pid_table();
+
+    size_t i = find_pid_slot(pid);
+    if (pid_table[i].pid == 0)
+        pid_used++;
+    pid_table[i].pid = pid;
+    pid_table[i].job = job;
+}
+
+/*  Removes PID from the pid table, shifting back any entries that probed past
+    its slot.
+ */
+static void pid_delete(pid_t pid)
+{
+    if (pid_slots == 0)
+        return;
+
+    size_t mask = pid_slots - 1;
+    size_t i = find_pid_slot(pid);
+    if (pid_table[i].pid == 0)
+        return;
+
+    pid_table[i].pid = 0;
+    pid_used--;
+
+    size_t j = i;
+    while (1)
+    {
+        j = (j + 1) & mask;
+        if (pid_table[j].pid == 0)
+            break;
+        size_t home = pid_hash(pid_table[j].pid) & mask;
+        // Move entry j to i unless its home slot lies cyclically in (i, j]
+        int in_range = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!in_range)
+        {
+            pid_table[i] = pid_table[j];
+            pid_table[j].pid = 0;
+            i = j;
+        }
+    }
+}
+
+/*  Returns a zeroed job record from the free list, allocating a new slab of
+    records if the list is empty.
+ */
+static struct job *alloc_job(void)
+{
+    if (free_jobs == NULL)
+    {
+        struct job_slab *slab = calloc(1, sizeof(struct job_slab));
+        if (slab == NULL)
+        {
+            perror("jobs: calloc()");
+            exit(1);
+        }
+        slab->next = slabs;
+        slabs = slab;
+        for (int i = JOB_SLAB_SIZE - 1; i >= 0; i--)
+        {
+            slab->jobs[i].next_free = free_jobs;
+            free_jobs = &slab->jobs[i];
+        }
+    }
+
+    struct job *job = free_jobs;
+    free_jobs = job->next_free;
+    memset(job, '\0', sizeof(struct job));
+    return job;
+}
+
+/*  Adds a job for the NUM_PROCS processes in PIDS, skipping entries of -1,
+    launched from the command line CMD_LINE in process group PGID (0 for the
+    shell's own group). If BACKGROUND is non-zero the job is given a job
+    number; otherwise it is a foreground job until job_set_background().
+    Returns the new job.
+ */
+struct job *job_add(const pid_t *pids, int num_procs, pid_t pgid,
+                    const char *cmd_line, int background)
+{
+    struct job *job = alloc_job();
+    job->pgid = pgid;
+    job->cmd_line = strdup(cmd_line);
+    job->procs = calloc(num_procs, sizeof(struct job_proc));
+    job->state = JOB_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &job->start_time);
+
+    for (int i = 0; i < num_procs; i++)
+    {
+        if (pids[i] == -1)
+            continue;
+        struct job_proc *proc = &job->procs[job->num_procs++];
+        proc->pid = pids[i];
+        proc->live = 1;
+        pid_insert(pids[i], job);
+    }
+    job->num_live = job->num_procs;
+
+    if (background)
+        job_set_background(job);
+
+    if (DEBUGJOBS)
+        printf("job_add: [%d] %d procs, pgid %d: %s\n", job->id, job->num_procs, pgid, cmd_line);
+
+    return job;
+}
+
+/*  Gives the foreground job JOB the next job number, making it a background
+    job.
+ */
+void job_set_background(struct job *job)
+{
+    if (job->id != 0)
+        return;
+
+    job->id = max_job_id + 1;
+    if (job->id >= jobs_by_id_size)
+    {
+        int new_size = jobs_by_id_size ? jobs_by_id_size * 2 : 16;
+        struct job **new_jobs = realloc(jobs_by_id, new_size * sizeof(struct job *));
+        if (new_jobs == NULL)
+        {
+            perror("jobs: realloc()");
+            exit(1);
+        }
+        memset(new_jobs + jobs_by_id_size, '\0', (new_size - jobs_by_id_size) * sizeof(struct job *));
+        jobs_by_id = new_jobs;
+        jobs_by_id_size = new_size;
+    }
+    jobs_by_id[job->id] = job;
+    max_job_id = job->id;
+    num_jobs++;
+}
+
+/*  Returns the job that process PID belongs to, or NULL.
+ */
+struct job *job_find_pid(pid_t pid)
+{
+    if (pid_slots == 0)
+        return NULL;
+    size_t i = find_pid_slot(pid);
+    return pid_table[i].pid == pid ? pid_table[i].job : NULL;
+}
+
+/*  Returns the background job with job number ID, or NULL.
+ */
+struct job *job_find_id(int id)
+{
+    if (id <= 0 || id > max_job_id)
+        return NULL;
+    return jobs_by_id[id];
+}
+
+/*  Returns the background job with the highest job number, or NULL.
+ */
+struct job *job_last(void)
+{
+    return job_find_id(max_job_id);
+}
+
+/*  Returns the background job following JOB in job number order, or the
+    first one if JOB is NULL. Returns NULL after the last job.
+ */
+struct job *job_next(struct job *job)
+{
+    for (int id = job ? job->id + 1 : 1; id <= max_job_id; id++)
+    {
+        if (jobs_by_id[id])
+            return jobs_by_id[id];
+    }
+    return NULL;
+}
+
+/*  Records the wait status STATUS reported for process PID of JOB, updating
+    the state of the job. USAGE, if not NULL, is the resource usage reported
+    with it. Returns the process, or NULL if PID is not in JOB.
+ */
+struct job_proc *job_update(struct job *job, pid_t pid, int status,
+                            const struct rusage *usage)
+{
+    struct job_proc *proc = NULL;
+    for (int i = 0; i < job->num_procs && !proc; i++)
+    {
+        if (job->procs[i].pid == pid)
+            proc = &job->procs[i];
+    }
+    if (proc == NULL || !proc->live)
+        return proc;
+
+    if (WIFSTOPPED(status))
+    {
+        if (!proc->stopped)
+            job->num_stopped++;
+        proc->stopped = 1;
+    }
+    else if (WIFCONTINUED(status))
+    {
+        if (proc->stopped)
+            job->num_stopped--;
+        proc->stopped = 0;
+    }
+    else
+    {
+        // Terminated
+        proc->status = status;
+        if (usage)
+            proc->usage = *usage;
+        if (proc->stopped)
+            job->num_stopped--;
+        proc->stopped = 0;
+        proc->live = 0;
+        proc->end_ns = stats_now();
+        job->num_live--;
+        if (trace_enabled)
+            trace_exit(pid, status, job->cmd_line);
+    }
+
+    if (job->num_live == 0)
+        job->state = JOB_DONE;
+    else if (job->num_stopped == job->num_live)
+        job->state = JOB_STOPPED;
+    else
+        job->state = JOB_RUNNING;
+
+    return proc;
+}
+
+/*  Removes JOB from the table and returns its record to the free list.
+ */
+void job_remove(struct job *job)
+{
+    for (int i = 0; i < job->num_procs; i++)
+        pid_delete(job->procs[i].pid);
+
+    if (job->id != 0)
+    {
+        jobs_by_id[job->id] = NULL;
+        num_jobs--;
+        while (max_job_id > 0 && jobs_by_id[max_job_id] == NULL)
+            max_job_id--;
+    }
+
+    free(job->procs);
+    free(job->cmd_line);
+    job->next_free = free_jobs;
+    free_jobs = job;
+}
+
+/*  Sends SIGNUM to every live process of JOB: to its process group if it has
+    one, or else to each process. Returns 0 on success, or -1 if a kill failed.
+ */
+int job_signal(struct job *job, int signum)
+{
+    if (job->pgid > 0)
+        return kill(-job->pgid, signum);
+
+    int result = 0;
+    for (int i = 0; i < job->num_procs; i++)
+    {
+        if (job->procs[i].live && kill(job->procs[i].pid, signum) == -1)
+            result = -1;
+    }
+    return result;
+}
+
+/*  Marks every stopped process of JOB as running again and sends it SIGCONT.
+    Returns the result of job_signal().
+ */
+int job_continue(struct job *job)
+{
+    for (int i = 0; i < job->num_procs; i++)
+        job->procs[i].stopped = 0;
+    job->num_stopped = 0;
+    if (job->num_live > 0)
+        job->state = JOB_RUNNING;
+    return job_signal(job, SIGCONT);
+}
+
+/*  Prints the job number, state, pids, command line and running time of
+    JOB, as listed by the jobs command.
+ */
+void job_print(struct job *job)
+{
+    static const char *state_names[] = {"Running", "Stopped", "Done"};
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (long)(now.tv_sec - job->start_time.tv_sec);
+
+    printf("[%d]%c %-8s ", job->id, job == job_last() ? '+' : ' ', state_names[job->state]);
+    for (int i = 0; i < job->num_procs; i++)
+    {
+        if (job->procs[i].live)
+            printf("%d ", job->procs[i].pid);
+    }
+    printf(" %s  (%lds)\n", job->cmd_line, elapsed);
+}
+
+/*  Stores in TOTAL the resource usage of every terminated process of JOB:
+    the sum of their CPU times, faults and context switches, and the largest
+    of their maximum resident set sizes.
+ */
+void job_usage(struct job *job, struct rusage *total)
+{
+    memset(total, '\0', sizeof(struct rusage));
+    for (int i = 0; i < job->num_procs; i++)
+    {
+        const struct rusage *usage = &job->procs[i].usage;
+        timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+        timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+        if (usage->ru_maxrss > total->ru_maxrss)
+            total->ru_maxrss = usage->ru_maxrss;
+        total->ru_minflt += usage->ru_minflt;
+        total->ru_majflt += usage->ru_majflt;
+        total->ru_nvcsw += usage->ru_nvcsw;
+        total->ru_nivcsw += usage->ru_nivcsw;
+    }
+}
+
+/*  Returns the number of background jobs.
+ */
+int job_count(void)
+{
+    return num_jobs;
+}
@@ -0,0 +1,62 @@
+#ifndef SMALLSH_JOBS_H
+#define SMALLSH_JOBS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// State of a job as a whole
+enum job_state
+{
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+};
+
+// A process of a job
+struct job_proc
+{
+    pid_t pid;
+    int status;         // Last wait status reported for the process
+    char live;          // Non-zero until the process has terminated
+    char stopped;       // Non-zero while the process is stopped
+    char reported;      // Non-zero once its termination has been printed
+    struct rusage usage;    // Resource usage, once terminated
+    uint64_t end_ns;        // When its termination was reaped (stats_now()),
+                            // to measure the delay until it is reported
+};
+
+// A job: one pipeline launched by the shell
+struct job
+{
+    int id;                 // Job number, as in %N. 0 for a foreground job.
+    pid_t pgid;             // Process group, or 0 if in the shell's group
+    int num_procs;
+    int num_live;           // Processes not yet terminated
+    int num_stopped;        // Live processes currently stopped
+    int num_reported;       // Terminated processes already printed
+    struct job_proc *procs;
+    char *cmd_line;
+    struct timespec start_time;
+    enum job_state state;
+    struct job *next_free;  // Next record in the free list of the slab
+};
+
+struct job *job_add(const pid_t *pids, int num_procs, pid_t pgid,
+                    const char *cmd_line, int background);
+void job_set_background(struct job *job);
+struct job *job_find_pid(pid_t pid);
+struct job *job_find_id(int id);
+struct job *job_last(void);
+struct job *job_next(struct job *job);
+struct job_proc *job_update(struct job *job, pid_t pid, int status,
+                            const struct rusage *usage);
+void job_remove(struct job *job);
+int job_signal(struct job *job, int signum);
+int job_continue(struct job *job);
+void job_print(struct job *job);
+void job_usage(struct job *job, struct rusage *total);
+int job_count(void);
+
+#endif
@@ -0,0 +1,333 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "smallsh_lex.h"
+#include "smallsh_glob.h"
+#include "smallsh_vars.h"
+
+#define DEBUGLEX 0
+
+// The shell's pid in ASCII, the expansion of "$$". Set once by lex_init().
+static char pid_str[24] = {'\0'};
+static size_t pid_len = 0;
+
+/*  Caches the shell's pid as a string, so "$$" expands without a getpid()
+    and sprintf() per token. Must be called at startup.
+ */
+void lex_init(void)
+{
+    pid_len = (size_t)snprintf(pid_str, sizeof(pid_str), "%d", (int)getpid());
+}
+
+/*  Returns the cached expansion of "$$".
+ */
+const char *lex_pid_str(void)
+{
+    return pid_str;
+}
+
+/*  Returns the operator type of the word of LEN bytes at WORD, or TOK_WORD.
+ */
+static enum token_type operator_type(const char *word, size_t len)
+{
+    if (len > 1)
+    {
+        if (len == 2 && word[0] == '<' && word[1] == '<')
+            return TOK_HERE_DOC;
+        if (len == 3 && word[0] == '<' && word[1] == '<' && word[2] == '<')
+            return TOK_HERE_STRING;
+        return TOK_WORD;
+    }
+
+    switch (word[0])
+    {
+    case '<':
+        return TOK_REDIR_IN;
+    case '>':
+        return TOK_REDIR_OUT;
+    case '|':
+        return TOK_PIPE;
+    case '&':
+        return TOK_BG;
+    default:
+        return TOK_WORD;
+    }
+}
+
+/*  Returns the length of the variable name at P, before END: a letter or
+    '_' followed by letters, digits and '_'.
+ */
+static size_t name_length(const char *p, const char *end)
+{
+    size_t len = 0;
+    while (p + len < end &&
+           (p[len] == '_' || (p[len] >= 'a' && p[len] <= 'z') || (p[len] >= 'A' && p[len] <= 'Z') ||
+            (len > 0 && p[len] >= '0' && p[len] <= '9')))
+        len++;
+    return len;
+}
+
+/*  Looks up the expansion starting at the '$' at DOLLAR, before END: "$$",
+    "$?", "$!", "$NAME" or "${NAME}". Stores its value, empty for an unset
+    variable, in *VALUE and *VALUE_LEN, and returns the end of the reference,
+    or NULL if the '$' does not start one and is literal.
+ */
+static const char *dollar_value(const char *dollar, const char *end,
+                                const char **value, size_t *value_len)
+{
+    const char *p = dollar + 1;
+    if (p == end)
+        return NULL;
+    if (*p == '$')
+    {
+        *value = pid_str;
+        *value_len = pid_len;
+        return p + 1;
+    }
+    if ((*value = vars_special(*p)) != NULL)
+    {
+        *value_len = strlen(*value);
+        return p + 1;
+    }
+
+    int braced = *p == '{';
+    p += braced;
+    size_t len = name_length(p, end);
+    if (len == 0 || (braced && (p + len == end || p[len] != '}')))
+        return NULL;
+    *value = vars_get(p, len);
+    if (*value == NULL)
+        *value = "";
+    *value_len = strlen(*value);
+    return p + len + braced;
+}
+
+/*  Copies the text from P to END to OUT, which must hold lex_expand_len()
+    of it, replacing each "$$" with the shell's pid and each "$?", "$!",
+    "$NAME" and "${NAME}" with its value. Returns the end of the copy. Sets
+    *EXPANDED if there was an expansion.
+ */
+static char *expand_dollars(char *out, const char *p, const char *end, int *expanded)
+{
+    while (p < end)
+    {
+        const char *dollar = memchr(p, '$', (size_t)(end - p));
+        if (dollar == NULL)
+        {
+            memcpy(out, p, (size_t)(end - p));
+            return out + (end - p);
+        }
+
+        memcpy(out, p, (size_t)(dollar - p));
+        out += dollar - p;
+        const char *value;
+        size_t value_len;
+        const char *next = dollar_value(dollar, end, &value, &value_len);
+        if (next)
+        {
+            memcpy(out, value, value_len);
+            out += value_len;
+            *expanded = 1;
+            p = next;
+        }
+        else
+        {
+            *out++ = '$';
+            p = dollar + 1;
+        }
+    }
+    return out;
+}
+
+/*  Returns the size of the expansion of the LEN bytes of TEXT by
+    lex_expand(). Text without a '$' is measured with a single memchr.
+ */
+size_t lex_expand_len(const char *text, size_t len)
+{
+    const char *p = text, *end = text + len;
+    size_t total = len;
+    const char *dollar;
+    while (p < end && (dollar = memchr(p, '$', (size_t)(end - p))) != NULL)
+    {
+        const char *value;
+        size_t value_len;
+        const char *next = dollar_value(dollar, end, &value, &value_len);
+        if (next)
+        {
+            total += value_len - (size_t)(next - dollar);
+            p = next;
+        }
+        else
+            p = dollar + 1;
+    }
+    return total;
+}
+
+/*  Copies the LEN bytes of TEXT to OUT, which must hold
+    lex_expand_len(TEXT, LEN) bytes, expanding "$$" and variables as in
+    words. Used for the body of a here-doc. Returns the length of the copy,
+    which is not null-terminated.
+ */
+size_t lex_expand(char *out, const char *text, size_t len)
+{
+    int expanded = 0;
+    return (size_t)(expand_dollars(out, text, text + len, &expanded) - out);
+}
+
+/*  Splits the LEN bytes of LINE (which need not be null-terminated) into
+    space-separated tokens, expanding every "$$" in a word to the shell's
+    pid and every "$?", "$!", "$NAME" and "${NAME}" to its value. A word
+    that expands to nothing is dropped. Values are not split into words.
+    Words consisting only of "<", ">", "|", "&", "<<" or
+    "<<<" are operators. Words containing a wildcard are flagged TOK_GLOB,
+    to be expanded by the parser.
+
+    Spaces and '$' are located with memchr, which scans many bytes per
+    instruction, and the literal runs between them are copied with memcpy.
+    The expanded text of every token is written straight into one buffer
+    sized by lex_expand_len(), so no token is ever copied twice.
+
+    Everything is allocated from ARENA. Stores the token array in *TOKENS and
+    returns the number of tokens.
+ */
+int lex_line(struct arena *arena, const char *line, size_t len,
+             struct token **tokens)
+{
+    // Worst case: every token is one byte followed by a separator. Each
+    // token also needs a null byte.
+    size_t max_tokens = len / 2 + 1;
+    size_t out_size = lex_expand_len(line, len) + max_tokens + 1;
+    char *out = arena_alloc(arena, out_size);
+    *tokens = arena_alloc(arena, max_tokens * sizeof(struct token));
+
+    const char *p = line;
+    const char *end = line + len;
+    int num_tokens = 0;
+
+    while (p < end)
+    {
+        // Skip separators
+        while (p < end && *p == ' ')
+            p++;
+        if (p == end)
+            break;
+
+        const char *word_end = memchr(p, ' ', (size_t)(end - p));
+        if (word_end == NULL)
+            word_end = end;
+
+        struct token *token = &(*tokens)[num_tokens++];
+        token->text = out;
+        token->flags = 0;
+        token->type = (word_end - p <= 3) ? operator_type(p, (size_t)(word_end - p)) : TOK_WORD;
+
+        // Copy the word, expanding each "$$" and variable
+        int expanded = 0;
+        out = expand_dollars(out, p, word_end, &expanded);
+        p = word_end;
+        token->len = (size_t)(out - token->text);
+        if (expanded)
+        {
+            token->flags |= TOK_EXPANDED;
+            if (token->len == 0)
+            {
+                num_tokens--;
+                continue;
+            }
+        }
+        if (token->type == TOK_WORD && glob_has_magic(token->text, out))
+            token->flags |= TOK_GLOB;
+        *out++ = '\0';
+
+        if (DEBUGLEX)
+            printf("token %d: type %d '%s'\n", num_tokens - 1, token->type, token->text);
+    }
+
+    return num_tokens;
+}
+
+/*  Splits the LEN bytes of LINE into tokens like lex_line(), but without
+    expanding them: each word is copied as it is, and a word containing a
+    '$' is flagged TOK_DOLLAR instead, to be expanded by
+    lex_expand_tokens() once the values are known. The tokens depend on
+    nothing but LINE, so they can be kept for later runs of the same line
+    (see smallsh_script.c).
+
+    Everything is allocated from ARENA. Stores the token array in *TOKENS and
+    returns the number of tokens.
+ */
+int lex_split(struct arena *arena, const char *line, size_t len,
+              struct token **tokens)
+{
+    size_t max_tokens = len / 2 + 1;
+    char *out = arena_alloc(arena, len + max_tokens + 1);
+    *tokens = arena_alloc(arena, max_tokens * sizeof(struct token));
+
+    const char *p = line;
+    const char *end = line + len;
+    int num_tokens = 0;
+
+    while (p < end)
+    {
+        while (p < end && *p == ' ')
+            p++;
+        if (p == end)
+            break;
+
+        const char *word_end = memchr(p, ' ', (size_t)(end - p));
+        if (word_end == NULL)
+            word_end = end;
+
+        struct token *token = &(*tokens)[num_tokens++];
+        token->text = out;
+        token->len = (size_t)(word_end - p);
+        token->type = (token->len <= 3) ? operator_type(p, token->len) : TOK_WORD;
+        token->flags = 0;
+        memcpy(out, p, token->len);
+        out += token->len;
+        *out++ = '\0';
+        if (memchr(p, '$', token->len))
+            token->flags |= TOK_DOLLAR;
+        else if (token->type == TOK_WORD && glob_has_magic(token->text, token->text + token->len))
+            token->flags |= TOK_GLOB;
+        p = word_end;
+    }
+
+    return num_tokens;
+}
+
+/*  Expands, in place, the NUM_TOKENS TOKENS split by lex_split(), with the
+    same result as lex_line() on their line: each token flagged TOK_DOLLAR
+    is expanded into a copy allocated from ARENA, and dropped if it expands
+    to nothing. Tokens without a '$' are kept as they are. Returns the
+    number of tokens left.
+ */
+int lex_expand_tokens(struct arena *arena, struct token *tokens, int num_tokens)
+{
+    int kept = 0;
+    for (int i = 0; i < num_tokens; i++)
+    {
+        struct token token = tokens[i];
+        if (token.flags & TOK_DOLLAR)
+        {
+            char *out = arena_alloc(arena, lex_expand_len(token.text, token.len) + 1);
+            int expanded = 0;
+            char *out_end = expand_dollars(out, token.text, token.text + token.len, &expanded);
+            *out_end = '\0';
+            token.text = out;
+            token.len = (size_t)(out_end - out);
+            token.flags &= ~TOK_DOLLAR;
+            if (expanded)
+            {
+                token.flags |= TOK_EXPANDED;
+                if (token.len == 0)
+                    continue;
+            }
+            if (token.type == TOK_WORD && glob_has_magic(out, out_end))
+                token.flags |= TOK_GLOB;
+        }
+        tokens[kept++] = token;
+    }
+    return kept;
+}
@@ -0,0 +1,42 @@
+#ifndef SMALLSH_LEX_H
+#define SMALLSH_LEX_H
+
+#include <stddef.h>
+#include "smallsh_arena.h"
+
+// Kinds of tokens. Operators are only recognized as whole words.
+enum token_type
+{
+    TOK_WORD,
+    TOK_REDIR_IN,   // <
+    TOK_REDIR_OUT,  // >
+    TOK_PIPE,       // |
+    TOK_BG,         // &
+    TOK_HERE_DOC,   // <<
+    TOK_HERE_STRING // <<<
+};
+
+// Token flags
+#define TOK_EXPANDED 0x1    // The word contained "$$" or a variable
+#define TOK_GLOB 0x2        // The word contains a wildcard (see smallsh_glob.c)
+#define TOK_DOLLAR 0x4      // Split but not yet expanded: the word contains a '$'
+
+struct token
+{
+    enum token_type type;
+    int flags;
+    char *text;         // Expanded, null-terminated text
+    size_t len;
+};
+
+void lex_init(void);
+const char *lex_pid_str(void);
+int lex_line(struct arena *arena, const char *line, size_t len,
+             struct token **tokens);
+int lex_split(struct arena *arena, const char *line, size_t len,
+              struct token **tokens);
+int lex_expand_tokens(struct arena *arena, struct token *tokens, int num_tokens);
+size_t lex_expand_len(const char *text, size_t len);
+size_t lex_expand(char *out, const char *text, size_t len);
+
+#endif
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+// memfd_create, sendfile
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include "smallsh_parallel.h"
+#include "smallsh_spawn.h"
+#include "smallsh_events.h"
+#include "smallsh_jobs.h"
+#include "smallsh_input.h"
+
+#define DEBUGPARALLEL 0
+
+// Separates the command template from the argument list
+#define ARGS_SYM ":::"
+
+// Replaced by the argument in each word of the template
+#define ARG_SUBST "{}"
+
+// A task of the work queue: one command run for one argument
+struct task
+{
+    struct job *job;    // Job tracking the running process, or NULL
+    int out_fd;         // Buffered output in ordered mode, or -1
+    int status;         // Wait status once finished
+    char done;
+};
+
+/*  Returns a copy of WORD, allocated from ARENA, with every "{}" replaced by
+    ARG.
+ */
+static char *substitute(struct arena *arena, const char *word, const char *arg)
+{
+    size_t arg_len = strlen(arg);
+    size_t len = strlen(word);
+    int count = 0;
+    for (const char *p = strstr(word, ARG_SUBST); p; p = strstr(p + 2, ARG_SUBST))
+        count++;
+
+    char *result = arena_alloc(arena, len + count * arg_len + 1);
+    char *out = result;
+    const char *p = word;
+    const char *match;
+    while ((match = strstr(p, ARG_SUBST)) != NULL)
+    {
+        memcpy(out, p, (size_t)(match - p));
+        out += match - p;
+        memcpy(out, arg, arg_len);
+        out += arg_len;
+        p = match + 2;
+    }
+    strcpy(out, p);
+    return result;
+}
+
+/*  Returns the command for argument ARG, allocated from ARENA: the NUM_WORDS
+    words of TEMPLATE with "{}" replaced by ARG, or followed by ARG if no word
+    contains "{}". It is launched with CONTROLS, which may be NULL.
+ */
+static struct user_input *make_command(struct arena *arena, char **template,
+                                       int num_words, const char *arg,
+                                       struct spawn_controls *controls)
+{
+    int has_subst = 0;
+    for (int i = 0; i < num_words && !has_subst; i++)
+        has_subst = strstr(template[i], ARG_SUBST) != NULL;
+
+    struct user_input *command = arena_calloc(arena, sizeof(struct user_input));
+    command->cmd_args = arena_alloc(arena, (num_words + 2) * sizeof(char *));
+    for (int i = 0; i < num_words; i++)
+    {
+        if (has_subst)
+            command->cmd_args[i] = substitute(arena, template[i], arg);
+        else
+            command->cmd_args[i] = template[i];
+    }
+    command->num_cmd_args = num_words;
+    if (!has_subst)
+        command->cmd_args[command->num_cmd_args++] = (char *)arg;
+    command->cmd_args[command->num_cmd_args] = NULL;
+    command->cmd = command->cmd_args[0];
+    command->controls = controls;
+    return command;
+}
+
+/*  Reads one argument per line from FD into an array allocated from ARENA,
+    skipping empty lines. Stores the number of arguments in *NUM_ARGS and
+    returns the array, or NULL after printing an error.
+ */
+static char **read_args(struct arena *arena, int fd, int *num_args)
+{
+    struct reader reader;
+    if (reader_open_fd(&reader, fd) == -1)
+        return NULL;
+
+    int size = 64;
+    char **args = arena_alloc(arena, size * sizeof(char *));
+    *num_args = 0;
+
+    const char *line;
+    size_t len;
+    while ((line = reader_getline(&reader, &len)) != NULL)
+    {
+        if (len == 0)
+            continue;
+        if (*num_args == size)
+        {
+            char **new_args = arena_alloc(arena, size * 2 * sizeof(char *));
+            memcpy(new_args, args, size * sizeof(char *));
+            args = new_args;
+            size *= 2;
+        }
+        char *arg = arena_alloc(arena, len + 1);
+        memcpy(arg, line, len);
+        arg[len] = '\0';
+        args[(*num_args)++] = arg;
+    }
+
+    reader_close(&reader);
+    return args;
+}
+
+/*  Copies everything written to the memory file FROM to the descriptor TO,
+    using sendfile() so the data is not copied through the shell. Falls back
+    to read() and write() where sendfile() refuses TO (e.g. O_APPEND files).
+ */
+static void copy_output(int from, int to)
+{
+    off_t size = lseek(from, 0, SEEK_END);
+    off_t offset = 0;
+    while (offset < size)
+    {
+        ssize_t n = sendfile(to, from, &offset, (size_t)(size - offset));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && offset == 0 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if (n <= 0)
+        {
+            perror("parallel: sendfile()");
+            fflush(stderr);
+            return;
+        }
+    }
+
+    char buf[16384];
+    while (offset < size)
+    {
+        ssize_t n = pread(from, buf, sizeof(buf), offset);
+        if (n <= 0)
+            break;
+        for (ssize_t written = 0; written < n; )
+        {
+            ssize_t w = write(to, buf + written, (size_t)(n - written));
+            if (w == -1 && errno == EINTR)
+                continue;
+            if (w == -1)
+            {
+                perror("parallel: write()");
+                fflush(stderr);
+                return;
+            }
+            written += w;
+        }
+        offset += n;
+    }
+}
+
+/*  Launches COMMAND for TASK, writing its stdout to a new memory file if
+    ORDERED is set, or else to OUT_FD (-1 for the shell's stdout). Stdin is
+    IN_FD. Returns 0 on success, or -1 if the command could not be launched,
+    in which case the task is finished with exit value 1.
+ */
+static int start_task(struct task *task, struct user_input *command,
+                      int in_fd, int out_fd, int ordered)
+{
+    task->out_fd = -1;
+    if (ordered)
+    {
+        task->out_fd = memfd_create("parallel", MFD_CLOEXEC);
+        if (task->out_fd == -1)
+        {
+            perror("parallel: memfd_create()");
+            fflush(stderr);
+        }
+        else
+            out_fd = task->out_fd;
+    }
+
+    pid_t pid = spawn_process(command, in_fd, out_fd, 0, -1);
+    if (pid == -1)
+    {
+        task->status = EXIT_FAILURE << 8;
+        task->done = 1;
+        return -1;
+    }
+
+    // Tracked as a foreground job, so the event loop can tell the task
+    // apart from background jobs finishing meanwhile
+    task->job = job_add(&pid, 1, 0, command->cmd, 0);
+
+    if (DEBUGPARALLEL)
+        printf("parallel: started %s as %d\n", command->cmd, pid);
+    return 0;
+}
+
+/*  Runs the parallel built-in described by USER_INPUT:
+
+        parallel [-j N] [-k] command [arg ...] [::: arg ...]
+
+    Runs the command once for each argument after ":::", or for each line of
+    stdin (or of the input file) if there is no ":::". Every "{}" in the
+    command is replaced by the argument; if there is none, the argument is
+    appended. At most N commands (by default, one per online CPU) run at once:
+    a new one is launched as soon as one finishes, so exactly N are running
+    until the queue is empty.
+
+    Output of the commands is interleaved as it is written, unless -k is
+    given, in which case the stdout of each command is collected in a memory
+    file and printed in argument order.
+
+    Memory is allocated from ARENA. Returns the exit value: the number of
+    commands that failed (at most PARALLEL_MAX_FAILED), or
+    PARALLEL_USAGE_ERROR.
+ */
+int parallel_run(struct arena *arena, struct user_input *user_input)
+{
+    char **words = user_input->cmd_args;
+    int num_words = user_input->num_cmd_args;
+
+    // Options
+    long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+    int ordered = 0;
+    int w = 1;
+    for (; w < num_words && words[w][0] == '-'; w++)
+    {
+        if (strcmp(words[w], "-k") == 0)
+            ordered = 1;
+        else if (strncmp(words[w], "-j", 2) == 0)
+        {
+            const char *value = words[w][2] ? words[w] + 2 : (w + 1 < num_words ? words[++w] : "");
+            char *end;
+            long n = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || n < 0)
+            {
+                fprintf(stderr, "parallel: invalid number of jobs '%s'\n", value);
+                fflush(stderr);
+                return PARALLEL_USAGE_ERROR;
+            }
+            if (n > 0)
+                max_running = n;
+        }
+        else if (strcmp(words[w], "--") == 0)
+        {
+            w++;
+            break;
+        }
+        else
+            break;
+    }
+    if (max_running < 1)
+        max_running = 1;
+
+    // Command template, up to ":::"
+    char **template = &words[w];
+    int num_template = 0;
+    while (w + num_template < num_words && strcmp(template[num_template], ARGS_SYM) != 0)
+        num_template++;
+    if (num_template == 0)
+    {
+        fprintf(stderr, "usage: parallel [-j N] [-k] command [arg ...] [::: arg ...]\n");
+        fflush(stderr);
+        return PARALLEL_USAGE_ERROR;
+    }
+
+    // Commands never read the terminal or the shell's script
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (null_fd == -1)
+    {
+        perror("parallel: open()");
+        fflush(stderr);
+        return PARALLEL_USAGE_ERROR;
+    }
+
+    // Arguments, after ":::" or one per line of the input
+    char **args;
+    int num_args;
+    if (w + num_template < num_words)
+    {
+        args = &template[num_template + 1];
+        num_args = num_words - (w + num_template + 1);
+    }
+    else
+    {
+        int in_fd = STDIN_FILENO;
+        if (user_input->here_data)
+        {
+            in_fd = spawn_open_here(user_input->here_data, user_input->here_len);
+            if (in_fd == -1)
+            {
+                close(null_fd);
+                return PARALLEL_USAGE_ERROR;
+            }
+        }
+        else if (user_input->input_file)
+        {
+            in_fd = open(user_input->input_file, O_RDONLY | O_CLOEXEC);
+            if (in_fd == -1)
+            {
+                fprintf(stderr, "error redirecting input to %s: open(): ", user_input->input_file);
+                perror("");
+                fflush(stderr);
+                close(null_fd);
+                return PARALLEL_USAGE_ERROR;
+            }
+        }
+        args = read_args(arena, in_fd, &num_args);
+        if (in_fd != STDIN_FILENO)
+            close(in_fd);
+        if (args == NULL)
+        {
+            close(null_fd);
+            return PARALLEL_USAGE_ERROR;
+        }
+    }
+
+    // Output of every command goes to the output file, if one is given
+    int out_fd = -1;
+    if (user_input->output_file)
+    {
+        out_fd = open(user_input->output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd == -1)
+        {
+            fprintf(stderr, "error redirecting output to %s: open(): ", user_input->output_file);
+            perror("");
+            fflush(stderr);
+            close(null_fd);
+            return PARALLEL_USAGE_ERROR;
+        }
+    }
+    fflush(stdout);
+
+    struct task *tasks = arena_calloc(arena, (num_args + 1) * sizeof(struct task));
+    int next_start = 0;     // Next task to launch
+    int next_print = 0;     // Next task whose output is printed (ordered mode)
+    int num_running = 0;
+    int num_failed = 0;
+
+    while (next_start < num_args || num_running > 0)
+    {
+        // Fill every free slot
+        while (next_start < num_args && num_running < max_running)
+        {
+            struct task *task = &tasks[next_start];
+            struct user_input *command = make_command(arena, template, num_template, args[next_start],
+                                                       user_input->controls);
+            next_start++;
+            if (start_task(task, command, null_fd, out_fd, ordered) == 0)
+                num_running++;
+            else if (task->out_fd != -1)
+            {
+                close(task->out_fd);
+                task->out_fd = -1;
+            }
+        }
+
+        // Wait for the next command to finish. Children of background jobs
+        // reaped meanwhile are deferred, as in the foreground wait.
+        while (num_running > 0)
+        {
+            pid_t pid;
+            int status;
+            struct rusage usage;
+            if (ev_reap(&pid, &status, &usage, 1) != 1)
+            {
+                num_running = 0;
+                break;
+            }
+
+            struct job *owner = job_find_pid(pid);
+            if (owner == NULL)
+                continue;
+            job_update(owner, pid, status, &usage);
+            if (owner->id != 0)
+            {
+                ev_defer(pid, status);
+                continue;
+            }
+            // A stopped task is continued, as it would otherwise never
+            // finish and the wait would never end
+            if (owner->state == JOB_STOPPED)
+                kill(pid, SIGCONT);
+            if (owner->state != JOB_DONE)
+                continue;
+
+            // Only the tasks started since the first unfinished one can be
+            // running, so the search starts there
+            for (int i = next_print; i < next_start; i++)
+            {
+                if (tasks[i].job == owner)
+                {
+                    tasks[i].status = owner->procs[0].status;
+                    tasks[i].done = 1;
+                    tasks[i].job = NULL;
+                    break;
+                }
+            }
+            job_remove(owner);
+            num_running--;
+            break;
+        }
+
+        // Count finished tasks in order, printing their output if collected
+        while (next_print < next_start && tasks[next_print].done)
+        {
+            struct task *task = &tasks[next_print++];
+            if (task->status != 0)
+                num_failed++;
+            if (task->out_fd != -1)
+            {
+                copy_output(task->out_fd, out_fd != -1 ? out_fd : STDOUT_FILENO);
+                close(task->out_fd);
+            }
+        }
+    }
+
+    // Tasks lost to a failed wait count as failed
+    num_failed += next_start - next_print;
+    for (; next_print < next_start; next_print++)
+    {
+        if (tasks[next_print].job)
+            job_remove(tasks[next_print].job);
+        if (tasks[next_print].out_fd != -1)
+            close(tasks[next_print].out_fd);
+    }
+
+    close(null_fd);
+    if (out_fd != -1)
+        close(out_fd);
+
+    return num_failed > PARALLEL_MAX_FAILED ? PARALLEL_MAX_FAILED : num_failed;
+}
@@ -0,0 +1,15 @@
+#ifndef SMALLSH_PARALLEL_H
+#define SMALLSH_PARALLEL_H
+
+#include "smallsh.h"
+#include "smallsh_arena.h"
+
+// Exit value of parallel when its arguments cannot be used
+#define PARALLEL_USAGE_ERROR 255
+
+// Largest exit value reporting a number of failed tasks
+#define PARALLEL_MAX_FAILED 101
+
+int parallel_run(struct arena *arena, struct user_input *user_input);
+
+#endif
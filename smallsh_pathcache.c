@@ -0,0 +1,366 @@
+#define _DEFAULT_SOURCE
+// strdup, confstr, MAP_ANONYMOUS
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "smallsh_pathcache.h"
+
+#define DEBUGPATHCACHE 0
+
+// Initial number of slots in the table. Always a power of two.
+#define PATHCACHE_INIT_SLOTS 64
+
+// A resolved command name
+struct pathcache_entry
+{
+    char *name;         // Command name as typed, NULL if the slot is empty
+    char *path;         // Absolute path the name resolved to
+    unsigned long hits; // Number of lookups answered by this entry
+};
+
+// Open-addressed (linear probing) table of resolved command names
+static struct pathcache_entry *table = NULL;
+static size_t table_slots = 0;
+static size_t table_used = 0;
+
+// Copy of $PATH the table was filled with
+static char *cached_path_var = NULL;
+
+// Lookups answered from the table, and lookups that had to walk $PATH
+static unsigned long total_hits = 0, total_misses = 0;
+
+// A remembered path that failed to execute in a child of the fork or zygote
+// engine, which cannot change this table. Children write it to a page shared
+// with the shell, which forgets the name at its next lookup. One report is
+// held at a time; a lost one is made again the next time the path fails.
+struct stale_report
+{
+    atomic_int state;   // STALE_NONE, STALE_WRITING or STALE_READY
+    char name[256];
+};
+
+enum { STALE_NONE, STALE_WRITING, STALE_READY };
+
+static struct stale_report *stale = NULL;
+
+/*  Returns the FNV-1a hash of the string STR.
+ */
+static size_t hash_str(const char *str)
+{
+    size_t hash = 2166136261u;
+    while (*str)
+    {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*  Returns the slot holding NAME, or the empty slot where it would be
+    inserted. The table must have at least one empty slot.
+ */
+static size_t find_slot(const char *name)
+{
+    size_t mask = table_slots - 1;
+    size_t i = hash_str(name) & mask;
+    while (table[i].name && strcmp(table[i].name, name) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/*  Returns the current search path. An unset PATH falls back to the system
+    default, as execvp does.
+ */
+static const char *get_path_var(void)
+{
+    static char default_path[256] = {'\0'};
+
+    char *path_var = getenv("PATH");
+    if (path_var)
+        return path_var;
+    if (default_path[0] == '\0')
+        confstr(_CS_PATH, default_path, sizeof(default_path));
+    return default_path;
+}
+
+/*  Empties the table if PATH has changed since it was filled.
+ */
+static void check_path_var(void)
+{
+    const char *path_var = get_path_var();
+    if (cached_path_var && strcmp(cached_path_var, path_var) == 0)
+        return;
+
+    if (DEBUGPATHCACHE)
+        printf("pathcache: PATH changed, clearing table\n");
+
+    pathcache_clear();
+    free(cached_path_var);
+    cached_path_var = strdup(path_var);
+}
+
+/*  Doubles the number of slots in the table (or allocates it), rehashing all
+    entries.
+ */
+static void grow_table(void)
+{
+    struct pathcache_entry *old_table = table;
+    size_t old_slots = table_slots;
+
+    table_slots = old_slots ? old_slots * 2 : PATHCACHE_INIT_SLOTS;
+    table = calloc(table_slots, sizeof(struct pathcache_entry));
+    if (table == NULL)
+    {
+        perror("pathcache: calloc()");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < old_slots; i++)
+    {
+        if (old_table[i].name)
+            table[find_slot(old_table[i].name)] = old_table[i];
+    }
+    free(old_table);
+}
+
+/*  Searches each directory in PATH for an executable regular file named CMD.
+    Returns a newly allocated path, or NULL if there is none. Sets *RELATIVE
+    to non-zero if the match came from a relative PATH entry, which must not
+    be cached since it changes meaning with the working directory.
+ */
+static char *search_path(const char *cmd, int *relative)
+{
+    const char *dir = get_path_var();
+    size_t cmd_len = strlen(cmd);
+
+    while (1)
+    {
+        const char *dir_end = strchr(dir, ':');
+        size_t dir_len = dir_end ? (size_t)(dir_end - dir) : strlen(dir);
+
+        // An empty PATH entry is the current directory
+        char *candidate = malloc(dir_len + cmd_len + 3);
+        if (dir_len == 0)
+            sprintf(candidate, "./%s", cmd);
+        else
+            sprintf(candidate, "%.*s/%s", (int)dir_len, dir, cmd);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(candidate, X_OK) == 0)
+        {
+            *relative = (dir_len == 0 || dir[0] != '/');
+            return candidate;
+        }
+        free(candidate);
+
+        if (dir_end == NULL)
+            return NULL;
+        dir = dir_end + 1;
+    }
+}
+
+/*  Sets up the page children report stale paths to. Must be called before
+    the zygote is started, so that it and its children share the page. If it
+    cannot be mapped, stale paths are only found by the posix_spawn engine.
+ */
+void pathcache_init(void)
+{
+    void *page = mmap(NULL, sizeof(struct stale_report), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+    {
+        perror("pathcache: mmap()");
+        fflush(stderr);
+        return;
+    }
+    stale = page;
+    atomic_init(&stale->state, STALE_NONE);
+}
+
+/*  Called in a child, after fork, when executing the path CMD_PATH that
+    the command name CMD resolved to failed with errno set. Reports CMD if
+    the path is gone or no longer executable and was remembered. Only writes
+    to the shared page, so it is safe after fork.
+ */
+void pathcache_report_stale(const char *cmd, const char *cmd_path)
+{
+    size_t len = strlen(cmd);
+    int expected = STALE_NONE;
+    if ((errno != ENOENT && errno != ENOTDIR && errno != EACCES) ||
+        stale == NULL || strchr(cmd, '/') || strcmp(cmd, cmd_path) == 0 ||
+        len >= sizeof(stale->name) ||
+        !atomic_compare_exchange_strong(&stale->state, &expected, STALE_WRITING))
+        return;
+    memcpy(stale->name, cmd, len + 1);
+    atomic_store(&stale->state, STALE_READY);
+}
+
+/*  Forgets the command reported stale by a child, if any, and resolves it
+    again, so that its new path is remembered.
+ */
+static void check_stale(void)
+{
+    if (stale == NULL || atomic_load(&stale->state) != STALE_READY)
+        return;
+    char name[sizeof(stale->name)];
+    memcpy(name, stale->name, sizeof(name));
+    atomic_store(&stale->state, STALE_NONE);
+    if (DEBUGPATHCACHE)
+        printf("pathcache: %s reported stale\n", name);
+    pathcache_forget(name);
+    pathcache_lookup(name);
+}
+
+/*  Returns the path to execute for the command name CMD, or NULL if CMD is
+    not found in PATH. Names containing a '/' are returned unchanged.
+    Names found in an absolute PATH directory are remembered, so later lookups
+    skip the PATH walk until PATH changes or the entry is forgotten.
+    The returned string is only valid until the next call.
+ */
+const char *pathcache_lookup(const char *cmd)
+{
+    static char *uncached = NULL;
+
+    if (strchr(cmd, '/'))
+        return cmd;
+
+    check_stale();
+    check_path_var();
+    if (table_slots)
+    {
+        size_t i = find_slot(cmd);
+        if (table[i].name)
+        {
+            table[i].hits++;
+            total_hits++;
+            return table[i].path;
+        }
+    }
+
+    total_misses++;
+    int relative = 0;
+    char *path = search_path(cmd, &relative);
+    if (path == NULL)
+        return NULL;
+
+    if (relative)
+    {
+        free(uncached);
+        uncached = path;
+        return path;
+    }
+
+    // Keep the load factor at or below 1/2
+    if ((table_used + 1) * 2 > table_slots)
+        grow_table();
+
+    size_t i = find_slot(cmd);
+    table[i].name = strdup(cmd);
+    table[i].path = path;
+    table[i].hits = 1;
+    table_used++;
+
+    if (DEBUGPATHCACHE)
+        printf("pathcache: %s -> %s\n", cmd, path);
+
+    return path;
+}
+
+/*  Removes CMD from the table, if present. Used when a remembered path no
+    longer executes, so the next lookup walks PATH again.
+ */
+void pathcache_forget(const char *cmd)
+{
+    if (table_slots == 0)
+        return;
+
+    size_t mask = table_slots - 1;
+    size_t i = find_slot(cmd);
+    if (table[i].name == NULL)
+        return;
+
+    free(table[i].name);
+    free(table[i].path);
+    table[i].name = NULL;
+    table_used--;
+
+    // Shift back any following entries that probed past the freed slot
+    size_t j = i;
+    while (1)
+    {
+        j = (j + 1) & mask;
+        if (table[j].name == NULL)
+            break;
+        size_t home = hash_str(table[j].name) & mask;
+        // Move entry j to i unless its home slot lies cyclically in (i, j]
+        int in_range = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!in_range)
+        {
+            table[i] = table[j];
+            table[j].name = NULL;
+            i = j;
+        }
+    }
+}
+
+/*  Forgets every remembered command and resets the hit/miss counts.
+ */
+void pathcache_clear(void)
+{
+    for (size_t i = 0; i < table_slots; i++)
+    {
+        if (table[i].name)
+        {
+            free(table[i].name);
+            free(table[i].path);
+            table[i].name = NULL;
+        }
+    }
+    table_used = 0;
+    total_hits = 0;
+    total_misses = 0;
+}
+
+/*  Resolves CMD and remembers it, as "hash CMD" does. Returns 0 on success, or
+    -1 if CMD is not found or cannot be remembered.
+ */
+int pathcache_add(const char *cmd)
+{
+    if (strchr(cmd, '/') || pathcache_lookup(cmd) == NULL)
+        return -1;
+    return 0;
+}
+
+/*  Prints every remembered command with its hit count and path.
+ */
+void pathcache_print(void)
+{
+    check_stale();
+    if (table_used == 0)
+    {
+        printf("hash: hash table empty\n");
+        return;
+    }
+
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < table_slots; i++)
+    {
+        if (table[i].name)
+            printf("%4lu\t%s\n", table[i].hits, table[i].path);
+    }
+}
+
+/*  Prints the total number of lookups answered from the table and the number
+    that had to search PATH.
+ */
+void pathcache_print_counts(void)
+{
+    printf("hash: %lu hits, %lu misses, %zu entries\n",
+           total_hits, total_misses, table_used);
+}
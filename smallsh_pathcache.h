@@ -0,0 +1,13 @@
+#ifndef SMALLSH_PATHCACHE_H
+#define SMALLSH_PATHCACHE_H
+
+void pathcache_init(void);
+void pathcache_report_stale(const char *cmd, const char *cmd_path);
+const char *pathcache_lookup(const char *cmd);
+void pathcache_forget(const char *cmd);
+void pathcache_clear(void);
+int pathcache_add(const char *cmd);
+void pathcache_print(void);
+void pathcache_print_counts(void);
+
+#endif
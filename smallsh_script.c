@@ -0,0 +1,308 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "smallsh_script.h"
+#include "smallsh_cache.h"
+
+#define DEBUGSCRIPT 0
+
+// A compiled script is stored in the cache (see smallsh_cache.c) under the
+// hash of the script's contents: a header, then a line record for each command line, the tokens of all the
+// lines, and their text. Everything is referred to by offset, so the file
+// is used as it is mapped.
+#define SCRIPT_MAGIC 0x31504353534d53ull    // "SMSCP1"
+
+struct script_header
+{
+    uint64_t magic;
+    uint64_t script_len;        // Bytes of the script
+    uint64_t hash[2];           // Of the script's contents
+    uint32_t num_lines;
+    uint32_t num_tokens;
+    uint64_t text_size;
+};
+
+// A command line of the script. Blank lines and comments have none.
+struct script_line
+{
+    uint64_t offset;            // Of the line in the script
+    uint32_t len;
+    uint32_t first_token;
+    uint32_t num_tokens;
+    uint32_t pad;
+};
+
+// A word of a line, split but not expanded (see lex_split())
+struct script_token
+{
+    uint32_t text;              // Offset of its null-terminated text
+    uint32_t len;
+    uint16_t type;
+    uint16_t flags;
+};
+
+_Static_assert(sizeof(struct script_header) == 48, "script header size");
+_Static_assert(sizeof(struct script_line) == 24, "script line size");
+_Static_assert(sizeof(struct script_token) == 12, "script token size");
+
+// The compiled script in use: mapped, or built in memory if it could not be
+// stored. NULL if there is none.
+static char *image = NULL;
+static const struct script_line *lines = NULL;
+static const struct script_token *words = NULL;
+static char *text = NULL;
+static uint32_t num_lines = 0;
+
+// Next line record to match. Lines are read in order, so the records are
+// searched from here; the lines of here-doc bodies are skipped over.
+static uint32_t next_line = 0;
+
+/*  Stores in HASH a 128-bit hash of the LEN bytes at DATA, from two
+    multiply-rotate lanes over 8 bytes at a time.
+ */
+static void hash_script(const char *data, size_t len, uint64_t hash[2])
+{
+    uint64_t a = 0x9e3779b97f4a7c15ull ^ len;
+    uint64_t b = 0xc2b2ae3d27d4eb4full + len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        a = (a ^ word) * 0x100000001b3ull;
+        a = (a << 29) | (a >> 35);
+        b = (b + word) * 0xff51afd7ed558ccdull;
+        b = (b << 31) | (b >> 33);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, len - i);
+    a = (a ^ tail) * 0x100000001b3ull;
+    b = (b + tail) * 0xff51afd7ed558ccdull;
+
+    // Mix each lane's high bits into its low bits
+    for (int lane = 0; lane < 2; lane++)
+    {
+        uint64_t h = lane ? b ^ a : a;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        hash[lane] = h;
+    }
+}
+
+/*  Appends the SIZE bytes at DATA to the buffer *BUF of *LEN bytes, which
+    holds *CAP. Returns 0, or -1 if out of memory.
+ */
+static int append(char **buf, size_t *len, size_t *cap, const void *data, size_t size)
+{
+    if (*len + size > *cap)
+    {
+        size_t new_cap = *cap ? *cap : 4096;
+        while (new_cap < *len + size)
+            new_cap *= 2;
+        char *new_buf = realloc(*buf, new_cap);
+        if (new_buf == NULL)
+            return -1;
+        *buf = new_buf;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, size);
+    *len += size;
+    return 0;
+}
+
+/*  Compiles the LEN bytes of the script at DATA, whose hash is HASH: splits
+    each command line into tokens, as the main loop would read it. Returns
+    the compiled image, allocated with malloc(), and stores its size in
+    *SIZE, or NULL if out of memory.
+ */
+static char *compile_script(const char *data, size_t len, const uint64_t hash[2], size_t *size)
+{
+    char *line_buf = NULL, *token_buf = NULL, *text_buf = NULL;
+    size_t line_len = 0, line_cap = 0, token_len = 0, token_cap = 0, text_len = 0, text_cap = 0;
+    struct script_header header = {SCRIPT_MAGIC, len, {hash[0], hash[1]}, 0, 0, 0};
+    struct arena arena;
+    arena_init(&arena, 16384);
+
+    int failed = 0;
+    size_t start = 0;
+    while (start < len && !failed)
+    {
+        const char *newline = memchr(data + start, '\n', len - start);
+        size_t end = newline ? (size_t)(newline - data) : len;
+        if (end > start && data[start] != '#')
+        {
+            arena_reset(&arena);
+            struct token *tokens;
+            int num = lex_split(&arena, data + start, end - start, &tokens);
+            struct script_line record = {start, (uint32_t)(end - start), header.num_tokens,
+                                         (uint32_t)num, 0};
+            failed |= append(&line_buf, &line_len, &line_cap, &record, sizeof(record));
+            for (int i = 0; i < num && !failed; i++)
+            {
+                struct script_token token = {(uint32_t)text_len, (uint32_t)tokens[i].len,
+                                             (uint16_t)tokens[i].type, (uint16_t)tokens[i].flags};
+                failed |= append(&token_buf, &token_len, &token_cap, &token, sizeof(token));
+                failed |= append(&text_buf, &text_len, &text_cap, tokens[i].text, tokens[i].len + 1);
+            }
+            header.num_lines++;
+            header.num_tokens += (uint32_t)num;
+        }
+        start = end + 1;
+    }
+    arena_destroy(&arena);
+    header.text_size = text_len;
+
+    char *compiled = NULL;
+    size_t compiled_len = 0, compiled_cap = 0;
+    if (!failed)
+    {
+        failed |= append(&compiled, &compiled_len, &compiled_cap, &header, sizeof(header));
+        failed |= append(&compiled, &compiled_len, &compiled_cap, line_buf, line_len);
+        failed |= append(&compiled, &compiled_len, &compiled_cap, token_buf, token_len);
+        failed |= append(&compiled, &compiled_len, &compiled_cap, text_buf, text_len);
+    }
+    free(line_buf);
+    free(token_buf);
+    free(text_buf);
+    if (failed)
+    {
+        free(compiled);
+        return NULL;
+    }
+    *size = compiled_len;
+    return compiled;
+}
+
+/*  Returns 1 if the SIZE bytes at COMPILED are a compiled script of LEN
+    bytes with hash HASH, or else 0. Every line record and token is checked
+    to lie within the image, so that a corrupt or foreign file is never read
+    out of bounds when its lines are used.
+ */
+static int check_image(const char *compiled, size_t size, size_t len, const uint64_t hash[2])
+{
+    const struct script_header *header = (const struct script_header *)compiled;
+    if (size < sizeof(struct script_header) ||
+        header->magic != SCRIPT_MAGIC ||
+        header->script_len != len || header->hash[0] != hash[0] || header->hash[1] != hash[1] ||
+        size != sizeof(struct script_header) +
+                (uint64_t)header->num_lines * sizeof(struct script_line) +
+                (uint64_t)header->num_tokens * sizeof(struct script_token) +
+                header->text_size)
+        return 0;
+
+    const struct script_line *line = (const struct script_line *)(header + 1);
+    for (uint32_t i = 0; i < header->num_lines; i++, line++)
+    {
+        if (line->offset > len || line->len > len - line->offset ||
+            line->first_token > header->num_tokens ||
+            line->num_tokens > header->num_tokens - line->first_token)
+            return 0;
+    }
+
+    // Each token's text ends with a null byte inside the text section
+    const struct script_token *token = (const struct script_token *)line;
+    const char *text_start = (const char *)(token + header->num_tokens);
+    for (uint32_t i = 0; i < header->num_tokens; i++, token++)
+    {
+        if ((uint64_t)token->text + token->len >= header->text_size ||
+            text_start[token->text + token->len] != '\0')
+            return 0;
+    }
+    return 1;
+}
+
+/*  Loads the compiled form of the script mapped by READER, compiling and
+    storing it in the cache if this script has not been run before, so that
+    its lines are not split again on every run. Scripts are identified by a
+    hash of their contents, and their compiled forms are evicted with the
+    cached outputs. Only done if SMALLSH_SCRIPT_CACHE is set to 1. Returns
+    0, or -1 if lines are to be read as usual.
+ */
+int script_load(const struct reader *reader)
+{
+    const char *setting = getenv("SMALLSH_SCRIPT_CACHE");
+    if (reader->map == NULL || reader->map_len > UINT32_MAX ||
+        setting == NULL || strcmp(setting, "1") != 0)
+        return -1;
+
+    uint64_t hash[2];
+    hash_script(reader->map, reader->map_len, hash);
+    unsigned char key[16];
+    memcpy(key, hash, sizeof(key));
+
+    // A stored one is mapped read-only: tokens are used in place
+    size_t size = 0;
+    int fd = cache_lookup(key);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        size = (size_t)st.st_size;
+        image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image == MAP_FAILED)
+            image = NULL;
+        else if (!check_image(image, size, reader->map_len, hash))
+        {
+            munmap(image, size);
+            image = NULL;
+        }
+    }
+    if (fd != -1)
+        close(fd);
+
+    if (image == NULL)
+    {
+        image = compile_script(reader->map, reader->map_len, hash, &size);
+        if (image == NULL)
+            return -1;
+        cache_store(key, image, size);
+        if (DEBUGSCRIPT)
+            printf("script: compiled %zu bytes\n", size);
+    }
+
+    const struct script_header *header = (const struct script_header *)image;
+    lines = (const struct script_line *)(header + 1);
+    words = (const struct script_token *)(lines + header->num_lines);
+    text = (char *)(words + header->num_tokens);
+    num_lines = header->num_lines;
+    next_line = 0;
+    return 0;
+}
+
+/*  Returns the tokens of the LEN bytes of LINE, read by READER from the
+    loaded script, as lex_line() would: the stored tokens are used in place,
+    and only the words with a '$' are expanded. Stores the token array,
+    allocated from ARENA, in *TOKENS and returns the number of tokens, or
+    -1 if the line was not compiled and must be split by lex_line().
+ */
+int script_tokens(struct arena *arena, const struct reader *reader,
+                  const char *line, size_t len, struct token **tokens)
+{
+    if (image == NULL || reader->map == NULL || line < reader->map ||
+        line > reader->map + reader->map_len)
+        return -1;
+
+    uint64_t offset = (uint64_t)(line - reader->map);
+    while (next_line < num_lines && lines[next_line].offset < offset)
+        next_line++;
+    if (next_line == num_lines || lines[next_line].offset != offset || lines[next_line].len != len)
+        return -1;
+
+    const struct script_line *record = &lines[next_line++];
+    struct token *out = arena_alloc(arena, (record->num_tokens + 1) * sizeof(struct token));
+    const struct script_token *token = &words[record->first_token];
+    for (uint32_t i = 0; i < record->num_tokens; i++, token++)
+    {
+        out[i].type = (enum token_type)token->type;
+        out[i].flags = token->flags;
+        out[i].text = text + token->text;
+        out[i].len = token->len;
+    }
+    *tokens = out;
+    return lex_expand_tokens(arena, out, (int)record->num_tokens);
+}
@@ -0,0 +1,13 @@
+#ifndef SMALLSH_SCRIPT_H
+#define SMALLSH_SCRIPT_H
+
+#include <stddef.h>
+#include "smallsh_arena.h"
+#include "smallsh_input.h"
+#include "smallsh_lex.h"
+
+int script_load(const struct reader *reader);
+int script_tokens(struct arena *arena, const struct reader *reader,
+                  const char *line, size_t len, struct token **tokens);
+
+#endif
@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+// SCM_RIGHTS, signalfd, accept4, memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "smallsh_serve.h"
+
+#define DEBUGSERVE 0
+
+// Largest packet in either direction: a request holds every command line
+// sent at once
+#define SERVE_MSG_MAX 65536
+
+// A worker: the shell forked to run one request, and its client connection
+struct serve_worker
+{
+    pid_t pid;
+    int conn;
+};
+
+// In a worker, the connection to its client, or -1
+static int serve_conn = -1;
+
+// In a worker, memory files capturing stdout and stderr when the client
+// passed no fd for them, or -1
+static int capture_fds[2] = {-1, -1};
+
+/*  Sends the packet of LEN bytes at BUF on SOCK. Returns 0 on success, or -1
+    if the client has gone away.
+ */
+static int send_packet(int sock, const char *buf, size_t len)
+{
+    ssize_t sent;
+    while ((sent = send(sock, buf, len, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        ;
+    return sent == -1 ? -1 : 0;
+}
+
+/*  Sends the exit value VALUE to the client on SOCK.
+ */
+static void send_status(int sock, int value)
+{
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%c%d", SERVE_STATUS, value);
+    send_packet(sock, buf, (size_t)len);
+}
+
+/*  Sends everything written to the memory file FD to the client on SOCK, in
+    packets tagged TAG.
+ */
+static void send_output(int sock, int fd, char tag)
+{
+    static char buf[SERVE_MSG_MAX];
+    buf[0] = tag;
+    off_t offset = 0;
+    ssize_t n;
+    while ((n = pread(fd, buf + 1, sizeof(buf) - 1, offset)) > 0)
+    {
+        if (send_packet(sock, buf, (size_t)n + 1) == -1)
+            break;
+        offset += n;
+    }
+}
+
+/*  Returns a memory file for capturing the output of a worker, or -1 after
+    printing an error.
+ */
+static int capture_output(const char *name)
+{
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd == -1)
+        perror("serve: memfd_create()");
+    return fd;
+}
+
+/*  Runs in a worker: receives the request on CONN and sets up READER to
+    read its command lines. The fds passed with it become stdin, stdout and
+    stderr: none, and both outputs are captured and sent back as packets;
+    one, for stdout and stderr; two, for stdout and stderr; or three, for
+    stdout, stderr and stdin. stdin is /dev/null unless passed.
+ */
+static void serve_worker(int conn, struct reader *reader)
+{
+    serve_conn = conn;
+
+    char *buf = malloc(SERVE_MSG_MAX);
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    if (buf == NULL)
+    {
+        perror("serve: malloc()");
+        _exit(EXIT_FAILURE);
+    }
+    struct iovec iov = {buf, SERVE_MSG_MAX};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    if (n <= 0)
+        _exit(EXIT_FAILURE);
+
+    int fds[3] = {-1, -1, -1};
+    int num_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            num_fds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+        }
+    }
+
+    int out_fd = fds[0];
+    int err_fd = num_fds == 1 ? fds[0] : fds[1];
+    int in_fd = fds[2];
+    if (out_fd == -1)
+        out_fd = capture_fds[0] = capture_output("serve-stdout");
+    if (err_fd == -1)
+        err_fd = capture_fds[1] = capture_output("serve-stderr");
+    if (in_fd == -1)
+        in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if ((in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1) ||
+        (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1) ||
+        (err_fd != -1 && dup2(err_fd, STDERR_FILENO) == -1))
+    {
+        perror("serve: dup2()");
+        _exit(EXIT_FAILURE);
+    }
+    if (fds[2] == -1 && in_fd != -1)
+        close(in_fd);
+    for (int i = 0; i < num_fds; i++)
+    {
+        if (fds[i] > STDERR_FILENO)
+            close(fds[i]);
+    }
+
+    reader_open_buffer(reader, buf, (size_t)n);
+
+    if (DEBUGSERVE)
+        fprintf(stderr, "serve: worker %d: %zd bytes, %d fds\n", getpid(), n, num_fds);
+}
+
+/*  Called by a worker as it exits: sends the output it captured to its
+    client. The exit value is sent by the server once it has reaped the
+    worker, so a client is answered even if its worker is killed.
+ */
+void serve_finish(void)
+{
+    if (serve_conn == -1)
+        return;
+    fflush(stdout);
+    fflush(stderr);
+    if (capture_fds[0] != -1)
+        send_output(serve_conn, capture_fds[0], SERVE_STDOUT);
+    if (capture_fds[1] != -1)
+        send_output(serve_conn, capture_fds[1], SERVE_STDERR);
+    close(serve_conn);
+    serve_conn = -1;
+}
+
+/*  Serves command lines sent by local clients over a Unix domain socket
+    bound to PATH. Each connection carries one request, a packet holding one
+    or more command lines, which is run by a worker: the shell, forked
+    before any other setup, reading the lines as a script. At most
+    MAX_WORKERS requests run at once; further connections wait in the
+    listen queue. The server exits on SIGINT, SIGTERM or SIGHUP, leaving
+    running workers to finish.
+
+    Returns 0 in each worker, with SCRIPT set up to read its command lines,
+    or -1 after printing an error. Never returns in the server.
+ */
+int serve_run(const char *path, int max_workers, struct reader *script)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "serve: %s: path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+    {
+        perror("serve: socket()");
+        return -1;
+    }
+    // A socket left by a previous server would make bind() fail
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1)
+    {
+        fprintf(stderr, "serve: %s: ", path);
+        perror("");
+        close(listen_fd);
+        return -1;
+    }
+
+    // Workers and termination requests are waited for with a signalfd
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    struct serve_worker *workers = calloc(max_workers, sizeof(struct serve_worker));
+    if (signal_fd == -1 || workers == NULL)
+    {
+        perror("serve: signalfd()");
+        return -1;
+    }
+    int num_workers = 0;
+
+    while (1)
+    {
+        // The listening socket is not polled while at the cap
+        struct pollfd fds[2] = {{signal_fd, POLLIN, 0}, {listen_fd, POLLIN, 0}};
+        if (poll(fds, num_workers < max_workers ? 2 : 1, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("serve: poll()");
+            exit(EXIT_FAILURE);
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            struct signalfd_siginfo info[16];
+            ssize_t n;
+            while ((n = read(signal_fd, info, sizeof(info))) > 0)
+            {
+                for (size_t i = 0; i < (size_t)n / sizeof(struct signalfd_siginfo); i++)
+                {
+                    if (info[i].ssi_signo != SIGCHLD)
+                    {
+                        unlink(path);
+                        exit(EXIT_SUCCESS);
+                    }
+                }
+            }
+
+            // Answer each finished request with the exit value of its worker
+            pid_t pid;
+            int status;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                int i = 0;
+                while (i < num_workers && workers[i].pid != pid)
+                    i++;
+                if (i == num_workers)
+                    continue;
+                if (WIFSIGNALED(status))
+                    send_status(workers[i].conn, 128 + WTERMSIG(status));
+                else
+                    send_status(workers[i].conn, WEXITSTATUS(status));
+                close(workers[i].conn);
+                workers[i] = workers[--num_workers];
+            }
+        }
+
+        if (num_workers < max_workers && (fds[1].revents & POLLIN))
+        {
+            int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn == -1)
+                continue;
+
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                close(listen_fd);
+                close(signal_fd);
+                free(workers);
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                serve_worker(conn, script);
+                return 0;
+            }
+            if (pid == -1)
+            {
+                perror("serve: fork()");
+                fflush(stderr);
+                send_status(conn, EXIT_FAILURE);
+                close(conn);
+                continue;
+            }
+            workers[num_workers].pid = pid;
+            workers[num_workers].conn = conn;
+            num_workers++;
+
+            if (DEBUGSERVE)
+                fprintf(stderr, "serve: worker %d, %d running\n", pid, num_workers);
+        }
+    }
+}
+
+/*  Sends a request to the server listening at PATH and waits for it to
+    finish. The request is the ARGC words of ARGV as one command line, run
+    with this process's stdin, stdout and stderr; or with no words, the
+    script read from stdin, run with its stdout and stderr. Returns the exit
+    value of the request, or 1 after printing an error.
+ */
+int serve_connect(const char *path, int argc, char **argv)
+{
+    static char buf[SERVE_MSG_MAX];
+    size_t len = 0;
+    if (argc > 0)
+    {
+        for (int i = 0; i < argc; i++)
+        {
+            size_t arg_len = strlen(argv[i]);
+            if (len + arg_len + 1 > sizeof(buf))
+            {
+                fprintf(stderr, "connect: command line too long\n");
+                return EXIT_FAILURE;
+            }
+            memcpy(buf + len, argv[i], arg_len);
+            len += arg_len;
+            buf[len++] = i + 1 < argc ? ' ' : '\n';
+        }
+    }
+    else
+    {
+        ssize_t n;
+        while (len < sizeof(buf) && (n = read(STDIN_FILENO, buf + len, sizeof(buf) - len)) != 0)
+        {
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1)
+            {
+                perror("connect: read()");
+                return EXIT_FAILURE;
+            }
+            len += (size_t)n;
+        }
+        if (len == sizeof(buf))
+        {
+            fprintf(stderr, "connect: script too long\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "connect: %s: path too long\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        fprintf(stderr, "connect: %s: ", path);
+        perror("");
+        return EXIT_FAILURE;
+    }
+
+    int fds[3] = {STDOUT_FILENO, STDERR_FILENO, STDIN_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {buf, len};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN((argc > 0 ? 3 : 2) * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    msg.msg_controllen = CMSG_SPACE((argc > 0 ? 3 : 2) * sizeof(int));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1)
+    {
+        perror("connect: sendmsg()");
+        return EXIT_FAILURE;
+    }
+
+    // Output is only sent back for fds that were not passed, which is never
+    // the case here, but is copied all the same
+    ssize_t n;
+    while ((n = recv(sock, buf, sizeof(buf) - 1, 0)) != 0)
+    {
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            perror("connect: recv()");
+            return EXIT_FAILURE;
+        }
+        if (buf[0] == SERVE_STATUS)
+        {
+            buf[n] = '\0';
+            return atoi(buf + 1);
+        }
+        if (write(buf[0] == SERVE_STDERR ? STDERR_FILENO : STDOUT_FILENO, buf + 1, (size_t)n - 1) == -1)
+            break;
+    }
+    fprintf(stderr, "connect: %s: connection closed\n", path);
+    return EXIT_FAILURE;
+}
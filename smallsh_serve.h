@@ -0,0 +1,16 @@
+#ifndef SMALLSH_SERVE_H
+#define SMALLSH_SERVE_H
+
+#include "smallsh_input.h"
+
+// Tag in the first byte of each packet sent back to a client: output of its
+// commands, for which it passed no fd, and finally their exit value
+#define SERVE_STDOUT 'o'
+#define SERVE_STDERR 'e'
+#define SERVE_STATUS 's'
+
+int serve_run(const char *path, int max_workers, struct reader *script);
+void serve_finish(void);
+int serve_connect(const char *path, int argc, char **argv);
+
+#endif
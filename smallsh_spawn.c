@@ -0,0 +1,554 @@
+#define _GNU_SOURCE
+// posix_spawn, sigaction, pipe2, F_SETPIPE_SZ, memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include "smallsh_spawn.h"
+#include "smallsh_pathcache.h"
+#include "smallsh_stats.h"
+#include "smallsh_trace.h"
+#include "smallsh_zygote.h"
+#include "smallsh_events.h"
+#include "smallsh_controls.h"
+
+#define DEBUGSPAWN 0
+
+extern char **environ;
+
+// Launch engine used by spawn_process(). Selected once by spawn_init().
+enum spawn_mode spawn_mode = SPAWN_POSIX;
+
+// Capacity requested for pipes between pipeline stages. 0 keeps the default.
+int spawn_pipe_size = 0;
+
+/*  Selects the launch engine from the SMALLSH_SPAWN environment variable.
+    "fork" selects the fork() fallback; "zygote" starts the zygote helper,
+    whose end of the socket is watched by the event loop; "spawn" (or unset)
+    selects posix_spawn. Any other value prints a warning and keeps the
+    default. Must be called after ev_init().
+    SMALLSH_PIPE_SZ, if set, is the capacity in bytes requested for pipes
+    between pipeline stages. SMALLSH_BG_SPREAD is read by controls_init().
+ */
+void spawn_init(void)
+{
+    char *mode = getenv("SMALLSH_SPAWN");
+    if (mode == NULL || strcmp(mode, "spawn") == 0)
+        spawn_mode = SPAWN_POSIX;
+    else if (strcmp(mode, "fork") == 0)
+        spawn_mode = SPAWN_FORK;
+    else if (strcmp(mode, "zygote") == 0)
+    {
+        if (zygote_start() == 0 && ev_watch(zygote_fd()) == 0)
+            spawn_mode = SPAWN_ZYGOTE;
+        else
+        {
+            fprintf(stderr, "SMALLSH_SPAWN: zygote not started, using spawn\n");
+            fflush(stderr);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "SMALLSH_SPAWN: unknown mode '%s', using spawn\n", mode);
+        fflush(stderr);
+    }
+
+    char *pipe_size = getenv("SMALLSH_PIPE_SZ");
+    if (pipe_size)
+        spawn_pipe_size = atoi(pipe_size);
+
+    // SMALLSH_BG_SPREAD spreads background processes across the CPUs
+    controls_init();
+
+    if (DEBUGSPAWN)
+        printf("spawn mode: %s, pipe size: %d\n", spawn_mode_name(), spawn_pipe_size);
+}
+
+/*  Must be called when the shell's working directory or environment has
+    changed, so commands launched by the zygote see the change too.
+ */
+void spawn_context_changed(void)
+{
+    if (spawn_mode == SPAWN_ZYGOTE)
+        zygote_context_changed();
+}
+
+/*  Returns the name of the current launch engine, as accepted by
+    SMALLSH_SPAWN.
+ */
+const char *spawn_mode_name(void)
+{
+    if (spawn_mode == SPAWN_ZYGOTE)
+        return "zygote";
+    return spawn_mode == SPAWN_FORK ? "fork" : "spawn";
+}
+
+/*  Launches STAGE with fork(). The child sets its own signal dispositions,
+    process group and redirections before calling execv. Errors in the child
+    are printed there, and the child exits with status 1. CONTROLS, if not
+    NULL, are applied by the child once in its process group. If EXEC_FD is
+    not -1, the child writes the time (from stats_now()) to it just before
+    executing the command; it must be close-on-exec.
+ */
+static pid_t spawn_fork(struct user_input *stage, int in_fd, int out_fd,
+                        int flags, pid_t pgid,
+                        const struct spawn_controls *controls, int exec_fd)
+{
+    struct sigaction ignore_action = {0}, default_action = {0};
+    ignore_action.sa_handler = SIG_IGN;
+    sigemptyset(&ignore_action.sa_mask);
+    default_action.sa_handler = SIG_DFL;
+    sigemptyset(&default_action.sa_mask);
+
+    // Resolve the command in the parent, so the result stays in its cache
+    const char *cmd_path = pathcache_lookup(stage->cmd);
+
+    pid_t spawnpid = fork();
+    if (spawnpid != 0)
+    {
+        // Parent process, or fork error. The parent sets the process group
+        // too, so it is in place whichever process runs first.
+        if (spawnpid == -1)
+            perror("fork()");
+        else if (pgid != -1)
+            setpgid(spawnpid, pgid);
+        return spawnpid;
+    }
+
+    /* CHILD PROCESS BRANCH */
+
+    // All children processes ignore SIGTSTP
+    sigaction(SIGTSTP, &ignore_action, NULL);
+
+    // Foreground child processes terminate on SIGINT
+    if (!(flags & SPAWN_BG))
+        sigaction(SIGINT, &default_action, NULL);
+
+    if (pgid != -1)
+        setpgid(0, pgid);
+
+    // The shell blocks SIGCHLD (see smallsh_events.c); the child must not
+    sigset_t sigchld_mask;
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+
+    // CPU affinity, resource limits and niceness (see smallsh_controls.c)
+    if (controls && controls_apply(controls) == -1)
+        exit(EXIT_FAILURE);
+
+    // Point stdin to in_fd. in_fd is close-on-exec, the copy is not.
+    if (in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1)
+    {
+        fprintf(stderr, "error redirecting input for %s: dup2(): ", stage->cmd);
+        perror("");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    // Point stdout to out_fd
+    if (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1)
+    {
+        fprintf(stderr, "error redirecting output for %s: dup2(): ", stage->cmd);
+        perror("");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    // Report the exec start when traced (see smallsh_trace.c)
+    if (exec_fd != -1)
+    {
+        uint64_t exec_ns = stats_now();
+        if (write(exec_fd, &exec_ns, sizeof(exec_ns)) == -1 && DEBUGSPAWN)
+            perror("write(exec_fd)");
+    }
+
+    // Call exec function to replace process. If the resolved path no longer
+    // executes, report it to the shell's cache and search PATH again.
+    if (cmd_path)
+    {
+        execv(cmd_path, stage->cmd_args);
+        pathcache_report_stale(stage->cmd, cmd_path);
+    }
+    execvp(stage->cmd, stage->cmd_args);
+
+    // If function returned, error occurred. Print error and exit.
+    fprintf(stderr, "execvp(): %s: ", stage->cmd);
+    perror("");
+    fflush(stderr);
+    exit(EXIT_FAILURE);
+}
+
+/*  Launches STAGE with posix_spawn, which glibc implements with
+    clone(CLONE_VM | CLONE_VFORK), so the shell's page tables are never copied.
+    The command is resolved through the PATH cache; if a remembered path no
+    longer executes it is forgotten and PATH is searched once more.
+
+    posix_spawn can reset signals to their default but cannot ignore them, so
+    SIGTSTP is blocked and switched to SIG_IGN around the call. The child
+    inherits the ignored disposition, while a SIGTSTP arriving meanwhile stays
+    pending and reaches the shell's handler once the mask is restored.
+ */
+static pid_t spawn_posix(struct user_input *stage, int in_fd, int out_fd,
+                         int flags, pid_t pgid)
+{
+    // in_fd and out_fd are close-on-exec; the dup2'd copies are not
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+    // Block SIGTSTP while its disposition is swapped to SIG_IGN
+    sigset_t block_mask, old_mask;
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &block_mask, &old_mask);
+
+    struct sigaction ignore_action = {0}, SIGTSTP_saved;
+    ignore_action.sa_handler = SIG_IGN;
+    sigemptyset(&ignore_action.sa_mask);
+    sigaction(SIGTSTP, &ignore_action, &SIGTSTP_saved);
+
+    // Foreground children terminate on SIGINT. Background children inherit
+    // the shell's ignored SIGINT. The child starts with the shell's old mask,
+    // less SIGCHLD, which the shell blocks (see smallsh_events.c).
+    sigset_t child_mask = old_mask;
+    sigdelset(&child_mask, SIGCHLD);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    short attr_flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    sigset_t default_mask;
+    sigemptyset(&default_mask);
+    if (!(flags & SPAWN_BG))
+        sigaddset(&default_mask, SIGINT);
+    posix_spawnattr_setsigdefault(&attr, &default_mask);
+    posix_spawnattr_setsigmask(&attr, &child_mask);
+    if (pgid != -1)
+    {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        attr_flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, attr_flags);
+
+    pid_t spawnpid;
+    int result = ENOENT;
+    const char *cmd_path = pathcache_lookup(stage->cmd);
+    if (cmd_path)
+    {
+        result = posix_spawn(&spawnpid, cmd_path, &actions, &attr,
+                             stage->cmd_args, environ);
+        if ((result == ENOENT || result == EACCES) && cmd_path != stage->cmd)
+        {
+            // Stale cache entry. Search PATH again and retry if it moved.
+            char *stale_path = strdup(cmd_path);
+            pathcache_forget(stage->cmd);
+            cmd_path = pathcache_lookup(stage->cmd);
+            if (cmd_path && strcmp(cmd_path, stale_path) != 0)
+                result = posix_spawn(&spawnpid, cmd_path, &actions, &attr,
+                                     stage->cmd_args, environ);
+            free(stale_path);
+        }
+        if (result == ENOEXEC)
+        {
+            // A file without a "#!" line is run by /bin/sh, as execvp does
+            char **sh_args = malloc((stage->num_cmd_args + 2) * sizeof(char *));
+            if (sh_args)
+            {
+                sh_args[0] = "/bin/sh";
+                sh_args[1] = (char *)cmd_path;
+                for (int i = 1; i <= stage->num_cmd_args; i++)
+                    sh_args[i + 1] = stage->cmd_args[i];
+                result = posix_spawn(&spawnpid, "/bin/sh", &actions, &attr, sh_args, environ);
+                free(sh_args);
+            }
+        }
+    }
+
+    // Restore SIGTSTP handling. Any pending SIGTSTP is delivered here.
+    sigaction(SIGTSTP, &SIGTSTP_saved, NULL);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (result != 0)
+    {
+        fprintf(stderr, "posix_spawn(): %s: ", stage->cmd);
+        errno = result;
+        perror("");
+        fflush(stderr);
+        return -1;
+    }
+
+    if (DEBUGSPAWN)
+        printf("posix_spawn: %s -> %d\n", cmd_path, spawnpid);
+
+    return spawnpid;
+}
+
+/*  Launches STAGE through the zygote, or with posix_spawn if the zygote is
+    gone or cannot take the request.
+ */
+static pid_t spawn_zygote(struct user_input *stage, int in_fd, int out_fd,
+                          int flags, pid_t pgid)
+{
+    pid_t pid = zygote_spawn(stage, pathcache_lookup(stage->cmd), in_fd, out_fd, flags, pgid);
+    if (pid == ZYGOTE_UNAVAILABLE)
+        return spawn_posix(stage, in_fd, out_fd, flags, pgid);
+    return pid;
+}
+
+/*  Launches the single command STAGE using the current launch engine.
+    IN_FD and OUT_FD, if not -1, become the child's stdin and stdout; they
+    must be close-on-exec. FLAGS is a set of SPAWN_* flags. PGID is the
+    process group to place the child in: -1 keeps the shell's group, 0 makes
+    the child the leader of a new group.
+    Returns the child's pid, or -1 if the command could not be launched, in
+    which case an error has already been printed.
+
+    A stage with controls (see smallsh_controls.c), including a background
+    process spread across the CPUs, is always launched with fork(): neither
+    posix_spawn nor the zygote can set affinity, limits or niceness in the
+    child alone.
+
+    When tracing, the launch is recorded with trace_spawn(). posix_spawn
+    returns only once the child has executed the command, so its return is
+    the exec start; a forked child reports it through a close-on-exec pipe.
+ */
+pid_t spawn_process(struct user_input *stage, int in_fd, int out_fd,
+                    int flags, pid_t pgid)
+{
+    struct spawn_controls spread;
+    const struct spawn_controls *controls = stage->controls;
+    if (flags & SPAWN_BG)
+        controls = controls_spread(controls, &spread);
+    int use_fork = spawn_mode == SPAWN_FORK || controls != NULL;
+
+    if (!trace_enabled)
+    {
+        if (use_fork)
+            return spawn_fork(stage, in_fd, out_fd, flags, pgid, controls, -1);
+        if (spawn_mode == SPAWN_ZYGOTE)
+            return spawn_zygote(stage, in_fd, out_fd, flags, pgid);
+        return spawn_posix(stage, in_fd, out_fd, flags, pgid);
+    }
+
+    uint64_t start_ns = stats_now();
+    uint64_t exec_ns = 0;
+    int exec_pipe[2] = {-1, -1};
+    pid_t pid;
+    if (use_fork)
+    {
+        if (pipe2(exec_pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+            perror("pipe2()");
+        pid = spawn_fork(stage, in_fd, out_fd, flags, pgid, controls, exec_pipe[1]);
+        if (exec_pipe[1] != -1)
+            close(exec_pipe[1]);
+    }
+    // The exec start of a child of the zygote is not known
+    else if (spawn_mode == SPAWN_ZYGOTE)
+        pid = spawn_zygote(stage, in_fd, out_fd, flags, pgid);
+    else
+    {
+        pid = spawn_posix(stage, in_fd, out_fd, flags, pgid);
+        exec_ns = stats_now();
+    }
+
+    if (pid != -1)
+        trace_spawn(pid, stage->cmd, flags & SPAWN_BG, start_ns, exec_ns, exec_pipe[0]);
+    else if (exec_pipe[0] != -1)
+        close(exec_pipe[0]);
+    return pid;
+}
+
+/*  Returns a close-on-exec descriptor reading the LEN bytes at DATA, the
+    body of a here-doc or here-string, without touching the filesystem. Up to
+    PIPE_BUF bytes are written to a pipe, which always holds them without
+    blocking; larger bodies go to a memory file, read from its start.
+    Returns -1 after printing an error.
+ */
+int spawn_open_here(const char *data, size_t len)
+{
+    if (len <= PIPE_BUF)
+    {
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+        {
+            perror("here-doc: pipe2()");
+            fflush(stderr);
+            return -1;
+        }
+        if (len > 0 && write(pipe_fds[1], data, len) == -1)
+            perror("here-doc: write()");
+        close(pipe_fds[1]);
+        return pipe_fds[0];
+    }
+
+    int fd = memfd_create("here-doc", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("here-doc: memfd_create()");
+        fflush(stderr);
+        return -1;
+    }
+    size_t written = 0;
+    while (written < len)
+    {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            perror("here-doc: write()");
+            fflush(stderr);
+            close(fd);
+            return -1;
+        }
+        written += (size_t)n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/*  Opens the redirection files of STAGE, close-on-exec. A stage with no input
+    file reads /dev/null if DEFAULT_NULL_IN is set, and likewise for output.
+    A here-doc or here-string is read from a pipe or memory file instead.
+    Unopened descriptors are set to -1. Returns 0 on success, or -1 after
+    printing an error.
+ */
+int spawn_open_redirections(struct user_input *stage, int default_null_in,
+                            int default_null_out, int *in_fd, int *out_fd)
+{
+    *in_fd = -1;
+    *out_fd = -1;
+
+    // Open input file if specified, or /dev/null for a background process
+    if (stage->here_data)
+    {
+        *in_fd = spawn_open_here(stage->here_data, stage->here_len);
+        if (*in_fd == -1)
+            return -1;
+    }
+    else if (stage->input_file || default_null_in)
+    {
+        char *input_file = "/dev/null";
+        if (stage->input_file)
+            input_file = stage->input_file;
+
+        *in_fd = open(input_file, O_RDONLY | O_CLOEXEC);
+        if (*in_fd == -1)
+        {
+            fprintf(stderr, "error redirecting input to %s: open(): ", input_file);
+            perror("");
+            fflush(stderr);
+            return -1;
+        }
+    }
+
+    // Open output file if specified, or /dev/null for a background process
+    if (stage->output_file || default_null_out)
+    {
+        char *output_file = "/dev/null";
+        if (stage->output_file)
+            output_file = stage->output_file;
+
+        *out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (*out_fd == -1)
+        {
+            fprintf(stderr, "error redirecting output to %s: open(): ", output_file);
+            perror("");
+            fflush(stderr);
+            if (*in_fd != -1)
+                close(*in_fd);
+            *in_fd = -1;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*  Launches every stage of the pipeline starting at USER_INPUT, connecting
+    the stdout of each stage to the stdin of the next with a pipe. All stages
+    run concurrently. Redirection files take precedence over pipes.
+
+    A background pipeline reads /dev/null and writes /dev/null where it would
+    otherwise use the terminal, and its stages are placed in a new process
+    group led by the first stage. Foreground stages stay in the shell's
+    process group, so terminal signals keep reaching them.
+
+    The pid of each stage is stored in PIDS, in order, or -1 for a stage that
+    could not be launched. Returns the number of stages launched.
+ */
+int spawn_pipeline(struct user_input *user_input, pid_t *pids)
+{
+    int flags = user_input->bg_process ? SPAWN_BG : 0;
+    pid_t pgid = (flags & SPAWN_BG) ? 0 : -1;
+    int prev_read = -1;
+    int num_launched = 0;
+    int i = 0;
+
+    for (struct user_input *stage = user_input; stage; stage = stage->next, i++)
+    {
+        // Create the pipe to the next stage
+        int pipe_fds[2] = {-1, -1};
+        if (stage->next)
+        {
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+            {
+                perror("pipe2()");
+                fflush(stderr);
+                for (; stage; stage = stage->next, i++)
+                    pids[i] = -1;
+                break;
+            }
+            if (spawn_pipe_size > 0 &&
+                fcntl(pipe_fds[1], F_SETPIPE_SZ, spawn_pipe_size) == -1 && DEBUGSPAWN)
+                perror("fcntl(F_SETPIPE_SZ)");
+        }
+
+        int file_in = -1, file_out = -1;
+        int null_in = (flags & SPAWN_BG) && stage == user_input;
+        int null_out = (flags & SPAWN_BG) && stage->next == NULL;
+        if (spawn_open_redirections(stage, null_in, null_out, &file_in, &file_out) == 0)
+        {
+            int in_fd = file_in != -1 ? file_in : prev_read;
+            int out_fd = file_out != -1 ? file_out : pipe_fds[1];
+            pids[i] = spawn_process(stage, in_fd, out_fd, flags, pgid);
+        }
+        else
+            pids[i] = -1;
+
+        if (pids[i] != -1)
+        {
+            num_launched++;
+            // Later stages join the group led by the first launched stage
+            if (pgid == 0)
+                pgid = pids[i];
+        }
+
+        // The children hold their own copies of these now
+        if (file_in != -1)
+            close(file_in);
+        if (file_out != -1)
+            close(file_out);
+        if (prev_read != -1)
+            close(prev_read);
+        if (pipe_fds[1] != -1)
+            close(pipe_fds[1]);
+        prev_read = pipe_fds[0];
+    }
+
+    if (prev_read != -1)
+        close(prev_read);
+
+    return num_launched;
+}
@@ -0,0 +1,31 @@
+#ifndef SMALLSH_SPAWN_H
+#define SMALLSH_SPAWN_H
+
+#include <sys/types.h>
+#include "smallsh.h"
+
+// Launch engines for non built-in commands
+enum spawn_mode
+{
+    SPAWN_POSIX,    // posix_spawn (vfork-style clone, no page-table copy)
+    SPAWN_FORK,     // fork + dup2 + execvp in the child
+    SPAWN_ZYGOTE    // Requests to a helper forked at startup (smallsh_zygote.c)
+};
+
+// Flags for spawn_process()
+#define SPAWN_BG 0x1    // Background process: SIGINT stays ignored
+
+extern enum spawn_mode spawn_mode;
+extern int spawn_pipe_size;
+
+void spawn_init(void);
+void spawn_context_changed(void);
+const char *spawn_mode_name(void);
+pid_t spawn_process(struct user_input *stage, int in_fd, int out_fd,
+                    int flags, pid_t pgid);
+int spawn_pipeline(struct user_input *user_input, pid_t *pids);
+int spawn_open_redirections(struct user_input *stage, int default_null_in,
+                            int default_null_out, int *in_fd, int *out_fd);
+int spawn_open_here(const char *data, size_t len);
+
+#endif
@@ -0,0 +1,220 @@
+#define _POSIX_C_SOURCE 200809L
+// clock_gettime, strdup
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "smallsh_stats.h"
+
+#define DEBUGSTATS 0
+
+// Each power of two is split into 2^STATS_SUB_BITS buckets, so a value is
+// known to within 25% from its bucket. Values below 2^STATS_SUB_BITS
+// nanoseconds have a bucket each.
+#define STATS_SUB_BITS 2
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_NUM_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+// Fixed-bucket log-scale histogram of durations in nanoseconds
+struct histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[STATS_NUM_BUCKETS];
+};
+
+static struct histogram histograms[NUM_STAT_PHASES];
+
+static const char *phase_names[NUM_STAT_PHASES] = {
+    "read", "parse", "builtin", "spawn", "run", "reap", "notify"
+};
+
+// File the statistics are written to by stats_dump(), or NULL
+static char *dump_path = NULL;
+
+/*  Returns the current time of the monotonic clock in nanoseconds. On Linux
+    this is read through the vDSO, without a system call.
+ */
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*  Returns the bucket holding NS.
+ */
+static int bucket_index(uint64_t ns)
+{
+    if (ns < STATS_SUB_BUCKETS)
+        return (int)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (exponent - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return (exponent - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+/*  Returns the largest value held by bucket INDEX.
+ */
+static uint64_t bucket_upper(int index)
+{
+    if (index < STATS_SUB_BUCKETS)
+        return (uint64_t)index;
+    int exponent = index / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    int sub = index % STATS_SUB_BUCKETS;
+    uint64_t width = (uint64_t)1 << (exponent - STATS_SUB_BITS);
+    return ((uint64_t)(STATS_SUB_BUCKETS + sub) << (exponent - STATS_SUB_BITS)) + width - 1;
+}
+
+/*  Adds a sample of NS nanoseconds to the histogram of PHASE. Only a bucket
+    lookup and four additions: a few nanoseconds.
+ */
+void stats_record_ns(enum stat_phase phase, uint64_t ns)
+{
+    struct histogram *histogram = &histograms[phase];
+    histogram->count++;
+    histogram->sum += ns;
+    if (ns > histogram->max)
+        histogram->max = ns;
+    histogram->buckets[bucket_index(ns)]++;
+}
+
+/*  Adds a sample to the histogram of PHASE: the time since START, a value
+    returned by stats_now().
+ */
+void stats_record(enum stat_phase phase, uint64_t start)
+{
+    stats_record_ns(phase, stats_now() - start);
+}
+
+/*  Clears every histogram.
+ */
+void stats_reset(void)
+{
+    memset(histograms, '\0', sizeof(histograms));
+}
+
+/*  Returns an upper bound of the value below which the fraction FRACTION of
+    the samples of HISTOGRAM lie, which must not be empty.
+ */
+static uint64_t percentile(const struct histogram *histogram, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * histogram->count);
+    if (rank >= histogram->count)
+        rank = histogram->count - 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_NUM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen > rank)
+        {
+            uint64_t upper = bucket_upper(i);
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/*  Writes NS to BUF (of SIZE bytes) with a unit chosen for its magnitude.
+ */
+static void format_ns(char *buf, size_t size, double ns)
+{
+    if (ns < 1e3)
+        snprintf(buf, size, "%.0fns", ns);
+    else if (ns < 1e6)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1e9)
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+}
+
+/*  Prints the sample count, p50, p99, max and mean of every phase to STREAM.
+ */
+void stats_print(FILE *stream)
+{
+    fprintf(stream, "%-8s %10s %10s %10s %10s %10s\n", "phase", "count", "p50", "p99", "max", "mean");
+    for (int p = 0; p < NUM_STAT_PHASES; p++)
+    {
+        const struct histogram *histogram = &histograms[p];
+        if (histogram->count == 0)
+        {
+            fprintf(stream, "%-8s %10d %10s %10s %10s %10s\n", phase_names[p], 0, "-", "-", "-", "-");
+            continue;
+        }
+
+        char p50[16], p99[16], max[16], mean[16];
+        format_ns(p50, sizeof(p50), (double)percentile(histogram, 0.50));
+        format_ns(p99, sizeof(p99), (double)percentile(histogram, 0.99));
+        format_ns(max, sizeof(max), (double)histogram->max);
+        format_ns(mean, sizeof(mean), (double)histogram->sum / histogram->count);
+        fprintf(stream, "%-8s %10llu %10s %10s %10s %10s\n", phase_names[p],
+                (unsigned long long)histogram->count, p50, p99, max, mean);
+    }
+    fflush(stream);
+}
+
+/*  Prints the same statistics as stats_print() to STREAM as a JSON object,
+    with every duration in nanoseconds.
+ */
+void stats_print_json(FILE *stream)
+{
+    fprintf(stream, "{\n");
+    for (int p = 0; p < NUM_STAT_PHASES; p++)
+    {
+        const struct histogram *histogram = &histograms[p];
+        uint64_t p50 = histogram->count ? percentile(histogram, 0.50) : 0;
+        uint64_t p99 = histogram->count ? percentile(histogram, 0.99) : 0;
+        double mean = histogram->count ? (double)histogram->sum / histogram->count : 0;
+        fprintf(stream, "  \"%s\": {\"count\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+                "\"max_ns\": %llu, \"mean_ns\": %.0f}%s\n", phase_names[p],
+                (unsigned long long)histogram->count, (unsigned long long)p50,
+                (unsigned long long)p99, (unsigned long long)histogram->max, mean,
+                p + 1 < NUM_STAT_PHASES ? "," : "");
+    }
+    fprintf(stream, "}\n");
+    fflush(stream);
+}
+
+/*  Sets the file the statistics are written to when the shell exits, or no
+    file if PATH is NULL. Returns 0 on success, or -1 after printing an
+    error.
+ */
+int stats_set_dump_file(const char *path)
+{
+    free(dump_path);
+    dump_path = NULL;
+    if (path == NULL)
+        return 0;
+
+    dump_path = strdup(path);
+    if (dump_path == NULL)
+    {
+        perror("stats: strdup()");
+        return -1;
+    }
+    if (DEBUGSTATS)
+        printf("stats: dumping to %s on exit\n", dump_path);
+    return 0;
+}
+
+/*  Writes the statistics as JSON to the file set by stats_set_dump_file(),
+    if any.
+ */
+void stats_dump(void)
+{
+    if (dump_path == NULL)
+        return;
+
+    FILE *file = fopen(dump_path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "stats: %s: ", dump_path);
+        perror("");
+        fflush(stderr);
+        return;
+    }
+    stats_print_json(file);
+    fclose(file);
+}
@@ -0,0 +1,29 @@
+#ifndef SMALLSH_STATS_H
+#define SMALLSH_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Phases of the main loop with a latency histogram each
+enum stat_phase
+{
+    STAT_READ,      // Prompt and reading of a command line
+    STAT_PARSE,     // Tokenizing and parsing
+    STAT_BUILTIN,   // Built-in dispatch, and running the built-in if one
+    STAT_SPAWN,     // Launching every stage of a pipeline
+    STAT_RUN,       // Launch to exit of a job
+    STAT_REAP,      // Background check before a prompt, or one foreground reap
+    STAT_NOTIFY,    // Reaping to reporting of a background process
+    NUM_STAT_PHASES
+};
+
+uint64_t stats_now(void);
+void stats_record(enum stat_phase phase, uint64_t start);
+void stats_record_ns(enum stat_phase phase, uint64_t ns);
+void stats_reset(void);
+void stats_print(FILE *stream);
+void stats_print_json(FILE *stream);
+int stats_set_dump_file(const char *path);
+void stats_dump(void);
+
+#endif
@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+// strdup
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "smallsh_trace.h"
+#include "smallsh_stats.h"
+
+#define DEBUGTRACE 0
+
+// Events are formatted into a buffer of this size, which is written out
+// whenever less than TRACE_EVENT_MAX bytes are left in it
+#define TRACE_BUF_SIZE 65536
+#define TRACE_EVENT_MAX 4096
+
+int trace_enabled = 0;
+
+static int trace_fd = -1;
+static char trace_buf[TRACE_BUF_SIZE];
+static size_t trace_len = 0;
+static int num_events = 0;
+static pid_t shell_pid = 0;
+
+// A process launched while tracing, until its exit is recorded
+struct trace_proc
+{
+    pid_t pid;
+    char *cmd;
+    int background;
+    uint64_t start_ns;  // Before the launch began
+    uint64_t exec_ns;   // When the command was executed, or 0 if unknown
+    int exec_fd;        // Read end of the pipe the child reports it on, or -1
+};
+
+// Live traced processes. Few are live at a time, so they are searched
+// linearly and removed by moving the last one into the gap.
+static struct trace_proc *procs = NULL;
+static int num_procs = 0, procs_size = 0;
+
+/*  Opens the file named by the environment variable SMALLSH_TRACE, if set,
+    and starts recording an event for every process the shell launches, in
+    the Chrome trace-event JSON format that Perfetto and chrome://tracing
+    load.
+ */
+void trace_init(void)
+{
+    char *path = getenv("SMALLSH_TRACE");
+    if (path == NULL || *path == '\0')
+        return;
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd == -1)
+    {
+        fprintf(stderr, "SMALLSH_TRACE: %s: ", path);
+        perror("");
+        fflush(stderr);
+        return;
+    }
+    trace_enabled = 1;
+    shell_pid = getpid();
+
+    // JSON array format. Each event is followed by ",\n" but the last, so
+    // the array is closed by trace_flush() at exit.
+    trace_len = (size_t)snprintf(trace_buf, sizeof(trace_buf),
+        "[\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+        "\"args\": {\"name\": \"smallsh\"}}", (int)shell_pid);
+    num_events = 1;
+}
+
+/*  Writes the buffered events to the trace file.
+ */
+static void write_buffer(void)
+{
+    size_t written = 0;
+    while (written < trace_len)
+    {
+        ssize_t n = write(trace_fd, trace_buf + written, trace_len - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            perror("SMALLSH_TRACE: write()");
+            fflush(stderr);
+            break;
+        }
+        written += (size_t)n;
+    }
+    trace_len = 0;
+}
+
+/*  Appends to BUF (of SIZE bytes) the string STR quoted for JSON, and
+    returns the number of bytes appended.
+ */
+static size_t json_string(char *buf, size_t size, const char *str)
+{
+    size_t len = 0;
+    if (size < 3)
+        return 0;
+    buf[len++] = '"';
+    for (const char *p = str; *p && len + 8 < size; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\')
+        {
+            buf[len++] = '\\';
+            buf[len++] = (char)c;
+        }
+        else if (c < 0x20)
+            len += (size_t)snprintf(buf + len, size - len, "\\u%04x", c);
+        else
+            buf[len++] = (char)c;
+    }
+    buf[len++] = '"';
+    buf[len] = '\0';
+    return len;
+}
+
+/*  Records that process PID, running the command CMD in the background if
+    BACKGROUND is set, was launched at START_NS. EXEC_NS is when its command
+    was executed, if known, or else 0, in which case EXEC_FD, if not -1, is
+    the read end of a close-on-exec pipe the child wrote the time to just
+    before executing. The pipe is read once the process has exited, so the
+    launch is never delayed. Times are from stats_now().
+ */
+void trace_spawn(pid_t pid, const char *cmd, int background,
+                 uint64_t start_ns, uint64_t exec_ns, int exec_fd)
+{
+    if (num_procs == procs_size)
+    {
+        int new_size = procs_size ? procs_size * 2 : 16;
+        struct trace_proc *new_procs = realloc(procs, new_size * sizeof(struct trace_proc));
+        if (new_procs == NULL)
+        {
+            perror("trace: realloc()");
+            if (exec_fd != -1)
+                close(exec_fd);
+            return;
+        }
+        procs = new_procs;
+        procs_size = new_size;
+    }
+
+    struct trace_proc *proc = &procs[num_procs++];
+    proc->pid = pid;
+    proc->cmd = strdup(cmd);
+    proc->background = background;
+    proc->start_ns = start_ns;
+    proc->exec_ns = exec_ns;
+    proc->exec_fd = exec_fd;
+}
+
+/*  Records the event of the traced process PID, which has exited with the
+    wait status STATUS, as part of the job launched from CMD_LINE.
+ */
+void trace_exit(pid_t pid, int status, const char *cmd_line)
+{
+    uint64_t exit_ns = stats_now();
+
+    int i = 0;
+    while (i < num_procs && procs[i].pid != pid)
+        i++;
+    if (i == num_procs)
+        return;
+    struct trace_proc *proc = &procs[i];
+
+    // The child wrote the time it executed its command before the pipe was
+    // closed by the exec, so this does not block
+    if (proc->exec_fd != -1)
+    {
+        uint64_t exec_ns;
+        if (read(proc->exec_fd, &exec_ns, sizeof(exec_ns)) == sizeof(exec_ns))
+            proc->exec_ns = exec_ns;
+        close(proc->exec_fd);
+    }
+
+    char result[32];
+    if (WIFSIGNALED(status))
+        snprintf(result, sizeof(result), "signal %d", WTERMSIG(status));
+    else
+        snprintf(result, sizeof(result), "exit %d", WEXITSTATUS(status));
+
+    // One complete ("X") event from launch to exit, on a track per pid
+    if (TRACE_BUF_SIZE - trace_len < TRACE_EVENT_MAX)
+        write_buffer();
+    char *buf = trace_buf + trace_len;
+    size_t size = TRACE_EVENT_MAX;
+    size_t len = 0;
+    len += (size_t)snprintf(buf + len, size - len, ",\n{\"name\": ");
+    len += json_string(buf + len, 256, proc->cmd);
+    len += (size_t)snprintf(buf + len, size - len,
+        ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+        "\"pid\": %d, \"tid\": %d, \"args\": {\"pid\": %d, \"fg\": %s, \"cmd_line\": ",
+        proc->background ? "bg" : "fg", proc->start_ns / 1e3,
+        (exit_ns - proc->start_ns) / 1e3, (int)shell_pid, (int)pid, (int)pid,
+        proc->background ? "false" : "true");
+    len += json_string(buf + len, size - len - 256, cmd_line);
+    if (proc->exec_ns)
+        len += (size_t)snprintf(buf + len, size - len,
+            ", \"exec_start_us\": %.3f, \"spawn_us\": %.3f, \"run_us\": %.3f",
+            proc->exec_ns / 1e3, (proc->exec_ns - proc->start_ns) / 1e3,
+            (exit_ns - proc->exec_ns) / 1e3);
+    len += (size_t)snprintf(buf + len, size - len, ", \"exit_us\": %.3f, \"status\": \"%s\"}}",
+                            exit_ns / 1e3, result);
+    trace_len += len;
+    num_events++;
+
+    if (DEBUGTRACE)
+        printf("trace: %d %s: %s\n", pid, proc->cmd, result);
+
+    free(proc->cmd);
+    procs[i] = procs[--num_procs];
+}
+
+/*  Writes every buffered event and closes the JSON array, leaving the trace
+    file complete. Called when the shell exits.
+ */
+void trace_flush(void)
+{
+    if (!trace_enabled)
+        return;
+    write_buffer();
+    trace_len = (size_t)snprintf(trace_buf, sizeof(trace_buf), "\n]\n");
+    write_buffer();
+    close(trace_fd);
+    trace_enabled = 0;
+
+    if (DEBUGTRACE)
+        printf("trace: %d events\n", num_events);
+}
@@ -0,0 +1,17 @@
+#ifndef SMALLSH_TRACE_H
+#define SMALLSH_TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Non-zero when SMALLSH_TRACE names a trace file. Nothing is recorded
+// otherwise.
+extern int trace_enabled;
+
+void trace_init(void);
+void trace_spawn(pid_t pid, const char *cmd, int background,
+                 uint64_t start_ns, uint64_t exec_ns, int exec_fd);
+void trace_exit(pid_t pid, int status, const char *cmd_line);
+void trace_flush(void);
+
+#endif
@@ -0,0 +1,327 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "smallsh_vars.h"
+
+#define DEBUGVARS 0
+
+// Initial number of slots in the table. Always a power of two.
+#define VARS_INIT_SLOTS 128
+
+extern char **environ;
+
+// A shell variable
+struct var
+{
+    char *name;         // NULL if the slot is empty
+    size_t len;         // Length of the name
+    char *entry;        // "NAME=VALUE", or NULL once unset
+    int exported;       // Passed to commands in the environment
+};
+
+// Open-addressed (linear probing) table of variables. An unset variable
+// keeps its slot, so no entry ever has to be moved.
+static struct var *table = NULL;
+static size_t table_slots = 0;
+static size_t table_used = 0;
+
+// Environment of commands: the entries of the exported variables. Rebuilt
+// when one of them changes, and installed as environ so that exec, getenv
+// and posix_spawn all use it as it is.
+static char **envp = NULL;
+static size_t envp_size = 0;
+
+// Expansions of "$?" and "$!"
+static char status_str[16] = "0";
+static char last_bg_str[16] = "";
+
+// Set once the environment has been imported. Until then it is built once,
+// at the end, instead of after each variable.
+static int initialized = 0;
+
+/*  Returns the FNV-1a hash of the LEN bytes at NAME.
+ */
+static size_t hash_name(const char *name, size_t len)
+{
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*  Returns the slot holding the variable named by the LEN bytes at NAME, or
+    the empty slot where it would be inserted.
+ */
+static struct var *find_slot(const char *name, size_t len)
+{
+    size_t mask = table_slots - 1;
+    size_t i = hash_name(name, len) & mask;
+    while (table[i].name && !(table[i].len == len && memcmp(table[i].name, name, len) == 0))
+        i = (i + 1) & mask;
+    return &table[i];
+}
+
+/*  Doubles the table. Returns 0, or -1 if out of memory.
+ */
+static int grow_table(void)
+{
+    struct var *old_table = table;
+    size_t old_slots = table_slots;
+    table_slots = old_slots ? 2 * old_slots : VARS_INIT_SLOTS;
+    table = calloc(table_slots, sizeof(struct var));
+    if (table == NULL)
+    {
+        table = old_table;
+        table_slots = old_slots;
+        return -1;
+    }
+    for (size_t i = 0; i < old_slots; i++)
+    {
+        if (old_table[i].name)
+            *find_slot(old_table[i].name, old_table[i].len) = old_table[i];
+    }
+    free(old_table);
+    return 0;
+}
+
+/*  Rebuilds the environment from the exported variables and installs it.
+ */
+static void rebuild_envp(void)
+{
+    size_t num = 0;
+    for (size_t i = 0; i < table_slots; i++)
+    {
+        if (table[i].entry && table[i].exported)
+            num++;
+    }
+    if (num + 1 > envp_size)
+    {
+        size_t new_size = envp_size ? envp_size : 64;
+        while (new_size < num + 1)
+            new_size *= 2;
+        char **new_envp = realloc(envp, new_size * sizeof(char *));
+        if (new_envp == NULL)
+        {
+            perror("vars: realloc()");
+            fflush(stderr);
+            return;
+        }
+        envp = new_envp;
+        envp_size = new_size;
+    }
+    num = 0;
+    for (size_t i = 0; i < table_slots; i++)
+    {
+        if (table[i].entry && table[i].exported)
+            envp[num++] = table[i].entry;
+    }
+    envp[num] = NULL;
+    environ = envp;
+
+    if (DEBUGVARS)
+        printf("vars: environment rebuilt, %zu variables\n", num);
+}
+
+/*  Sets the variable named by the LEN bytes at NAME to VALUE, or unsets it
+    if VALUE is NULL. EXPORT is 1 to export it, 0 to stop exporting it, or
+    -1 to leave that as it is. Returns 0, or -1 if out of memory.
+ */
+static int set_var(const char *name, size_t len, const char *value, int export)
+{
+    if ((table_used + 1) * 4 > table_slots * 3 && grow_table() == -1)
+        return -1;
+    struct var *var = find_slot(name, len);
+    if (var->name == NULL)
+    {
+        if (value == NULL && export != 1)
+            return 0;
+        var->name = malloc(len + 1);
+        if (var->name == NULL)
+            return -1;
+        memcpy(var->name, name, len);
+        var->name[len] = '\0';
+        var->len = len;
+        table_used++;
+    }
+
+    int was_in_env = var->entry && var->exported;
+    char *old_entry = var->entry;
+    if (value)
+    {
+        size_t value_len = strlen(value);
+        char *entry = malloc(len + value_len + 2);
+        if (entry == NULL)
+            return -1;
+        memcpy(entry, name, len);
+        entry[len] = '=';
+        memcpy(entry + len + 1, value, value_len + 1);
+        var->entry = entry;
+    }
+    else
+        var->entry = NULL;
+    if (export != -1)
+        var->exported = export;
+
+    // The old entry may still be in the environment until it is rebuilt
+    if (initialized && (was_in_env || (var->entry && var->exported)))
+        rebuild_envp();
+    free(old_entry);
+    return 0;
+}
+
+/*  Imports the environment as exported variables and installs the shell's
+    own copy of it. Must be called at startup, before any command is
+    launched.
+ */
+void vars_init(void)
+{
+    grow_table();
+    for (char **env = environ; *env; env++)
+    {
+        char *equals = strchr(*env, '=');
+        if (equals)
+            set_var(*env, (size_t)(equals - *env), equals + 1, 1);
+    }
+    rebuild_envp();
+    initialized = 1;
+}
+
+/*  Returns the value of the variable named by the LEN bytes at NAME, or
+    NULL if it is not set.
+ */
+const char *vars_get(const char *name, size_t len)
+{
+    if (table == NULL)
+        return NULL;
+    struct var *var = find_slot(name, len);
+    return var->entry ? var->entry + len + 1 : NULL;
+}
+
+/*  Sets the variable named by the LEN bytes at NAME to VALUE, keeping it
+    exported if it was, or exporting it if EXPORT is set. Returns 0, or -1
+    if out of memory.
+ */
+int vars_set(const char *name, size_t len, const char *value, int export)
+{
+    return set_var(name, len, value, export ? 1 : -1);
+}
+
+/*  Returns the length of the variable name at the start of NAME: a letter
+    or '_' followed by letters, digits and '_'. 0 if there is none.
+ */
+static size_t name_length(const char *name)
+{
+    size_t len = 0;
+    while (name[len] == '_' || (name[len] >= 'a' && name[len] <= 'z') ||
+           (name[len] >= 'A' && name[len] <= 'Z') ||
+           (len > 0 && name[len] >= '0' && name[len] <= '9'))
+        len++;
+    return len;
+}
+
+/*  Returns 1 if WORD is an assignment, NAME=VALUE, or else 0.
+ */
+int vars_is_assignment(const char *word)
+{
+    size_t len = name_length(word);
+    return len > 0 && word[len] == '=';
+}
+
+/*  Sets the variable assigned by WORD, NAME=VALUE. It stays exported if it
+    was.
+ */
+void vars_assign(const char *word)
+{
+    size_t len = name_length(word);
+    if (vars_set(word, len, word + len + 1, 0) == -1)
+    {
+        perror("vars: malloc()");
+        fflush(stderr);
+    }
+}
+
+/*  Sets the expansion of "$?", the exit value of the last foreground
+    command.
+ */
+void vars_set_status(int value)
+{
+    snprintf(status_str, sizeof(status_str), "%d", value);
+}
+
+/*  Sets the expansion of "$!", the pid of the last background process.
+ */
+void vars_set_last_bg(pid_t pid)
+{
+    snprintf(last_bg_str, sizeof(last_bg_str), "%d", (int)pid);
+}
+
+/*  Returns the expansion of the special parameter "$C" for C '?' or '!', or
+    NULL for any other C.
+ */
+const char *vars_special(char c)
+{
+    if (c == '?')
+        return status_str;
+    if (c == '!')
+        return last_bg_str;
+    return NULL;
+}
+
+/*  export [name[=value] ...]
+    Exports each NAME, setting it to VALUE if given. With no names, prints
+    every exported variable. Returns 0, or 1 if a name is not valid.
+ */
+int vars_export(struct user_input *user_input)
+{
+    if (user_input->num_cmd_args == 1)
+    {
+        for (char **env = envp; *env; env++)
+            printf("export %s\n", *env);
+        fflush(stdout);
+        return EXIT_SUCCESS;
+    }
+
+    int result = EXIT_SUCCESS;
+    for (int i = 1; i < user_input->num_cmd_args; i++)
+    {
+        const char *arg = user_input->cmd_args[i];
+        size_t len = name_length(arg);
+        if (len == 0 || (arg[len] != '\0' && arg[len] != '='))
+        {
+            fprintf(stderr, "export: '%s': not a valid identifier\n", arg);
+            fflush(stderr);
+            result = EXIT_FAILURE;
+            continue;
+        }
+        const char *value = arg[len] == '=' ? arg + len + 1 : vars_get(arg, len);
+        set_var(arg, len, value, 1);
+    }
+    return result;
+}
+
+/*  unset name ...
+    Unsets each variable NAME. Returns 0, or 1 if a name is not valid.
+ */
+int vars_unset(struct user_input *user_input)
+{
+    int result = EXIT_SUCCESS;
+    for (int i = 1; i < user_input->num_cmd_args; i++)
+    {
+        const char *arg = user_input->cmd_args[i];
+        size_t len = name_length(arg);
+        if (len == 0 || arg[len] != '\0')
+        {
+            fprintf(stderr, "unset: '%s': not a valid identifier\n", arg);
+            fflush(stderr);
+            result = EXIT_FAILURE;
+            continue;
+        }
+        set_var(arg, len, NULL, 0);
+    }
+    return result;
+}
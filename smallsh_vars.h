@@ -0,0 +1,19 @@
+#ifndef SMALLSH_VARS_H
+#define SMALLSH_VARS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "smallsh.h"
+
+void vars_init(void);
+const char *vars_get(const char *name, size_t len);
+int vars_set(const char *name, size_t len, const char *value, int export);
+int vars_is_assignment(const char *word);
+void vars_assign(const char *word);
+void vars_set_status(int value);
+void vars_set_last_bg(pid_t pid);
+const char *vars_special(char c);
+int vars_export(struct user_input *user_input);
+int vars_unset(struct user_input *user_input);
+
+#endif
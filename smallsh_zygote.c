@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+// SCM_RIGHTS, signalfd, wait4, prctl
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "smallsh_zygote.h"
+#include "smallsh_spawn.h"
+#include "smallsh_pathcache.h"
+
+#define DEBUGZYGOTE 0
+
+extern char **environ;
+
+// Largest request packet: the header and the null-terminated strings
+#define ZYGOTE_MSG_MAX 65536
+
+// Most arguments a request can carry
+#define ZYGOTE_MAX_ARGS 512
+
+// Request from the shell to launch one command. Followed in the same packet
+// by the null-terminated command path, each argument, and then each
+// environment variable if the context is sent. The stdin and stdout to give
+// the command, if any, and the shell's working directory when the context
+// is sent, are passed with SCM_RIGHTS in that order.
+struct zygote_request
+{
+    int flags;          // SPAWN_* flags
+    pid_t pgid;         // As for spawn_process()
+    int num_args;
+    int has_in_fd;      // Non-zero if an fd for stdin is attached
+    int has_out_fd;     // Non-zero if an fd for stdout is attached
+    int num_env;        // If not -1, the zygote takes on this environment
+                        // and the attached working directory first
+};
+
+// Types of zygote_reply
+enum zygote_reply_type
+{
+    ZYGOTE_SPAWNED,     // Answer to a request: pid, or -1 and errno in status
+    ZYGOTE_CHANGED      // A child changed state: pid, wait status and rusage
+};
+
+struct zygote_reply
+{
+    enum zygote_reply_type type;
+    pid_t pid;
+    int status;
+    struct rusage usage;
+};
+
+// Shell's end of the socket pair, or -1 when there is no zygote
+static int zygote_sock = -1;
+static pid_t zygote_pid = -1;
+
+// Set when the shell's working directory or environment has changed since
+// they were last sent to the zygote, whose children inherit its own
+static int context_changed = 0;
+
+// Environment taken on by the zygote: the strings copied out of the request
+// packet and the array environ points to, replaced each time it is sent
+static char *env_strings = NULL;
+static char **env_vector = NULL;
+
+// State changes received while waiting for a ZYGOTE_SPAWNED reply, in FIFO
+// order
+static struct zygote_reply *changes = NULL;
+static size_t changes_size = 0, changes_head = 0, changes_tail = 0;
+
+/*  Sends REPLY to the shell over SOCK.
+ */
+static void send_reply(int sock, const struct zygote_reply *reply)
+{
+    while (send(sock, reply, sizeof(struct zygote_reply), 0) == -1 && errno == EINTR)
+        ;
+}
+
+/*  Runs in the zygote's child: sets up the signal dispositions, process
+    group and redirections described by REQUEST, then executes the command
+    at CMD_PATH with arguments ARGS. Does not return.
+ */
+static void zygote_exec(const struct zygote_request *request, const char *cmd_path,
+                        char **args, int in_fd, int out_fd)
+{
+    struct sigaction ignore_action = {0}, default_action = {0};
+    ignore_action.sa_handler = SIG_IGN;
+    sigemptyset(&ignore_action.sa_mask);
+    default_action.sa_handler = SIG_DFL;
+    sigemptyset(&default_action.sa_mask);
+
+    // Same dispositions as a child of the shell: SIGTSTP ignored, and SIGINT
+    // terminating foreground children
+    sigaction(SIGTSTP, &ignore_action, NULL);
+    sigaction(SIGTERM, &default_action, NULL);
+    if (!(request->flags & SPAWN_BG))
+        sigaction(SIGINT, &default_action, NULL);
+
+    if (request->pgid != -1)
+        setpgid(0, request->pgid);
+
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+
+    if (in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1)
+    {
+        fprintf(stderr, "error redirecting input for %s: dup2(): ", args[0]);
+        perror("");
+        _exit(EXIT_FAILURE);
+    }
+    if (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1)
+    {
+        fprintf(stderr, "error redirecting output for %s: dup2(): ", args[0]);
+        perror("");
+        _exit(EXIT_FAILURE);
+    }
+
+    // A remembered path that no longer executes is reported to the shell,
+    // and PATH searched again
+    if (*cmd_path)
+    {
+        execv(cmd_path, args);
+        pathcache_report_stale(args[0], cmd_path);
+    }
+    execvp(args[0], args);
+
+    fprintf(stderr, "execvp(): %s: ", args[0]);
+    perror("");
+    _exit(EXIT_FAILURE);
+}
+
+/*  Receives one request from SOCK and launches its command, replying with
+    the pid. Returns -1 once the shell has closed its end, or else 0.
+ */
+static int zygote_handle_request(int sock)
+{
+    static char buf[ZYGOTE_MSG_MAX];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {buf, sizeof(buf) - 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n == -1)
+        return errno == EINTR ? 0 : -1;
+    if (n == 0)
+        return -1;
+    buf[n] = '\0';
+
+    // Passed descriptors, in the order stdin, stdout, working directory
+    int fds[3] = {-1, -1, -1};
+    int num_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            num_fds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+        }
+    }
+
+    struct zygote_reply reply = {0};
+    reply.type = ZYGOTE_SPAWNED;
+    reply.pid = -1;
+
+    struct zygote_request *request = (struct zygote_request *)buf;
+    char *args[ZYGOTE_MAX_ARGS + 1];
+    if ((size_t)n < sizeof(struct zygote_request) || request->num_args < 1 ||
+        request->num_args > ZYGOTE_MAX_ARGS)
+    {
+        reply.status = EINVAL;
+        send_reply(sock, &reply);
+        for (int i = 0; i < num_fds; i++)
+            close(fds[i]);
+        return 0;
+    }
+
+    // Unpack the command path and arguments
+    char *p = buf + sizeof(struct zygote_request);
+    char *cmd_path = p;
+    p += strlen(p) + 1;
+    for (int i = 0; i < request->num_args; i++)
+    {
+        args[i] = p;
+        p += strlen(p) + 1;
+    }
+    args[request->num_args] = NULL;
+
+    int in_fd = request->has_in_fd ? fds[0] : -1;
+    int out_fd = request->has_out_fd ? fds[request->has_in_fd ? 1 : 0] : -1;
+
+    // Take on the shell's working directory and environment, which every
+    // later child inherits. The strings must outlive the packet buffer, so
+    // they are copied, and the previous copy freed.
+    if (request->num_env != -1)
+    {
+        int cwd_fd = fds[request->has_in_fd + request->has_out_fd];
+        if (cwd_fd != -1 && fchdir(cwd_fd) == -1)
+            perror("zygote: fchdir()");
+        char *end = p;
+        for (int i = 0; i < request->num_env; i++)
+            end += strlen(end) + 1;
+        char *new_strings = malloc(end - p);
+        char **new_vector = malloc((request->num_env + 1) * sizeof(char *));
+        if (new_strings && new_vector)
+        {
+            memcpy(new_strings, p, end - p);
+            char *str = new_strings;
+            for (int i = 0; i < request->num_env; i++)
+            {
+                new_vector[i] = str;
+                str += strlen(str) + 1;
+            }
+            new_vector[request->num_env] = NULL;
+            environ = new_vector;
+            free(env_strings);
+            free(env_vector);
+            env_strings = new_strings;
+            env_vector = new_vector;
+        }
+        else
+        {
+            perror("zygote: malloc()");
+            free(new_strings);
+            free(new_vector);
+        }
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(sock);
+        zygote_exec(request, cmd_path, args, in_fd, out_fd);
+    }
+    if (pid == -1)
+        reply.status = errno;
+    // Set the group from both sides, so it is in place before the shell
+    // launches the next stage into it
+    else if (request->pgid != -1)
+        setpgid(pid, request->pgid == 0 ? pid : request->pgid);
+
+    for (int i = 0; i < num_fds; i++)
+        close(fds[i]);
+
+    reply.pid = pid;
+    send_reply(sock, &reply);
+
+    if (DEBUGZYGOTE)
+        fprintf(stderr, "zygote: %s -> %d\n", args[0], pid);
+    return 0;
+}
+
+/*  Main loop of the zygote: launches commands requested on SOCK and reports
+    every state change of its children back to the shell. Exits when the
+    shell closes its end.
+ */
+static void zygote_main(int sock)
+{
+    // SIGCHLD is still blocked from the shell (see smallsh_events.c)
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd == -1)
+    {
+        perror("zygote: signalfd()");
+        _exit(EXIT_FAILURE);
+    }
+
+    struct sigaction ignore_action = {0}, default_action = {0};
+    ignore_action.sa_handler = SIG_IGN;
+    sigemptyset(&ignore_action.sa_mask);
+    default_action.sa_handler = SIG_DFL;
+    sigemptyset(&default_action.sa_mask);
+    sigaction(SIGTSTP, &ignore_action, NULL);
+    sigaction(SIGTERM, &default_action, NULL);
+
+    struct pollfd fds[2] = {{sock, POLLIN, 0}, {sigchld_fd, POLLIN, 0}};
+    while (1)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info[16];
+            while (read(sigchld_fd, info, sizeof(info)) > 0)
+                ;
+            struct zygote_reply reply = {0};
+            reply.type = ZYGOTE_CHANGED;
+            while ((reply.pid = wait4(-1, &reply.status, WNOHANG | WUNTRACED | WCONTINUED, &reply.usage)) > 0)
+            {
+                send_reply(sock, &reply);
+                memset(&reply.usage, '\0', sizeof(struct rusage));
+            }
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            if (zygote_handle_request(sock) == -1)
+                _exit(EXIT_SUCCESS);
+        }
+        else if (fds[0].revents & (POLLHUP | POLLERR))
+            _exit(EXIT_SUCCESS);
+    }
+}
+
+/*  Forks the zygote: a helper process, made at startup while the shell's
+    image is still small, that launches commands on the shell's behalf. Its
+    children are not children of the shell, so their state changes are sent
+    back over the socket and returned by zygote_reap(). The shell becomes a
+    child subreaper, so if the zygote dies its children are reparented to
+    the shell and reaped as usual. Returns 0 on success, or -1 after printing
+    an error.
+ */
+int zygote_start(void)
+{
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) == -1)
+    {
+        perror("zygote: socketpair()");
+        return -1;
+    }
+
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1)
+        perror("zygote: prctl()");
+
+    zygote_pid = fork();
+    if (zygote_pid == -1)
+    {
+        perror("zygote: fork()");
+        close(socks[0]);
+        close(socks[1]);
+        return -1;
+    }
+    if (zygote_pid == 0)
+    {
+        close(socks[0]);
+        zygote_main(socks[1]);
+    }
+
+    close(socks[1]);
+    zygote_sock = socks[0];
+    return 0;
+}
+
+/*  Returns the shell's end of the socket to the zygote, or -1. It becomes
+    readable when a state change is reported.
+ */
+int zygote_fd(void)
+{
+    return zygote_sock;
+}
+
+/*  Notes that the shell's working directory or environment has changed, so
+    they are sent to the zygote along with the next request.
+ */
+void zygote_context_changed(void)
+{
+    context_changed = 1;
+}
+
+/*  Appends REPLY to the queue of state changes.
+ */
+static void queue_change(const struct zygote_reply *reply)
+{
+    // Grow the ring buffer when full, keeping one slot free
+    if (changes_size == 0 || (changes_tail + 1) % changes_size == changes_head)
+    {
+        size_t new_size = changes_size ? changes_size * 2 : 16;
+        struct zygote_reply *new_changes = malloc(new_size * sizeof(struct zygote_reply));
+        if (new_changes == NULL)
+        {
+            perror("zygote: malloc()");
+            exit(1);
+        }
+        size_t n = 0;
+        for (size_t i = changes_head; i != changes_tail; i = (i + 1) % changes_size)
+            new_changes[n++] = changes[i];
+        free(changes);
+        changes = new_changes;
+        changes_size = new_size;
+        changes_head = 0;
+        changes_tail = n;
+    }
+    changes[changes_tail] = *reply;
+    changes_tail = (changes_tail + 1) % changes_size;
+}
+
+/*  Stops using the zygote after it failed, so commands are launched by the
+    shell itself from now on. The zygote is killed, if still alive, so that
+    its children are handed to the shell (a subreaper), which reaps them.
+ */
+static void zygote_lost(void)
+{
+    fprintf(stderr, "zygote: lost, launching commands directly\n");
+    fflush(stderr);
+    close(zygote_sock);
+    zygote_sock = -1;
+    if (zygote_pid > 0)
+    {
+        kill(zygote_pid, SIGKILL);
+        while (waitpid(zygote_pid, NULL, 0) == -1 && errno == EINTR)
+            ;
+    }
+    zygote_pid = -1;
+}
+
+/*  Asks the zygote to launch STAGE, resolved to CMD_PATH (or NULL to search
+    PATH), as spawn_process() would. Returns the pid, -1 if the zygote could
+    not fork, or ZYGOTE_UNAVAILABLE if the request could not be made, in
+    which case the caller should launch the command itself.
+ */
+pid_t zygote_spawn(struct user_input *stage, const char *cmd_path,
+                   int in_fd, int out_fd, int flags, pid_t pgid)
+{
+    // Arguments expanded from wildcards can outnumber what the zygote takes
+    if (zygote_sock == -1 || stage->num_cmd_args > ZYGOTE_MAX_ARGS)
+        return ZYGOTE_UNAVAILABLE;
+
+    // Pack the request
+    static char buf[ZYGOTE_MSG_MAX];
+    struct zygote_request *request = (struct zygote_request *)buf;
+    request->flags = flags;
+    request->pgid = pgid;
+    request->num_args = stage->num_cmd_args;
+    request->has_in_fd = in_fd != -1;
+    request->has_out_fd = out_fd != -1;
+    request->num_env = -1;
+
+    size_t len = sizeof(struct zygote_request);
+    const char *path = cmd_path ? cmd_path : "";
+    for (int i = -1; i < stage->num_cmd_args; i++)
+    {
+        const char *str = i == -1 ? path : stage->cmd_args[i];
+        size_t str_len = strlen(str) + 1;
+        if (len + str_len > sizeof(buf))
+            return ZYGOTE_UNAVAILABLE;
+        memcpy(buf + len, str, str_len);
+        len += str_len;
+    }
+
+    // Send the working directory and environment if they have changed
+    int cwd_fd = -1;
+    if (context_changed)
+    {
+        request->num_env = 0;
+        for (char **env = environ; *env; env++)
+        {
+            size_t str_len = strlen(*env) + 1;
+            if (len + str_len > sizeof(buf))
+                return ZYGOTE_UNAVAILABLE;
+            memcpy(buf + len, *env, str_len);
+            len += str_len;
+            request->num_env++;
+        }
+        cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    struct iovec iov = {buf, len};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    // Attach the descriptors for stdin and stdout
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    int fds[3];
+    int num_fds = 0;
+    if (in_fd != -1)
+        fds[num_fds++] = in_fd;
+    if (out_fd != -1)
+        fds[num_fds++] = out_fd;
+    if (cwd_fd != -1)
+        fds[num_fds++] = cwd_fd;
+    if (num_fds > 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+    }
+
+    ssize_t sent;
+    while ((sent = sendmsg(zygote_sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        ;
+    if (cwd_fd != -1)
+        close(cwd_fd);
+    if (sent != -1)
+        context_changed = 0;
+    if (sent == -1)
+    {
+        zygote_lost();
+        return ZYGOTE_UNAVAILABLE;
+    }
+
+    // Wait for the answer, keeping state changes that arrive before it
+    while (1)
+    {
+        struct zygote_reply reply;
+        ssize_t n = recv(zygote_sock, &reply, sizeof(reply), 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n != sizeof(reply))
+        {
+            // The command may or may not have been launched. If it was, it
+            // is reparented to the shell and reaped as usual.
+            zygote_lost();
+            return -1;
+        }
+        if (reply.type == ZYGOTE_CHANGED)
+        {
+            queue_change(&reply);
+            continue;
+        }
+
+        if (reply.pid == -1)
+        {
+            fprintf(stderr, "zygote: fork(): %s: %s\n", stage->cmd, strerror(reply.status));
+            fflush(stderr);
+        }
+        return reply.pid;
+    }
+}
+
+/*  Stores in *PID, *STATUS and *USAGE (if not NULL) the next state change of
+    a child of the zygote, and returns 1. Returns 0 if there is none. Never
+    blocks.
+ */
+int zygote_reap(pid_t *pid, int *status, struct rusage *usage)
+{
+    struct zygote_reply reply;
+    if (changes_head != changes_tail)
+    {
+        reply = changes[changes_head];
+        changes_head = (changes_head + 1) % changes_size;
+    }
+    else
+    {
+        if (zygote_sock == -1)
+            return 0;
+        ssize_t n = recv(zygote_sock, &reply, sizeof(reply), MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        if (n != sizeof(reply) || reply.type != ZYGOTE_CHANGED)
+        {
+            zygote_lost();
+            return 0;
+        }
+    }
+
+    *pid = reply.pid;
+    *status = reply.status;
+    if (usage)
+        *usage = reply.usage;
+    return 1;
+}
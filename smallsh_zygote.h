@@ -0,0 +1,19 @@
+#ifndef SMALLSH_ZYGOTE_H
+#define SMALLSH_ZYGOTE_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "smallsh.h"
+
+// Returned by zygote_spawn() when the request could not be handed to the
+// zygote, so the caller should launch the command itself
+#define ZYGOTE_UNAVAILABLE -2
+
+int zygote_start(void);
+int zygote_fd(void);
+void zygote_context_changed(void);
+pid_t zygote_spawn(struct user_input *stage, const char *cmd_path,
+                   int in_fd, int out_fd, int flags, pid_t pgid);
+int zygote_reap(pid_t *pid, int *status, struct rusage *usage);
+
+#endif
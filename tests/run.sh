@@ -0,0 +1,191 @@
+#!/bin/bash
+# Regression tests of the shell, run on ./smallsh (or SHELL_UNDER_TEST) in
+# batch mode. Prints each failure and exits 1 if any test failed.
+# Run from the repository root after ./compile.sh: bash tests/run.sh
+
+SH=${SHELL_UNDER_TEST:-./smallsh}
+SH=$(realpath "$SH")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+export SMALLSH_CACHE_DIR="$WORK/cache"
+failures=0
+
+# check NAME EXPECTED SCRIPT [ENV...]
+# Runs SCRIPT with the shell in $WORK, for at most 30 seconds, and compares
+# its output with EXPECTED
+check()
+{
+    local name=$1 expected=$2 script=$3
+    shift 3
+    printf '%s\n' "$script" > "$WORK/script"
+    local output
+    (cd "$WORK" && timeout -k 5 30 env "$@" "$SH" script > "$WORK/output" 2>&1)
+    output=$(cat "$WORK/output")
+    if [ "$output" != "$expected" ]
+    then
+        echo "FAIL: $name"
+        echo "  expected: $(printf '%q' "$expected")"
+        echo "  got:      $(printf '%q' "$output")"
+        failures=$((failures + 1))
+    fi
+}
+
+# An executable without a "#!" line is run by /bin/sh on every engine
+printf 'echo hi from noshebang $1\n' > "$WORK/noshebang"
+chmod +x "$WORK/noshebang"
+for engine in spawn fork zygote
+do
+    check "no shebang ($engine)" "hi from noshebang arg
+status 0" './noshebang arg
+echo status $?' SMALLSH_SPAWN=$engine
+done
+
+# A remembered command path that stops working is searched for again, and
+# the new path replaces it, on every engine
+mkdir -p "$WORK/bin1" "$WORK/bin2"
+printf 'movedtool\nmv bin1/movedtool bin2/movedtool\nmovedtool\nhash\n' > "$WORK/script"
+for engine in spawn fork zygote
+do
+    printf '#!/bin/sh\necho tool\n' > "$WORK/bin1/movedtool"
+    chmod +x "$WORK/bin1/movedtool"
+    rm -f "$WORK/bin2/movedtool"
+    output=$(cd "$WORK" && SMALLSH_SPAWN=$engine PATH="$WORK/bin1:$WORK/bin2:$PATH" "$SH" script 2>&1)
+    if [ "$(echo "$output" | grep -c '^tool$')" != 2 ] ||
+       ! echo "$output" | grep -q "bin2/movedtool" || echo "$output" | grep -q "bin1/movedtool"
+    then
+        echo "FAIL: moved command ($engine)"
+        echo "  got: $(printf '%q' "$output")"
+        failures=$((failures + 1))
+    fi
+done
+
+# parallel refuses to run in the background
+check "parallel &" "parallel: cannot run in the background
+status 1" 'parallel echo ::: a b &
+echo status $?'
+
+# The status of enable and history is the foreground status
+check "enable status" "enable: nosuch: not an in-process built-in
+status 1
+status 0" 'enable nosuch
+echo status $?
+enable echo
+echo status $?'
+
+check "export and unset status" "export: '1x=y': not a valid identifier
+status 1
+status 0
+status 0" 'export 1x=y
+echo status $?
+export X=y
+echo status $?
+unset X
+echo status $?'
+
+check "cached shell built-in" "cached: cd: is a shell built-in
+status 1" 'cached cd /
+echo status $?'
+
+check "cached background command" "cached: cannot run in the background
+status 1" 'cached sleep 0 &
+echo status $?'
+
+check "cached in-process built-in" "hello
+status 0
+hello
+status 0" 'cached echo hello
+echo status $?
+cached echo hello
+echo status $?'
+
+# A compiled script is a record of the cache index, reused on the next run
+# and subject to the size cap like the cached outputs
+printf 'echo compiled $HOME\n' > "$WORK/script"
+for cap in 256M 16
+do
+    rm -rf "$WORK/scriptcache"
+    expected=1
+    [ $cap = 16 ] && expected=0
+    for run in 1 2
+    do
+        output=$(cd "$WORK" && SMALLSH_SCRIPT_CACHE=1 SMALLSH_CACHE_DIR="$WORK/scriptcache" \
+                 SMALLSH_CACHE_SIZE=$cap "$SH" script 2>&1)
+    done
+    stored=$(ls "$WORK/scriptcache" | grep -vc '^index$')
+    if [ "$output" != "compiled $HOME" ] || [ "$stored" != $expected ]
+    then
+        echo "FAIL: script cache (cap $cap)"
+        echo "  got: $(printf '%q' "$output"), $stored stored"
+        failures=$((failures + 1))
+    fi
+done
+
+# A parallel task that is stopped is continued instead of hanging the shell
+printf '#!/bin/sh\nkill -STOP $$\necho resumed $1\n' > "$WORK/stopself"
+chmod +x "$WORK/stopself"
+check "parallel stopped task" "resumed a
+status 0" 'parallel ./stopself ::: a
+echo status $?'
+
+# The zygote's children see the environment as it was last changed
+check "zygote environment" "one
+two
+two" 'export ZYGOTE_VAR=one
+printenv ZYGOTE_VAR
+export ZYGOTE_VAR=two
+printenv ZYGOTE_VAR
+cd /
+printenv ZYGOTE_VAR' SMALLSH_SPAWN=zygote
+
+# parallel, like every built-in, clears the timings of the previous command
+printf 'sleep 0.2\nparallel true ::: a\nstatus -v\n' > "$WORK/script"
+output=$(cd "$WORK" && timeout -k 5 30 "$SH" script 2>&1)
+if ! echo "$output" | grep -q "^real	0m0.000s$"
+then
+    echo "FAIL: parallel status timings"
+    echo "  got: $(printf '%q' "$output")"
+    failures=$((failures + 1))
+fi
+
+# A limit that overflows with its K, M or G suffix is rejected
+check "limit overflow" "limit: invalid limits 'as=99999999999G'
+ok" 'limit as=99999999999G echo wrapped
+limit as=1G echo ok'
+
+# An invalid cache size is reported, and the default size used
+for size in abc 10X 99999999999G
+do
+    check "cache size $size" "cached: SMALLSH_CACHE_SIZE: invalid size '$size'
+hi
+hi" 'cached echo hi
+cached echo hi' SMALLSH_CACHE_SIZE=$size SMALLSH_CACHE_DIR="$WORK/sizecache"
+done
+
+# Scripts are only compiled when asked for, and a compiled script whose line
+# records point outside it is compiled again instead of being used
+printf 'echo compiled $HOME\n' > "$WORK/script"
+rm -rf "$WORK/scriptcache"
+output=$(cd "$WORK" && SMALLSH_CACHE_DIR="$WORK/scriptcache" "$SH" script 2>&1)
+if [ -e "$WORK/scriptcache" ]
+then
+    echo "FAIL: script cache off by default"
+    failures=$((failures + 1))
+fi
+SMALLSH_SCRIPT_CACHE=1 SMALLSH_CACHE_DIR="$WORK/scriptcache" "$SH" "$WORK/script" > /dev/null 2>&1
+blob=$(ls "$WORK/scriptcache" | grep -v '^index$')
+# first_token of the first line record, after the 48-byte header
+printf '\377\377\377\177' | dd of="$WORK/scriptcache/$blob" bs=1 seek=60 conv=notrunc 2> /dev/null
+output=$(cd "$WORK" && SMALLSH_SCRIPT_CACHE=1 SMALLSH_CACHE_DIR="$WORK/scriptcache" "$SH" script 2>&1)
+if [ "$output" != "compiled $HOME" ]
+then
+    echo "FAIL: corrupt compiled script"
+    echo "  got: $(printf '%q' "$output")"
+    failures=$((failures + 1))
+fi
+
+if [ $failures -ne 0 ]
+then
+    echo "$failures test(s) failed"
+    exit 1
+fi
+echo "all tests passed"